@@ -0,0 +1,668 @@
+#include "amr.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+//ldoc on
+/**
+ * ## Implementation
+ *
+ * ### Patches
+ *
+ * Each patch is stepped like a block of the distributed memory solver:
+ * we fill its ghost cells, take a step pair into a second array with
+ * `central2d_step_block`, and swap the arrays.  After the swap, the
+ * second array holds the solution at the start of the step pair, which
+ * is what the next level up needs to interpolate its ghost cells in
+ * time.  The base solver is treated as the one patch on level 0.
+ */
+
+static
+void amr_patch_setup(amr_patch_t* p, central2d_t* sim, int x0, int y0)
+{
+    p->sim = sim;
+    p->u0 = sim->u;
+    p->w = central2d_alloc_array(sim);
+    p->x0 = x0;
+    p->y0 = y0;
+    p->ring = NULL;
+    p->cring = NULL;
+}
+
+
+static
+amr_patch_t* amr_patch_new(amr_t* amr, int l, int bx, int by)
+{
+    central2d_t* base = amr->base;
+    int b = amr->block;
+    float dx = base->dx / (1 << l);
+    float dy = base->dy / (1 << l);
+    central2d_t* sim = central2d_init_layout(b*dx, b*dy, b, b, base->nfield,
+                                             base->flux, base->speed,
+                                             base->cfl, base->layout);
+    sim->dx = dx;
+    sim->dy = dy;
+    central2d_set_engine(sim, base->engine);
+    central2d_set_kernels(sim, base->kernels);
+    amr_patch_t* p = (amr_patch_t*) malloc(sizeof(amr_patch_t));
+    amr_patch_setup(p, sim, bx*b, by*b);
+    p->ring = (double*) calloc(4*b * sim->nfield, sizeof(double));
+    p->cring = (double*) calloc(2*b * sim->nfield, sizeof(double));
+    return p;
+}
+
+
+static
+void amr_patch_free(amr_patch_t* p)
+{
+    central2d_t* sim = p->sim;
+    if (sim->u != p->u0) {
+        p->w = sim->u;
+        sim->u = p->u0;
+    }
+    central2d_free_array(sim, p->w);
+    central2d_free(sim);
+    free(p->cring);
+    free(p->ring);
+    free(p);
+}
+
+
+static
+void amr_patch_step(amr_patch_t* p, float dt)
+{
+    central2d_t* sim = p->sim;
+    float* w = p->w;
+    central2d_step_block(sim, w, 0, 0, sim->nx, sim->ny, dt);
+    p->w = sim->u;
+    sim->u = w;
+}
+
+
+amr_t* amr_init(central2d_t* base, int nlevel, int block, float threshold,
+                int regrid_every)
+{
+    assert(nlevel >= 1 && nlevel <= AMR_MAXLEVEL);
+    assert(block >= 8 && block % 2 == 0);
+    assert(nlevel == 1 ||
+           (base->nx % (block/2) == 0 && base->ny % (block/2) == 0));
+
+    amr_t* amr = (amr_t*) malloc(sizeof(amr_t));
+    amr->base = base;
+    amr->nlevel = nlevel;
+    amr->block = block;
+    amr->threshold = threshold;
+    amr->regrid_every = (regrid_every > 0 ? regrid_every : 1);
+    amr->npair = 0;
+    amr_patch_setup(&amr->root, base, 0, 0);
+
+    for (int l = 0; l < nlevel; ++l) {
+        amr_level_t* lev = amr->level + l;
+        lev->nx = base->nx << l;
+        lev->ny = base->ny << l;
+        lev->nbx = (l > 0 ? lev->nx / block : 1);
+        lev->nby = (l > 0 ? lev->ny / block : 1);
+        lev->npatch = 0;
+        lev->block = (amr_patch_t**) calloc(lev->nbx * lev->nby,
+                                            sizeof(amr_patch_t*));
+        lev->patches = (amr_patch_t**) calloc(lev->nbx * lev->nby,
+                                              sizeof(amr_patch_t*));
+    }
+    return amr;
+}
+
+
+void amr_free(amr_t* amr)
+{
+    for (int l = 0; l < amr->nlevel; ++l) {
+        amr_level_t* lev = amr->level + l;
+        for (int n = 0; n < lev->npatch; ++n)
+            amr_patch_free(lev->patches[n]);
+        free(lev->patches);
+        free(lev->block);
+    }
+
+    // Leave the solution in the base solver's own storage
+    central2d_t* base = amr->base;
+    if (base->u != amr->root.u0) {
+        memcpy(amr->root.u0, base->u, base->array_size * sizeof(float));
+        amr->root.w = base->u;
+        base->u = amr->root.u0;
+    }
+    central2d_free_array(base, amr->root.w);
+    free(amr);
+}
+
+
+/**
+ * ### Sampling the hierarchy
+ *
+ * To fill in ghost cells and new patches, we need values at arbitrary
+ * cells of a level.  A cell that belongs to a patch on its own level
+ * comes straight from the patch (interpolated in time if the caller
+ * asks for a time between the start and the end of the patch's last
+ * step pair: `alpha` is zero at the start and one at the end).  Any
+ * other cell gets a value from the level below by limited linear
+ * interpolation: the coarse value plus a quarter of the limited
+ * difference in each direction, toward the fine cell.  The four fine
+ * cells in a coarse cell then average to the coarse value, so the
+ * interpolation conserves the totals.  The nesting rules in the regrid
+ * make sure that the level below covers the cells we need: the ghost
+ * cells of a patch and their neighbors are within three cells of it on
+ * the level below, so we never have to go down more than one level.
+ */
+
+static inline
+int amr_wrap(int i, int n)
+{
+    return ((i % n) + n) % n;
+}
+
+
+// Patch holding cell (i,j) of level l (or NULL), and the index in it
+static
+amr_patch_t* amr_find(amr_t* amr, int l, int* i, int* j)
+{
+    amr_level_t* lev = amr->level + l;
+    *i = amr_wrap(*i, lev->nx);
+    *j = amr_wrap(*j, lev->ny);
+    if (l == 0)
+        return &amr->root;
+    int b = amr->block;
+    amr_patch_t* p = lev->block[(*j/b)*lev->nbx + *i/b];
+    *i %= b;
+    *j %= b;
+    return p;
+}
+
+
+static
+float amr_sample(amr_t* amr, int l, int i, int j, int k, float alpha)
+{
+    int li = i, lj = j;
+    amr_patch_t* p = amr_find(amr, l, &li, &lj);
+    assert(p);
+    int o = central2d_offset(p->sim, k, li, lj);
+    float u = p->sim->u[o];
+    return (alpha == 1 ? u : (1-alpha)*p->w[o] + alpha*u);
+}
+
+
+// Interpolate cell (i,j) of level l from level l-1
+static
+float amr_interp(amr_t* amr, int l, int i, int j, int k, float alpha)
+{
+    i = amr_wrap(i, amr->level[l].nx);
+    j = amr_wrap(j, amr->level[l].ny);
+    int ci = i/2, cj = j/2;
+    float c = amr_sample(amr, l-1, ci, cj, k, alpha);
+    float sx = central2d_limdiff(amr_sample(amr, l-1, ci-1, cj, k, alpha), c,
+                                 amr_sample(amr, l-1, ci+1, cj, k, alpha));
+    float sy = central2d_limdiff(amr_sample(amr, l-1, ci, cj-1, k, alpha), c,
+                                 amr_sample(amr, l-1, ci, cj+1, k, alpha));
+    return c + (i%2 ? 0.25f : -0.25f) * sx + (j%2 ? 0.25f : -0.25f) * sy;
+}
+
+
+// Fill the ghost cells of a patch on level l >= 1, in the eight parts
+// that lie in each of the neighboring blocks
+static
+void amr_fill_ghosts(amr_t* amr, int l, amr_patch_t* p, float alpha)
+{
+    amr_level_t* lev = amr->level + l;
+    central2d_t* sim = p->sim;
+    int b = amr->block, ng = sim->ng, cs = sim->cell_stride;
+    int bx = p->x0 / b, by = p->y0 / b;
+    for (int dy = -1; dy <= 1; ++dy)
+        for (int dx = -1; dx <= 1; ++dx) {
+            if (dx == 0 && dy == 0)
+                continue;
+            int ix0 = (dx < 0 ? -ng : dx*b), nx = (dx == 0 ? b : ng);
+            int iy0 = (dy < 0 ? -ng : dy*b), ny = (dy == 0 ? b : ng);
+            amr_patch_t* q = lev->block[amr_wrap(by+dy, lev->nby) * lev->nbx +
+                                        amr_wrap(bx+dx, lev->nbx)];
+            for (int k = 0; k < sim->nfield; ++k)
+                for (int iy = iy0; iy < iy0+ny; ++iy) {
+                    float* u = sim->u + central2d_offset(sim, k, ix0, iy);
+                    if (q) {
+                        const float* v = q->sim->u +
+                            central2d_offset(q->sim, k, ix0-dx*b, iy-dy*b);
+                        for (int ix = 0; ix < nx; ++ix)
+                            u[ix*cs] = v[ix*cs];
+                    } else {
+                        for (int ix = 0; ix < nx; ++ix)
+                            u[ix*cs] = amr_interp(amr, l, p->x0+ix0+ix,
+                                                  p->y0+iy, k, alpha);
+                    }
+                }
+        }
+}
+
+
+/**
+ * ### Averaging
+ *
+ * Each patch covers a quarter of a patch (or a block of the base grid)
+ * on the level below, and different patches cover different cells
+ * there, so the patches on a level can be averaged down in parallel.
+ */
+
+static
+void amr_average_level(amr_t* amr, int l)
+{
+    amr_level_t* lev = amr->level + l;
+    #pragma omp parallel for schedule(dynamic)
+    for (int n = 0; n < lev->npatch; ++n) {
+        amr_patch_t* p = lev->patches[n];
+        central2d_t* sim = p->sim;
+        int ci = p->x0/2, cj = p->y0/2;
+        amr_patch_t* q = amr_find(amr, l-1, &ci, &cj);
+        if (!q)
+            continue;
+        for (int k = 0; k < sim->nfield; ++k)
+            for (int iy = 0; iy < sim->ny/2; ++iy)
+                for (int ix = 0; ix < sim->nx/2; ++ix) {
+                    const float* u =
+                        sim->u + central2d_offset(sim, k, 2*ix, 2*iy);
+                    const float* up = u + sim->row_stride;
+                    int cs = sim->cell_stride;
+                    q->sim->u[central2d_offset(q->sim, k, ci+ix, cj+iy)] =
+                        0.25f * ((u[0] + u[cs]) + (up[0] + up[cs]));
+                }
+    }
+}
+
+
+void amr_average(amr_t* amr)
+{
+    for (int l = amr->nlevel-1; l > 0; --l)
+        amr_average_level(amr, l);
+}
+
+
+/**
+ * ### Regridding
+ *
+ * For each level `l` from 1 up, we flag the blocks whose cells at level
+ * `l-1` are rougher than the threshold (this needs the ghost cells at
+ * level `l-1`, so we fill them first), add the blocks next to flagged
+ * blocks, and then drop any flagged block that would not be properly
+ * nested in level `l-1`.  Finally we create patches for
+ * the new blocks and free the patches for blocks that are no longer
+ * flagged.  Since we work up from the base, the flags on each level
+ * come from the new patches on the level below.
+ */
+
+// Is level l (>= 1) refined over cells [i0,i1) x [j0,j1)?
+static
+bool amr_covered(amr_t* amr, int l, int i0, int i1, int j0, int j1)
+{
+    int b = amr->block;
+    for (int j = j0; j < j1+b; j += b)
+        for (int i = i0; i < i1+b; i += b) {
+            int li = (i < i1 ? i : i1-1), lj = (j < j1 ? j : j1-1);
+            if (!amr_find(amr, l, &li, &lj))
+                return false;
+        }
+    return true;
+}
+
+
+static
+void amr_flag(amr_t* amr, int l, bool* flag)
+{
+    amr_level_t* lev = amr->level + l;
+    amr_level_t* below = amr->level + l-1;
+    int b = amr->block, half = b/2;
+
+    // Fill the ghost cells on the level below
+    if (l == 1) {
+        central2d_t* sim = amr->base;
+        central2d_periodic(sim->u, sim->nx, sim->ny, sim->ng, sim->nfield,
+                           sim->row_stride, sim->field_stride,
+                           sim->cell_stride);
+    } else {
+        #pragma omp parallel for schedule(dynamic)
+        for (int n = 0; n < below->npatch; ++n)
+            amr_fill_ghosts(amr, l-1, below->patches[n], 1);
+    }
+
+    // Flag the rough blocks
+    bool* big = (bool*) calloc(lev->nbx * lev->nby, sizeof(bool));
+    #pragma omp parallel for schedule(dynamic)
+    for (int id = 0; id < lev->nbx * lev->nby; ++id) {
+        int ci = (id % lev->nbx) * half, cj = (id / lev->nbx) * half;
+        amr_patch_t* q = amr_find(amr, l-1, &ci, &cj);
+        big[id] = (q && central2d_roughness(q->sim, ci, cj, half, half) >
+                   amr->threshold);
+    }
+
+    // Add the neighbors, and keep the properly nested blocks
+    #pragma omp parallel for schedule(dynamic)
+    for (int id = 0; id < lev->nbx * lev->nby; ++id) {
+        int bx = id % lev->nbx, by = id / lev->nbx;
+        flag[id] = false;
+        for (int dy = -1; dy <= 1 && !flag[id]; ++dy)
+            for (int dx = -1; dx <= 1 && !flag[id]; ++dx)
+                flag[id] = big[amr_wrap(by+dy, lev->nby) * lev->nbx +
+                               amr_wrap(bx+dx, lev->nbx)];
+        if (flag[id] && l > 1)
+            flag[id] = amr_covered(amr, l-1, bx*half-3, (bx+1)*half+3,
+                                   by*half-3, (by+1)*half+3);
+    }
+    free(big);
+}
+
+
+static
+void amr_regrid_level(amr_t* amr, int l, const bool* flag)
+{
+    amr_level_t* lev = amr->level + l;
+    int nblock = lev->nbx * lev->nby;
+
+    // Create the new patches
+    #pragma omp parallel for schedule(dynamic)
+    for (int id = 0; id < nblock; ++id) {
+        if (!flag[id] || lev->block[id])
+            continue;
+        amr_patch_t* p = amr_patch_new(amr, l, id % lev->nbx, id / lev->nbx);
+        central2d_t* sim = p->sim;
+        for (int k = 0; k < sim->nfield; ++k)
+            for (int iy = 0; iy < sim->ny; ++iy)
+                for (int ix = 0; ix < sim->nx; ++ix)
+                    sim->u[central2d_offset(sim, k, ix, iy)] =
+                        amr_interp(amr, l, p->x0+ix, p->y0+iy, k, 1);
+        lev->block[id] = p;
+    }
+
+    // Drop the old ones, and list the patches
+    lev->npatch = 0;
+    for (int id = 0; id < nblock; ++id) {
+        if (lev->block[id] && !flag[id]) {
+            amr_patch_free(lev->block[id]);
+            lev->block[id] = NULL;
+        }
+        if (lev->block[id])
+            lev->patches[lev->npatch++] = lev->block[id];
+    }
+}
+
+
+int amr_regrid(amr_t* amr)
+{
+    int npatch = 0;
+    for (int l = 1; l < amr->nlevel; ++l) {
+        amr_level_t* lev = amr->level + l;
+        bool* flag = (bool*) malloc(lev->nbx * lev->nby * sizeof(bool));
+        amr_flag(amr, l, flag);
+        amr_regrid_level(amr, l, flag);
+        free(flag);
+        npatch += lev->npatch;
+    }
+    amr->npair = 0;
+    return npatch;
+}
+
+
+/**
+ * ### Time stepping
+ *
+ * A step pair on level `l` fills the ghost cells, steps every patch on
+ * the level, and then (if the level above has patches) takes two step
+ * pairs on the level above at half the time step, with ghost cells
+ * interpolated from the start and the middle of the pair on level `l`,
+ * and averages the results back onto level `l`.
+ *
+ * Each patch on level `l+1` keeps two sets of ring sums (see
+ * `central2d_ring_out`): `ring`, for its own edges over its two step
+ * pairs, and `cring`, for the edges of the block it refines, over the
+ * step pair on level `l`.  A staggered cell on level `l` in the ring
+ * of a block lies over the corner of two cells of the block, and the
+ * fine staggered cells along the same edge lie over the same corner
+ * or halfway to the next one, so we give each fine ring cell to the
+ * coarse ring cell at its corner, or half to each of the two on either
+ * side.  Where a staggered cell on level `l` is shared by refined
+ * blocks only, the sums of those blocks cancel on both levels, to
+ * rounding.  Where it is not, what the fine step moved into the
+ * refined blocks (and what the averaging puts into level `l`) differs
+ * from what the coarse step took out of the other cells under it, and
+ * we correct those cells by an equal share of the difference.  The
+ * nesting rules keep these cells on level `l`.  The corrections for
+ * neighboring patches on level `l+1` may touch the same cells, so we
+ * make them in one thread, but there are only as many as there are
+ * cells along the edges.
+ */
+
+// Add to the ring sums of the blocks on level l+1 over patch p on
+// level l what goes through their edges in a step pair on level l
+// (before the pair if !in, after it if in)
+static
+void amr_child_rings(amr_t* amr, int l, amr_patch_t* p, float dt, bool in)
+{
+    amr_level_t* fine = amr->level + l+1;
+    int h = amr->block/2;
+    int bx0 = p->x0/h, by0 = p->y0/h;
+    int nbx = (l == 0 ? fine->nbx : 2), nby = (l == 0 ? fine->nby : 2);
+    for (int by = by0; by < by0+nby; ++by)
+        for (int bx = bx0; bx < bx0+nbx; ++bx) {
+            amr_patch_t* c = fine->block[by*fine->nbx + bx];
+            if (!c)
+                continue;
+            int ix = bx*h - p->x0, iy = by*h - p->y0;
+            if (in)
+                central2d_ring_in(p->sim, ix, iy, h, h, dt, c->cring);
+            else
+                central2d_ring_out(p->sim, ix, iy, h, h, dt, c->cring);
+        }
+}
+
+
+// Blocks (i) of h cells on a level of n cells and their staggered cell
+// indices (b) for the staggered cell over cells ig and ig+1; return
+// how many there are (one, unless the cell straddles an edge)
+static inline
+int amr_ring_images(int ig, int n, int h, int* i, int* b)
+{
+    int i0 = amr_wrap(ig, n), i1 = amr_wrap(ig+1, n);
+    i[0] = i0/h;
+    b[0] = i0 - i[0]*h;
+    i[1] = i1/h;
+    b[1] = i1 - i[1]*h - 1;
+    return (i[0] == i[1] && b[0] == b[1] ? 1 : 2);
+}
+
+
+// What went into patch p through staggered cell (bx,by) in the ring of
+// its block of h by h cells on the level below, on the patch's level
+// (in units of cells of the level below), less what went through it
+// on the level below
+static
+double amr_ring_mismatch(const amr_patch_t* p, int h, int bx, int by, int k)
+{
+    int b = 2*h, nfield = p->sim->nfield;
+    double sum = 0;
+    for (int dy = -1; dy <= 1; ++dy)
+        for (int dx = -1; dx <= 1; ++dx) {
+            int r = central2d_ring_index(2*bx+1+dx, 2*by+1+dy, b, b);
+            if (r >= 0)
+                sum += (dx ? 0.5 : 1) * (dy ? 0.5 : 1) * p->ring[r*nfield+k];
+        }
+    int r = central2d_ring_index(bx, by, h, h);
+    return 0.25*sum - p->cring[r*nfield+k];
+}
+
+
+// Correct the cells of level l next to the edges of level l+1
+static
+void amr_reflux(amr_t* amr, int l)
+{
+    amr_level_t* lev = amr->level + l;
+    amr_level_t* fine = amr->level + l+1;
+    int h = amr->block/2, nfield = amr->base->nfield;
+    for (int n = 0; n < fine->npatch; ++n) {
+        amr_patch_t* p = fine->patches[n];
+        int x0 = p->x0/2, y0 = p->y0/2;
+        for (int by = -1; by < h; ++by)
+            for (int bx = -1; bx < h; ++bx) {
+                if (central2d_ring_index(bx, by, h, h) < 0)
+                    continue;
+
+                // Refined blocks sharing the staggered cell (the first
+                // one makes the correction)
+                int ix[2], iy[2], bxs[2], bys[2], nq = 0;
+                int mx = amr_ring_images(x0+bx, lev->nx, h, ix, bxs);
+                int my = amr_ring_images(y0+by, lev->ny, h, iy, bys);
+                amr_patch_t* q[4];
+                int qx[4], qy[4];
+                for (int a = 0; a < my; ++a)
+                    for (int c = 0; c < mx; ++c) {
+                        q[nq] = fine->block[iy[a]*fine->nbx + ix[c]];
+                        qx[nq] = bxs[c];
+                        qy[nq] = bys[a];
+                        nq += (q[nq] != NULL);
+                    }
+                if (q[0] != p || qx[0] != bx || qy[0] != by)
+                    continue;
+
+                // Cells under the staggered cell not covered by level l+1
+                amr_patch_t* cp[4];
+                int ci[4], cj[4], nc = 0;
+                for (int dy = 0; dy < 2; ++dy)
+                    for (int dx = 0; dx < 2; ++dx) {
+                        int i = amr_wrap(x0+bx+dx, lev->nx);
+                        int j = amr_wrap(y0+by+dy, lev->ny);
+                        if (fine->block[(j/h)*fine->nbx + i/h])
+                            continue;
+                        ci[nc] = i;
+                        cj[nc] = j;
+                        cp[nc] = amr_find(amr, l, ci+nc, cj+nc);
+                        assert(cp[nc]);
+                        ++nc;
+                    }
+                if (nc == 0)
+                    continue;
+
+                for (int k = 0; k < nfield; ++k) {
+                    double sum = 0;
+                    for (int m = 0; m < nq; ++m)
+                        sum += amr_ring_mismatch(q[m], h, qx[m], qy[m], k);
+                    float du = (float) (-sum / nc);
+                    for (int m = 0; m < nc; ++m)
+                        cp[m]->sim->u[central2d_offset(cp[m]->sim, k,
+                                                       ci[m], cj[m])] += du;
+                }
+            }
+    }
+    for (int n = 0; n < fine->npatch; ++n)
+        memset(fine->patches[n]->ring, 0,
+               4*amr->block * nfield * sizeof(double));
+}
+
+
+static
+void amr_advance(amr_t* amr, int l, float dt, float alpha)
+{
+    amr_level_t* lev = amr->level + l;
+    int b = amr->block, nfield = amr->base->nfield;
+    bool refined = (l+1 < amr->nlevel && amr->level[l+1].npatch > 0);
+    if (refined)
+        for (int n = 0; n < amr->level[l+1].npatch; ++n)
+            memset(amr->level[l+1].patches[n]->cring, 0,
+                   2*b * nfield * sizeof(double));
+    if (l == 0) {
+        central2d_t* sim = amr->base;
+        central2d_periodic(sim->u, sim->nx, sim->ny, sim->ng, sim->nfield,
+                           sim->row_stride, sim->field_stride,
+                           sim->cell_stride);
+        if (refined)
+            amr_child_rings(amr, 0, &amr->root, dt, false);
+        amr_patch_step(&amr->root, dt);
+        if (refined)
+            amr_child_rings(amr, 0, &amr->root, dt, true);
+    } else {
+        #pragma omp parallel for schedule(dynamic)
+        for (int n = 0; n < lev->npatch; ++n)
+            amr_fill_ghosts(amr, l, lev->patches[n], alpha);
+        #pragma omp parallel for schedule(dynamic)
+        for (int n = 0; n < lev->npatch; ++n) {
+            amr_patch_t* p = lev->patches[n];
+            central2d_ring_out(p->sim, 0, 0, b, b, dt, p->ring);
+            if (refined)
+                amr_child_rings(amr, l, p, dt, false);
+            amr_patch_step(p, dt);
+            central2d_ring_in(p->sim, 0, 0, b, b, dt, p->ring);
+            if (refined)
+                amr_child_rings(amr, l, p, dt, true);
+        }
+    }
+    if (refined) {
+        amr_advance(amr, l+1, dt/2, 0);
+        amr_advance(amr, l+1, dt/2, 0.5f);
+        amr_average_level(amr, l+1);
+        amr_reflux(amr, l);
+    }
+}
+
+
+// Max wave speeds over all levels (level l takes steps 2^l times
+// shorter on cells 2^l times smaller, so the speeds compare directly)
+static
+void amr_speed(amr_t* amr, float* cxy)
+{
+    central2d_speed(amr->base, cxy);
+    for (int l = 1; l < amr->nlevel; ++l) {
+        amr_level_t* lev = amr->level + l;
+        float cx = 1.0e-15f, cy = 1.0e-15f;
+        #pragma omp parallel for schedule(dynamic) \
+            reduction(max:cx) reduction(max:cy)
+        for (int n = 0; n < lev->npatch; ++n) {
+            float pcxy[2] = {1.0e-15f, 1.0e-15f};
+            central2d_speed(lev->patches[n]->sim, pcxy);
+            cx = fmaxf(cx, pcxy[0]);
+            cy = fmaxf(cy, pcxy[1]);
+        }
+        cxy[0] = fmaxf(cxy[0], cx);
+        cxy[1] = fmaxf(cxy[1], cy);
+    }
+}
+
+
+int amr_run(amr_t* amr, float tfinal)
+{
+    central2d_t* base = amr->base;
+    float dx = base->dx, dy = base->dy, cfl = base->cfl;
+    int nstep = 0;
+    bool done = false;
+    float t = 0;
+    while (!done) {
+        if (amr->npair >= amr->regrid_every)
+            amr_regrid(amr);
+
+        float cxy[2] = {1.0e-15f, 1.0e-15f};
+        amr_speed(amr, cxy);
+        float dt = cfl / fmaxf(cxy[0]/dx, cxy[1]/dy);
+        if (t + 2*dt >= tfinal) {
+            dt = (tfinal-t)/2;
+            done = true;
+        }
+        amr_advance(amr, 0, dt, 1);
+        amr->npair += 1;
+        t += 2*dt;
+        nstep += 2;
+    }
+    return nstep;
+}
+
+
+long amr_cells(const amr_t* amr, int* npatch)
+{
+    long ncell = (long) amr->base->nx * amr->base->ny;
+    int n = 0;
+    for (int l = 1; l < amr->nlevel; ++l)
+        n += amr->level[l].npatch;
+    if (npatch)
+        *npatch = n;
+    return ncell + (long) n * amr->block * amr->block;
+}
@@ -0,0 +1,133 @@
+#ifndef AMR_H
+#define AMR_H
+
+#include "stepper.h"
+
+//ldoc on
+/**
+ * # Adaptive mesh refinement
+ *
+ * A uniform grid fine enough for the fronts in a dam break spends most
+ * of its cells on flat water.  The AMR layer keeps a hierarchy of
+ * grids instead: the base solver (level 0) covers the whole periodic
+ * domain, and each finer level halves the cell size and covers only
+ * the parts of the domain where the solution has structure.
+ *
+ * The refined levels are block structured.  Level `l` is divided into
+ * square blocks of `block` cells on a side (as if it covered the whole
+ * domain, which would take `nx << l` by `ny << l` cells), and each
+ * block that is refined is an ordinary `central2d_t` with its own ghost
+ * cells, called a patch.  A block at level `l` covers a quarter of a
+ * block at level `l-1` (or `block/2` by `block/2` cells of the base
+ * grid at level 1), so the base grid size must be a multiple of
+ * `block/2`.  A block is refined only where the block containing it at
+ * the level below is refined, and the blocks at that level within
+ * three of its cells must be refined too, so every patch sits well
+ * inside the level below.
+ *
+ * Cell `(i,j)` of level `l` is the cell with lower left corner at
+ * `(i*dx, j*dy)` for the level's cell sizes, so patch cell `(ix,iy)`
+ * (in the sense of `central2d_offset`) is level cell `(x0+ix, y0+iy)`.
+ */
+
+#define AMR_MAXLEVEL 8
+
+typedef struct amr_patch_t {
+    central2d_t* sim;  // Solver for the block
+    float* w;          // Second copy of the solution (swapped in steps)
+    float* u0;         // Original storage of sim->u
+    int x0, y0;        // Level cell index of the first real cell
+    double* ring;      // Ring sums on the patch's level (for refluxing)
+    double* cring;     // Ring sums of the block on the level below
+} amr_patch_t;
+
+typedef struct amr_level_t {
+    int nx, ny;              // Level size in cells
+    int nbx, nby;            // Level size in blocks
+    int npatch;              // Number of refined blocks
+    amr_patch_t** block;     // Patch for each block (NULL if unrefined)
+    amr_patch_t** patches;   // The npatch patches
+} amr_level_t;
+
+typedef struct amr_t {
+    central2d_t* base;       // Level 0 solver
+    amr_patch_t root;        // Level 0 as a patch
+    int nlevel;              // Number of levels (including the base)
+    int block;               // Block size in cells
+    float threshold;         // Refinement threshold
+    int regrid_every;        // Base step pairs between regrids
+    int npair;               // Base step pairs since the last regrid
+    amr_level_t level[AMR_MAXLEVEL];
+} amr_t;
+
+/**
+ * `amr_init` builds a hierarchy of `nlevel` levels (at most
+ * `AMR_MAXLEVEL`) over the `base` solver, which stays owned by the
+ * caller, with no refined blocks yet.  The patches use the base
+ * solver's physics, layout, step engine, and kernels.  A block at
+ * level `l` is refined when the largest limited difference or jump
+ * between cells (see `central2d_roughness`) over the cells it covers
+ * at level `l-1` is more than `threshold`, and also when any of the
+ * blocks next to it is; the extra layer of blocks keeps fronts inside
+ * the refined region until the next regrid, which comes every
+ * `regrid_every` step pairs of the base grid.  `amr_free` frees the
+ * patches (but not the base solver).
+ */
+amr_t* amr_init(central2d_t* base, int nlevel, int block, float threshold,
+                int regrid_every);
+void amr_free(amr_t* amr);
+
+/**
+ * `amr_regrid` chooses the refined blocks on every level from the
+ * current solution, level by level from the coarsest.  New patches get
+ * their values by conservative limited linear interpolation from the
+ * level below, and patches that are no longer needed are dropped (the
+ * level below already has their averages).  It returns the total
+ * number of patches.  To start a run at the full resolution, we can
+ * call `amr_regrid` once for each refined level, setting the initial
+ * condition on all the patches after each call (as with `init_cells`
+ * at the patch's offset) and then calling `amr_average`, which
+ * replaces each cell covered by a finer level with the average of the
+ * four cells above it, from the finest level down.
+ */
+int amr_regrid(amr_t* amr);
+void amr_average(amr_t* amr);
+
+/**
+ * `amr_run` is the counterpart of `central2d_run`: it advances the
+ * hierarchy by time `tfinal` and returns the number of steps taken on
+ * the base grid.  Each level takes two step pairs for every step pair
+ * of the level below, at half the time step, so the time step is set
+ * by the largest wave speed on any level relative to the base cell
+ * size.  Ghost cells come from neighboring patches on the same level
+ * where there are any, and otherwise by interpolation from the level
+ * below (linear in time between the start and end of its step pair).
+ * After the finer levels catch up, they are averaged onto the level
+ * below, so the base solver always holds the solution averaged to the
+ * base resolution, which is what the driver writes out and checks.
+ *
+ * The fine and coarse steps do not agree on what goes through the
+ * edges of a refined region, so after the averaging, we reflux: the
+ * coarse cells just outside the region are corrected by the difference
+ * between what went through the edges on the finer level, added up
+ * over its two step pairs, and what went through them on the coarse
+ * level (see `central2d_ring_out`).  The totals on the base grid are
+ * then conserved to rounding.
+ *
+ * Even where all the cells are refined, the result is not the same as
+ * that of a uniform grid at the finest resolution, since the time
+ * steps differ: the finest level takes `2^(nlevel-1)` step pairs of
+ * equal length for each base step pair, all sized for the wave speeds
+ * at the start of the base pair, where the uniform grid picks a new
+ * time step for each pair.
+ */
+int amr_run(amr_t* amr, float tfinal);
+
+/**
+ * `amr_cells` returns the number of real cells on all levels and sets
+ * `*npatch` (if not `NULL`) to the number of patches.
+ */
+long amr_cells(const amr_t* amr, int* npatch);
+
+//ldoc off
+#endif /* AMR_H */
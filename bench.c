@@ -0,0 +1,550 @@
+#define _POSIX_C_SOURCE 200809L  // For clock_gettime and getopt
+#include "stepper.h"
+#include "shallow2d.h"
+#include "simd.h"
+#include "initcond.h"
+#include "profile.h"
+
+// Kernels for the shallow water equations (as in shallow2d.c)
+#define KERNEL_NFIELD 3
+#define KERNEL_FLUX(FU, GU, U, ncell, fs, cs) \
+    shallow2d_flux(FU, GU, U, ncell, fs, cs)
+#include "stepper_kernels.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+//ldoc on
+/**
+ * # Benchmarks
+ *
+ * The Lua driver measures whole runs, which makes it awkward to tell
+ * whether a change to one kernel made it faster.  This program times
+ * the limiters, the shallow water flux and speed functions, the
+ * predictor and corrector, and whole runs with each step engine, for
+ * a range of grid sizes (from grids that fit in the L1 cache to grids
+ * that only fit in main memory), with no Lua in sight.  The usage is
+ *
+ *     shallow-bench [-n nx,...] [-k kernel,...] [-r reps] [-w warmup]
+ *                   [-t seconds] [-p peak] [-s simd] [-o file.csv]
+ *
+ * where `-n` lists the grid sizes (each grid is `nx` by `nx`), `-k`
+ * lists the kernels to time (all of them by default; see the table
+ * below), `-r` and `-w` set the number of timed and warmup repetitions,
+ * and `-t` sets the minimum time for one repetition.  Each repetition
+ * calls the kernel enough times (over the whole grid) to take at least
+ * that long, and we report statistics of the time per cell over the
+ * repetitions.  `-s` selects the vector kernels as in `simd.h`, and
+ * `-o` also writes the results to a CSV file.
+ *
+ * Each kernel has a cost model (the operations and bytes per cell; we
+ * use the same counts as the phase timing in `profile.h`), from which
+ * we get GFLOP/s, GB/s, and the arithmetic intensity.  For the roofline
+ * comparison, we time a STREAM-style triad over the same amount of
+ * memory as each kernel works on (the solver arrays that it reads or
+ * writes) at each grid size, so that the triad sees the same level of
+ * the memory hierarchy as the kernel.  The bound is the intensity times
+ * the triad bandwidth, capped by the peak rate given with `-p` (in
+ * GFLOP/s) if there is one, and the last column is the achieved rate
+ * as a fraction of that bound.  The bound is only as good as the triad
+ * is a model of the kernel's memory traffic: a kernel that mostly
+ * reads, or whose stores stay in cache (like the limiters, which write
+ * to one row of scratch space), can move more bytes per second than the
+ * triad, and so go past 100%.
+ */
+
+typedef struct bench_opts_t {
+    int reps;          // Timed repetitions
+    int warmup;        // Untimed repetitions
+    double min_time;   // Minimum seconds per repetition
+    double peak;       // Peak GFLOP/s (or zero)
+} bench_opts_t;
+
+
+static
+double bench_wtime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+
+/**
+ * ## Kernels
+ *
+ * Each kernel sweeps over the whole grid of a solver once and returns
+ * the number of cells it processed.  The solver starts from the dam
+ * break initial conditions, with the ghost cells filled and the fluxes
+ * computed so that the predictor and corrector see sensible inputs.
+ * The kernels other than the runs do not change `u`, `f`, or `g`, so
+ * every call does the same work.  The limiters write to a row of
+ * scratch space for each row and field.
+ */
+
+static volatile float bench_sink;
+
+static
+double bench_deriv1(central2d_t* sim)
+{
+    int nx_all = sim->nx + 2*sim->ng, ny_all = sim->ny + 2*sim->ng;
+    int s = sim->row_stride, fs = sim->field_stride, cs = sim->cell_stride;
+    for (int k = 0; k < 3; ++k)
+        for (int iy = 1; iy < ny_all-1; ++iy)
+            limited_deriv1(sim->scratch+1, sim->u + k*fs + iy*s + cs,
+                           nx_all-2, cs);
+    return (nx_all-2.0) * (ny_all-2);
+}
+
+
+static
+double bench_derivk(central2d_t* sim)
+{
+    int nx_all = sim->nx + 2*sim->ng, ny_all = sim->ny + 2*sim->ng;
+    int s = sim->row_stride, fs = sim->field_stride, cs = sim->cell_stride;
+    for (int k = 0; k < 3; ++k)
+        for (int iy = 1; iy < ny_all-1; ++iy)
+            limited_derivk(sim->scratch+1, sim->u + k*fs + iy*s + cs,
+                           nx_all-2, s, cs);
+    return (nx_all-2.0) * (ny_all-2);
+}
+
+
+static
+double bench_flux(central2d_t* sim)
+{
+    int nx_all = sim->nx + 2*sim->ng, ny_all = sim->ny + 2*sim->ng;
+    int s = sim->row_stride, fs = sim->field_stride, cs = sim->cell_stride;
+    for (int iy = 0; iy < ny_all; ++iy)
+        shallow2d_flux(sim->f + iy*s, sim->g + iy*s, sim->u + iy*s,
+                       nx_all, fs, cs);
+    return (double) nx_all * ny_all;
+}
+
+
+static
+double bench_speed(central2d_t* sim)
+{
+    int nx_all = sim->nx + 2*sim->ng, ny_all = sim->ny + 2*sim->ng;
+    int s = sim->row_stride, fs = sim->field_stride, cs = sim->cell_stride;
+    float cxy[2] = {1.0e-15f, 1.0e-15f};
+    for (int iy = 0; iy < ny_all; ++iy)
+        shallow2d_speed(cxy, sim->u + iy*s, nx_all, fs, cs);
+    bench_sink = cxy[0] + cxy[1];
+    return (double) nx_all * ny_all;
+}
+
+
+static
+double bench_predict(central2d_t* sim)
+{
+    int nx_all = sim->nx + 2*sim->ng, ny_all = sim->ny + 2*sim->ng;
+    float dtcdx2 = 0.01f, dtcdy2 = 0.01f;
+    central2d_predict(sim->v, sim->scratch, sim->u, sim->f, sim->g,
+                      dtcdx2, dtcdy2, nx_all, ny_all,
+                      sim->row_stride, sim->field_stride, sim->cell_stride,
+                      3);
+    return (nx_all-2.0) * (ny_all-2);
+}
+
+
+static
+double bench_correct(central2d_t* sim)
+{
+    int nx = sim->nx, ny = sim->ny, ng = sim->ng;
+    float dtcdx2 = 0.01f, dtcdy2 = 0.01f;
+    central2d_correct(sim->v, sim->scratch, sim->u, sim->f, sim->g,
+                      dtcdx2, dtcdy2, ng, nx+ng, ng, ny+ng,
+                      nx + 2*ng, ny + 2*ng,
+                      sim->row_stride, sim->field_stride, sim->cell_stride,
+                      3);
+    return (double) nx * ny;
+}
+
+
+/**
+ * The runs advance for about two step pairs (at the initial wave
+ * speed of the dam break) and count cell steps.  They use the step
+ * functions compiled here, which are the same as `shallow2d_kernels`,
+ * except for the device engine, which only `shallow2d_kernels` has.
+ * The solution stays on the device between the device runs, as it does
+ * between the frames of a driver run.
+ */
+
+static const central2d_kernels_t bench_kernels = {
+    3, shallow2d_flux,
+    central2d_step, central2d_step_fluxed, central2d_step_fused,
+    central2d_step_fused16, central2d_step_fused_diag, NULL
+};
+
+
+static
+double bench_run(central2d_t* sim)
+{
+    float tfinal = 4 * sim->cfl * sim->dx / 4.0f;
+    int nstep = central2d_run(sim, tfinal);
+    return (double) nstep * sim->nx * sim->ny;
+}
+
+
+static
+void bench_setup_reference(central2d_t* sim)
+{
+    central2d_set_engine(sim, CENTRAL2D_REFERENCE);
+    central2d_set_flux_speed(sim, shallow2d_flux_speed);
+}
+
+
+static
+void bench_setup_fused(central2d_t* sim)
+{
+    central2d_set_engine(sim, CENTRAL2D_FUSED);
+}
+
+
+static
+void bench_setup_device(central2d_t* sim)
+{
+    central2d_set_kernels(sim, &shallow2d_kernels);
+    central2d_set_engine(sim, CENTRAL2D_DEVICE);
+}
+
+
+/**
+ * The table gives each kernel a name, an optional setup function, the
+ * phase whose cost model applies, and the number of solution-sized
+ * arrays it works on (for the triad).  The limiters have a model of
+ * their own: nine operations and a load and a store per value.
+ */
+
+typedef struct bench_kernel_t {
+    const char* name;
+    double (*run)(central2d_t* sim);
+    void (*setup)(central2d_t* sim);
+    int phase;       // Phase for the cost model (or -1)
+    int narray;      // Solution-sized arrays read or written
+} bench_kernel_t;
+
+static const bench_kernel_t bench_table[] = {
+    {"deriv1",    bench_deriv1,  NULL, -1, 1},
+    {"derivk",    bench_derivk,  NULL, -1, 1},
+    {"flux",      bench_flux,    NULL, PROFILE_FLUX, 3},
+    {"speed",     bench_speed,   NULL, PROFILE_SPEED, 1},
+    {"predict",   bench_predict, NULL, PROFILE_PREDICT, 4},
+    {"correct",   bench_correct, NULL, PROFILE_CORRECT, 4},
+    {"run",       bench_run,     bench_setup_reference, PROFILE_STEP, 4},
+    {"run_fused", bench_run,     bench_setup_fused,     PROFILE_STEP, 4},
+    {"run_device", bench_run,    bench_setup_device,    PROFILE_STEP, 4}
+};
+
+#define BENCH_NKERNEL ((int) (sizeof(bench_table) / sizeof(bench_table[0])))
+
+
+static
+void bench_cost(const bench_kernel_t* kernel, double* flops, double* bytes)
+{
+    if (kernel->phase < 0) {
+        *flops = 3*9;
+        *bytes = 2*3*4;
+    } else {
+        profile_cost((profile_phase_t) kernel->phase, flops, bytes);
+    }
+}
+
+
+static
+central2d_t* bench_sim(int nx, const bench_kernel_t* kernel)
+{
+    central2d_t* sim = central2d_init(2.0, 2.0, nx, nx, 3,
+                                      shallow2d_flux, shallow2d_speed, 0.45);
+    central2d_set_kernels(sim, &bench_kernels);
+    if (kernel && kernel->setup)
+        kernel->setup(sim);
+    init_cells(sim, init_lookup("dam"), 0, 0);
+    central2d_periodic(sim->u, sim->nx, sim->ny, sim->ng, sim->nfield,
+                       sim->row_stride, sim->field_stride, sim->cell_stride);
+    bench_flux(sim);
+
+    // Write the scratch row the limiters use (and a vector beyond it)
+    // before timing.  The masked vector stores at the end of a row are
+    // several times slower if the masked-off lanes reach a page that
+    // has not been written yet, which depended on what the heap had
+    // done with the memory before, and so on the order of the kernels.
+    memset(sim->scratch, 0, (sim->nx + 2*sim->ng + 16) * sizeof(float));
+    return sim;
+}
+
+
+/**
+ * ## Timing and statistics
+ *
+ * The warmup repetitions also pick the number of calls per repetition:
+ * we double it until a repetition takes at least the minimum time.
+ */
+
+typedef struct bench_stats_t {
+    int inner;                        // Calls per repetition
+    double min, median, mean, sd;     // Seconds per cell
+} bench_stats_t;
+
+
+static
+int bench_compare(const void* a, const void* b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+
+static
+void bench_time(bench_stats_t* stats, double (*run)(void* ctx), void* ctx,
+                const bench_opts_t* opts)
+{
+    int inner = 1;
+    for (int i = 0; i < opts->warmup || i == 0; ++i) {
+        for (;;) {
+            double t0 = bench_wtime();
+            for (int j = 0; j < inner; ++j)
+                run(ctx);
+            if (bench_wtime()-t0 >= opts->min_time || inner >= (1 << 20))
+                break;
+            inner *= 2;
+        }
+    }
+
+    double* samples = (double*) malloc(opts->reps * sizeof(double));
+    for (int i = 0; i < opts->reps; ++i) {
+        double ncell = 0;
+        double t0 = bench_wtime();
+        for (int j = 0; j < inner; ++j)
+            ncell += run(ctx);
+        samples[i] = (bench_wtime()-t0) / ncell;
+    }
+    qsort(samples, opts->reps, sizeof(double), bench_compare);
+
+    double sum = 0, sum2 = 0;
+    for (int i = 0; i < opts->reps; ++i)
+        sum += samples[i];
+    stats->mean = sum / opts->reps;
+    for (int i = 0; i < opts->reps; ++i)
+        sum2 += (samples[i]-stats->mean) * (samples[i]-stats->mean);
+    stats->sd = (opts->reps > 1 ? sqrt(sum2 / (opts->reps-1)) : 0);
+    stats->min = samples[0];
+    stats->median = (opts->reps % 2 ? samples[opts->reps/2] :
+                     0.5 * (samples[opts->reps/2-1] + samples[opts->reps/2]));
+    stats->inner = inner;
+    free(samples);
+}
+
+
+static
+double bench_kernel_call(void* ctx)
+{
+    void** args = (void**) ctx;
+    const bench_kernel_t* kernel = (const bench_kernel_t*) args[0];
+    return kernel->run((central2d_t*) args[1]);
+}
+
+
+/**
+ * The triad works on three arrays that together are as big as the
+ * solution-sized arrays that a kernel works on, and counts one cell
+ * per element; it reads two values and writes one.
+ */
+
+typedef struct bench_triad_t {
+    size_t n;
+    float* a;
+    float* b;
+    float* c;
+} bench_triad_t;
+
+
+static
+double bench_triad_call(void* ctx)
+{
+    bench_triad_t* tr = (bench_triad_t*) ctx;
+    float* restrict a = tr->a;
+    const float* restrict b = tr->b;
+    const float* restrict c = tr->c;
+    for (size_t i = 0; i < tr->n; ++i)
+        a[i] = b[i] + 3.0f * c[i];
+    return (double) tr->n;
+}
+
+
+static
+double bench_triad(size_t nbytes, const bench_opts_t* opts,
+                   bench_stats_t* stats)
+{
+    bench_triad_t tr;
+    tr.n = nbytes / (3 * sizeof(float));
+    tr.a = (float*) malloc(tr.n * sizeof(float));
+    tr.b = (float*) malloc(tr.n * sizeof(float));
+    tr.c = (float*) malloc(tr.n * sizeof(float));
+    for (size_t i = 0; i < tr.n; ++i) {
+        tr.a[i] = 0;
+        tr.b[i] = 1;
+        tr.c[i] = 2;
+    }
+    bench_time(stats, bench_triad_call, &tr, opts);
+    free(tr.c);
+    free(tr.b);
+    free(tr.a);
+    return 1e-9 * 3 * sizeof(float) / stats->median;
+}
+
+
+/**
+ * ## Output
+ *
+ * Each line of the report has the kernel, the grid size, the size of
+ * the arrays it works on, the statistics (in nanoseconds per cell), the
+ * rates at the median time, the arithmetic intensity, the roofline
+ * bound, and the fraction of the bound achieved.
+ */
+
+static
+void bench_report(FILE* out, FILE* csv, const char* name, int nx,
+                  double mbytes, const bench_stats_t* stats,
+                  double flops, double bytes, double bw, double peak)
+{
+    double gflops = 1e-9 * flops / stats->median;
+    double gbytes = 1e-9 * bytes / stats->median;
+    double ai = (bytes > 0 ? flops / bytes : 0);
+    double roof = ai * bw;
+    if (peak > 0 && (roof > peak || flops == 0))
+        roof = peak;
+    double frac = (roof > 0 && flops > 0 ? gflops / roof : gbytes / bw);
+    fprintf(out, "%-10s %6d %9.2f %7d %8.3f %8.3f %8.3f %7.3f "
+            "%8.2f %8.2f %6.2f %8.2f %6.1f%%\n",
+            name, nx, mbytes, stats->inner,
+            1e9 * stats->min, 1e9 * stats->median, 1e9 * stats->mean,
+            1e9 * stats->sd, gflops, gbytes, ai, roof, 100 * frac);
+    if (csv)
+        fprintf(csv, "%s,%d,%.6g,%d,%.6g,%.6g,%.6g,%.6g,"
+                "%.6g,%.6g,%.6g,%.6g,%.6g\n",
+                name, nx, mbytes, stats->inner,
+                1e9 * stats->min, 1e9 * stats->median, 1e9 * stats->mean,
+                1e9 * stats->sd, gflops, gbytes, ai, roof, frac);
+}
+
+
+/**
+ * ## Main
+ */
+
+static
+int bench_parse_list(const char* list, int* x, int nmax)
+{
+    int n = 0;
+    for (const char* p = list; *p && n < nmax; ) {
+        x[n++] = atoi(p);
+        p += strcspn(p, ",");
+        p += (*p == ',');
+    }
+    return n;
+}
+
+
+static
+bool bench_selected(const char* list, const char* name)
+{
+    if (!list)
+        return true;
+    size_t len = strlen(name);
+    for (const char* p = list; *p; ) {
+        size_t n = strcspn(p, ",");
+        if (n == len && strncmp(p, name, n) == 0)
+            return true;
+        p += n;
+        p += (*p == ',');
+    }
+    return false;
+}
+
+
+int main(int argc, char** argv)
+{
+    int sizes[64] = {64, 128, 256, 512, 1024, 2048};
+    int nsize = 6;
+    const char* kernels = NULL;
+    const char* csv_name = NULL;
+    bench_opts_t opts = {10, 2, 0.01, 0};
+
+    int c;
+    while ((c = getopt(argc, argv, "n:k:r:w:t:p:s:o:")) != -1) {
+        switch (c) {
+        case 'n': nsize = bench_parse_list(optarg, sizes, 64); break;
+        case 'k': kernels = optarg; break;
+        case 'r': opts.reps = atoi(optarg); break;
+        case 'w': opts.warmup = atoi(optarg); break;
+        case 't': opts.min_time = atof(optarg); break;
+        case 'p': opts.peak = atof(optarg); break;
+        case 's': simd_set_level(simd_parse(optarg)); break;
+        case 'o': csv_name = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-n nx,...] [-k kernel,...] "
+                    "[-r reps] [-w warmup] [-t seconds] [-p peak] "
+                    "[-s simd] [-o file.csv]\n", argv[0]);
+            return -1;
+        }
+    }
+    if (opts.reps < 1)
+        opts.reps = 1;
+
+    FILE* csv = NULL;
+    if (csv_name && !(csv = fopen(csv_name, "w"))) {
+        fprintf(stderr, "Could not open %s\n", csv_name);
+        return -1;
+    }
+    if (csv)
+        fprintf(csv, "kernel,nx,mbytes,inner,min_ns,median_ns,mean_ns,sd_ns,"
+                "gflops,gbytes_per_s,intensity,roof_gflops,fraction\n");
+
+    printf("SIMD: %s\n", simd_name(simd_level()));
+    printf("%-10s %6s %9s %7s %8s %8s %8s %7s %8s %8s %6s %8s %7s\n",
+           "kernel", "nx", "MB", "inner", "min_ns", "med_ns", "mean_ns",
+           "sd_ns", "GFLOP/s", "GB/s", "AI", "roof", "%roof");
+    for (int i = 0; i < nsize; ++i) {
+        int nx = sizes[i];
+        if (nx < 8)
+            continue;
+        central2d_t* sim = bench_sim(nx, NULL);
+        size_t array_bytes = (size_t) sim->array_size * sizeof(float);
+        central2d_free(sim);
+
+        // Triad bandwidths by the number of arrays (timed when needed)
+        double bw[5] = {0, 0, 0, 0, 0};
+        bench_stats_t stats;
+        for (int j = 0; j < BENCH_NKERNEL; ++j) {
+            const bench_kernel_t* kernel = bench_table + j;
+            if (!bench_selected(kernels, kernel->name))
+                continue;
+            int narray = kernel->narray;
+            size_t nbytes = narray * array_bytes;
+            double mbytes = nbytes / (1024.0 * 1024.0);
+            if (bw[narray] == 0) {
+                bw[narray] = bench_triad(nbytes, &opts, &stats);
+                bench_report(stdout, csv, "triad", nx, mbytes, &stats,
+                             2, 3*sizeof(float), bw[narray], opts.peak);
+            }
+
+            double flops, bytes;
+            bench_cost(kernel, &flops, &bytes);
+            sim = bench_sim(nx, kernel);
+            void* args[2] = {(void*) kernel, sim};
+            bench_time(&stats, bench_kernel_call, args, &opts);
+            bench_report(stdout, csv, kernel->name, nx, mbytes, &stats,
+                         flops, bytes, bw[narray], opts.peak);
+            central2d_free(sim);
+        }
+        fflush(stdout);
+    }
+    if (csv)
+        fclose(csv);
+    return 0;
+}
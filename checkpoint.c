@@ -0,0 +1,177 @@
+#define _GNU_SOURCE  // For O_DIRECT
+#include "checkpoint.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+//ldoc on
+/**
+ * ## Implementation
+ *
+ * The header is a fixed-size record at the start of the first 4 KB
+ * block, which is otherwise zero.  The checksum is a Fletcher-64 sum
+ * of the data viewed as 32-bit words; it is cheap next to the cost of
+ * the write, and it catches truncated or garbled files.
+ */
+
+#define CHECKPOINT_ALIGN 4096
+
+typedef struct checkpoint_header_t {
+    char magic[8];          // "SWCHKPT1"
+    int32_t nx, ny;         // Grid size (real cells)
+    int32_t nfield;         // Number of fields
+    int32_t frame;          // Frames written
+    double t;               // Simulated time
+    int64_t nstep;          // Steps taken
+    uint64_t nbytes;        // Bytes of data (before padding)
+    uint64_t checksum;      // Fletcher-64 of the data
+} checkpoint_header_t;
+
+
+static
+uint64_t checkpoint_sum(const uint32_t* x, size_t n)
+{
+    uint64_t a = 0, b = 0;
+    for (size_t i = 0; i < n; ++i) {
+        a = (a + x[i]) % 0xffffffff;
+        b = (b + a) % 0xffffffff;
+    }
+    return (b << 32) | a;
+}
+
+
+// Copy the real cells of the solution to or from a contiguous array
+static
+void checkpoint_copy(central2d_t* sim, float* data, bool save)
+{
+    int nx = sim->nx, ny = sim->ny, cs = sim->cell_stride;
+    for (int k = 0; k < sim->nfield; ++k)
+        for (int iy = 0; iy < ny; ++iy) {
+            float* u = sim->u + central2d_offset(sim, k, 0, iy);
+            float* d = data + ((size_t) k*ny + iy)*nx;
+            for (int ix = 0; ix < nx; ++ix) {
+                if (save)
+                    d[ix] = u[ix*cs];
+                else
+                    u[ix*cs] = d[ix];
+            }
+        }
+}
+
+
+static
+int checkpoint_open(const char* fname, bool direct)
+{
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+    if (direct) {
+        int fd = open(fname, flags | O_DIRECT, 0644);
+        if (fd >= 0)
+            return fd;
+    }
+#endif
+    return open(fname, flags, 0644);
+}
+
+
+// Write everything, dropping O_DIRECT if the file system rejects it
+static
+int checkpoint_put(int fd, const char* buf, size_t nbytes)
+{
+    while (nbytes > 0) {
+        ssize_t n = write(fd, buf, nbytes);
+#ifdef O_DIRECT
+        if (n < 0 && errno == EINVAL && (fcntl(fd, F_GETFL) & O_DIRECT)) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+            continue;
+        }
+#endif
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        nbytes -= n;
+    }
+    return 0;
+}
+
+
+int checkpoint_write(central2d_t* sim, const char* fname,
+                     const checkpoint_info_t* info, bool direct)
+{
+    size_t ncell = (size_t) sim->nfield * sim->nx * sim->ny;
+    size_t ndata = ncell * sizeof(float);
+    size_t nbytes = CHECKPOINT_ALIGN +
+        (ndata + CHECKPOINT_ALIGN-1) / CHECKPOINT_ALIGN * CHECKPOINT_ALIGN;
+    char* buf;
+    if (posix_memalign((void**) &buf, CHECKPOINT_ALIGN, nbytes) != 0)
+        return -1;
+    memset(buf, 0, CHECKPOINT_ALIGN);
+    memset(buf + CHECKPOINT_ALIGN + ndata, 0,
+           nbytes - CHECKPOINT_ALIGN - ndata);
+    float* data = (float*) (buf + CHECKPOINT_ALIGN);
+    checkpoint_copy(sim, data, true);
+
+    checkpoint_header_t* h = (checkpoint_header_t*) buf;
+    memcpy(h->magic, "SWCHKPT1", 8);
+    h->nx = sim->nx;
+    h->ny = sim->ny;
+    h->nfield = sim->nfield;
+    h->frame = info->frame;
+    h->t = info->t;
+    h->nstep = info->nstep;
+    h->nbytes = ndata;
+    h->checksum = checkpoint_sum((const uint32_t*) data, ncell);
+
+    char* tmpname = (char*) malloc(strlen(fname) + 5);
+    sprintf(tmpname, "%s.tmp", fname);
+    int status = -1;
+    int fd = checkpoint_open(tmpname, direct);
+    if (fd >= 0) {
+        status = checkpoint_put(fd, buf, nbytes) | fsync(fd);
+        status = close(fd) | status;
+        if (status == 0)
+            status = rename(tmpname, fname);
+        if (status != 0)
+            unlink(tmpname);
+    }
+    free(tmpname);
+    free(buf);
+    return status;
+}
+
+
+int checkpoint_read(central2d_t* sim, const char* fname,
+                    checkpoint_info_t* info)
+{
+    FILE* fp = fopen(fname, "rb");
+    if (!fp)
+        return -1;
+
+    size_t ncell = (size_t) sim->nfield * sim->nx * sim->ny;
+    checkpoint_header_t h;
+    bool ok = (fread(&h, sizeof(h), 1, fp) == 1 &&
+               memcmp(h.magic, "SWCHKPT1", 8) == 0 &&
+               h.nx == sim->nx && h.ny == sim->ny &&
+               h.nfield == sim->nfield &&
+               h.nbytes == ncell * sizeof(float) &&
+               fseek(fp, CHECKPOINT_ALIGN, SEEK_SET) == 0);
+
+    float* data = (ok ? (float*) malloc(h.nbytes) : NULL);
+    ok = (ok && fread(data, 1, h.nbytes, fp) == h.nbytes &&
+          checkpoint_sum((const uint32_t*) data, ncell) == h.checksum);
+    if (ok) {
+        checkpoint_copy(sim, data, false);
+        info->t = h.t;
+        info->nstep = h.nstep;
+        info->frame = h.frame;
+    }
+    free(data);
+    fclose(fp);
+    return (ok ? 0 : -1);
+}
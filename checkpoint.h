@@ -0,0 +1,50 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "stepper.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//ldoc on
+/**
+ * # Checkpoint and restart
+ *
+ * Batch systems limit how long a job may run, so long simulations
+ * have to be able to stop and pick up again later.  A checkpoint holds
+ * the real cells of every field of a solver together with where the
+ * run was: the simulated time, the number of steps taken, and the
+ * number of frames written.  The fields are stored field by field and
+ * row by row with no ghost cells or padding, independent of the
+ * storage layout (see `central2d_layout_t`), so a run can be restarted
+ * with a different layout or parallel decomposition.  Ghost cells need
+ * not be saved, since every run starts by filling them in.
+ *
+ * The checkpoint is written as a single large write of a 4 KB header
+ * followed by the data (padded to a multiple of 4 KB) from a page
+ * aligned buffer.  That is the size and alignment `O_DIRECT` needs, so
+ * with `direct` set we bypass the page cache when the system allows it
+ * (and quietly fall back to an ordinary write when it does not).  We
+ * write to a temporary file and rename it over `fname` when the data
+ * is safely on disk, so a job killed in the middle of a checkpoint
+ * still has the previous one.  The header has a checksum of the data,
+ * which `checkpoint_read` verifies.
+ *
+ * Both functions return zero on success.  `checkpoint_read` fails if
+ * the file is missing or corrupt or if it is for a grid with a
+ * different size or number of fields.
+ */
+
+typedef struct checkpoint_info_t {
+    double t;          // Simulated time
+    int64_t nstep;     // Steps taken
+    int32_t frame;     // Frames written
+} checkpoint_info_t;
+
+int checkpoint_write(central2d_t* sim, const char* fname,
+                     const checkpoint_info_t* info, bool direct);
+int checkpoint_read(central2d_t* sim, const char* fname,
+                    checkpoint_info_t* info);
+
+//ldoc off
+#endif /* CHECKPOINT_H */
@@ -0,0 +1,181 @@
+#define _POSIX_C_SOURCE 200112L  // For fseeko
+#include "framefile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+
+//ldoc on
+/**
+ * ## Implementation
+ *
+ * We keep the index in memory as the frames are written and append it
+ * at the end.  The writer also keeps its own buffers for the rounded
+ * and shuffled values and for the compressed chunk, so that it can be
+ * driven from the output thread of a frame writer (`framewriter.h`)
+ * without any allocation per frame.
+ */
+
+#define FRAME_ALIGN 64
+
+// The header must be exactly 64 bytes (compile time check)
+typedef char frame_header_check[sizeof(frame_file_header_t) == 64 ? 1 : -1];
+
+struct frame_file_t {
+    FILE* fp;
+    frame_file_header_t header;
+    int64_t pos;            // Current end of the file
+
+    int64_t* index;         // Per frame: time bits, then offset/size pairs
+    int nalloc;             // Frames of index space allocated
+
+    uint32_t* bits;         // Rounded values of one field
+    unsigned char* shuffled;
+    unsigned char* packed;  // Compressed chunk
+    size_t packed_size;
+};
+
+
+static
+int frame_file_put(frame_file_t* ff, const void* data, size_t nbytes)
+{
+    static const char zeros[FRAME_ALIGN] = {0};
+    size_t pad = (FRAME_ALIGN - nbytes % FRAME_ALIGN) % FRAME_ALIGN;
+    if (fwrite(data, 1, nbytes, ff->fp) != nbytes ||
+        fwrite(zeros, 1, pad, ff->fp) != pad)
+        return -1;
+    ff->pos += nbytes + pad;
+    return 0;
+}
+
+
+frame_file_t* frame_file_create(const char* fname,
+                                int nx, int ny, int nfield,
+                                float dx, float dy,
+                                frame_codec_t codec, int keep_bits)
+{
+#ifndef USE_ZLIB
+    if (codec == FRAME_ZLIB)
+        return NULL;
+#endif
+    FILE* fp = fopen(fname, "wb");
+    if (!fp)
+        return NULL;
+
+    frame_file_t* ff = (frame_file_t*) calloc(1, sizeof(frame_file_t));
+    frame_file_header_t* h = &ff->header;
+    memcpy(h->magic, "SWFRAME1", 8);
+    h->nx = nx;
+    h->ny = ny;
+    h->nfield = nfield;
+    h->codec = codec;
+    h->keep_bits = (keep_bits > 0 && keep_bits < 23 ? keep_bits : 0);
+    h->dx = dx;
+    h->dy = dy;
+    ff->fp = fp;
+
+    size_t n = (size_t) nx * ny;
+    ff->bits = (uint32_t*) malloc(n * sizeof(uint32_t));
+#ifdef USE_ZLIB
+    ff->shuffled = (unsigned char*) malloc(n * sizeof(uint32_t));
+    ff->packed_size = compressBound(n * sizeof(uint32_t));
+    ff->packed = (unsigned char*) malloc(ff->packed_size);
+#endif
+    if (frame_file_put(ff, h, sizeof(*h)) != 0) {
+        frame_file_close(ff);
+        return NULL;
+    }
+    return ff;
+}
+
+
+// Round to keep significand bits, to nearest with ties away from zero
+static
+void frame_round(uint32_t* restrict bits, const float* restrict x,
+                 size_t n, int keep_bits)
+{
+    memcpy(bits, x, n * sizeof(uint32_t));
+    if (keep_bits == 0)
+        return;
+    uint32_t half = 1u << (22-keep_bits);
+    uint32_t mask = ~((half << 1) - 1);
+    for (size_t i = 0; i < n; ++i)
+        if ((bits[i] & 0x7f800000) != 0x7f800000)
+            bits[i] = (bits[i] + half) & mask;
+}
+
+
+#ifdef USE_ZLIB
+static
+void frame_shuffle(unsigned char* restrict dst, const uint32_t* restrict src,
+                   size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        for (int b = 0; b < 4; ++b)
+            dst[b*n+i] = (src[i] >> (8*b)) & 0xff;
+}
+#endif
+
+
+int frame_file_write(frame_file_t* ff, const float* frame, double t)
+{
+    frame_file_header_t* h = &ff->header;
+    int nfield = h->nfield;
+    int rec = 1 + 2*nfield;
+    size_t n = (size_t) h->nx * h->ny;
+
+    if (h->nframe == ff->nalloc) {
+        ff->nalloc = (ff->nalloc ? 2*ff->nalloc : 64);
+        ff->index = (int64_t*) realloc(ff->index,
+                                       ff->nalloc * rec * sizeof(int64_t));
+    }
+    int64_t* entry = ff->index + h->nframe * rec;
+    memcpy(entry, &t, sizeof(double));
+
+    for (int k = 0; k < nfield; ++k) {
+        const void* data = ff->bits;
+        size_t nbytes = n * sizeof(uint32_t);
+        frame_round(ff->bits, frame + k*n, n, h->keep_bits);
+#ifdef USE_ZLIB
+        if (h->codec == FRAME_ZLIB) {
+            uLongf packed_size = ff->packed_size;
+            frame_shuffle(ff->shuffled, ff->bits, n);
+            if (compress2(ff->packed, &packed_size, ff->shuffled, nbytes,
+                          Z_BEST_SPEED) != Z_OK)
+                return -1;
+            data = ff->packed;
+            nbytes = packed_size;
+        }
+#endif
+        entry[1+2*k] = ff->pos;
+        entry[2+2*k] = nbytes;
+        if (frame_file_put(ff, data, nbytes) != 0)
+            return -1;
+    }
+    ++h->nframe;
+    return 0;
+}
+
+
+int frame_file_close(frame_file_t* ff)
+{
+    frame_file_header_t* h = &ff->header;
+    size_t rec = 1 + 2*h->nfield;
+    h->index_offset = ff->pos;
+    int status =
+        (frame_file_put(ff, ff->index, h->nframe * rec * sizeof(int64_t)) ||
+         fseeko(ff->fp, 0, SEEK_SET) ||
+         fwrite(h, sizeof(*h), 1, ff->fp) != 1);
+    status = (fclose(ff->fp) != 0) || status;
+    free(ff->packed);
+    free(ff->shuffled);
+    free(ff->bits);
+    free(ff->index);
+    free(ff);
+    return status;
+}
@@ -0,0 +1,76 @@
+#ifndef FRAMEFILE_H
+#define FRAMEFILE_H
+
+#include <stdint.h>
+
+//ldoc on
+/**
+ * # Chunked frame files
+ *
+ * The original output format is a pair of floats with the grid size
+ * followed by raw frames of the water height.  It has no room for the
+ * other fields or the frame times, and a reader has to know the whole
+ * file layout to find a frame.  Frame files are a chunked format with
+ * a header and an index, so that readers can map the file and get any
+ * field of any frame without reading the rest:
+ *
+ * - A 64-byte header (`frame_file_header_t`), starting with the magic
+ *   string `"SWFRAME1"`, with the grid size, number of fields, codec,
+ *   cell sizes, and the location of the index.
+ * - One chunk per field per frame, each starting at a multiple of 64
+ *   bytes.  A field is `ny` rows of `nx` single precision values
+ *   (real cells only).  With `FRAME_RAW`, the chunk is just the
+ *   values, so it can be mapped straight into an array.  With
+ *   `FRAME_ZLIB`, the bytes of the values are shuffled (all the first
+ *   bytes, then all the second bytes, and so on) and the result is
+ *   compressed as a zlib stream; the shuffle puts the slowly varying
+ *   sign and exponent bytes together, which compress well.
+ * - The index, with one record per frame: the simulated time (a
+ *   double), then an offset and a size in bytes (64-bit integers) for
+ *   the chunk of each field.
+ *
+ * All numbers are little-endian.  The frame count and index offset in
+ * the header are filled in by `frame_file_close`, so a file from a run
+ * that did not finish has no index.
+ *
+ * The compression is lossless by default.  If `keep_bits` is between
+ * 1 and 22, values are first rounded to that many significand bits
+ * (out of 23), which zeroes the low bits and makes the data much more
+ * compressible at a relative error of at most `2^-(keep_bits+1)`.
+ */
+
+typedef enum frame_codec_t {
+    FRAME_RAW  = 0,  // Uncompressed chunks
+    FRAME_ZLIB = 1   // Byte shuffle + zlib (needs USE_ZLIB)
+} frame_codec_t;
+
+typedef struct frame_file_header_t {
+    char magic[8];          // "SWFRAME1"
+    int32_t nx, ny;         // Grid size (real cells)
+    int32_t nfield;         // Fields per frame
+    int32_t codec;          // frame_codec_t
+    int32_t keep_bits;      // Significand bits kept (0 = all)
+    int32_t nframe;         // Frames in the index
+    float dx, dy;           // Cell sizes
+    int64_t index_offset;   // Location of the index
+    char reserved[16];
+} frame_file_header_t;
+
+typedef struct frame_file_t frame_file_t;
+
+/**
+ * `frame_file_create` returns `NULL` if the file cannot be opened or
+ * if the codec is not available in this build.  `frame_file_write`
+ * appends a frame of `nfield` contiguous `nx`-by-`ny` fields at time
+ * `t`, and `frame_file_close` writes the index and closes the file.
+ * Both return zero on success.
+ */
+frame_file_t* frame_file_create(const char* fname,
+                                int nx, int ny, int nfield,
+                                float dx, float dy,
+                                frame_codec_t codec, int keep_bits);
+int frame_file_write(frame_file_t* ff, const float* frame, double t);
+int frame_file_close(frame_file_t* ff);
+
+//ldoc off
+#endif /* FRAMEFILE_H */
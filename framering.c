@@ -0,0 +1,123 @@
+#define _POSIX_C_SOURCE 200112L  // For ftruncate
+#include "framering.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+//ldoc on
+/**
+ * ## Implementation
+ *
+ * There is only one writer, so the sequence numbers and the count are
+ * plain stores; what matters is their order relative to the frame
+ * data, which we enforce with full memory barriers.  The readers are
+ * in other processes, so the stores go through `volatile` pointers
+ * into the mapping.
+ */
+
+#define FRAME_RING_ALIGN 64
+
+// The headers must be exactly 64 bytes (compile time checks)
+typedef char frame_ring_header_check[
+    sizeof(frame_ring_header_t) == 64 ? 1 : -1];
+typedef char frame_ring_slot_check[
+    sizeof(frame_ring_slot_t) == 64 ? 1 : -1];
+
+struct frame_ring_t {
+    int fd;
+    char* map;
+    size_t map_size;
+    frame_ring_header_t* header;
+    int64_t count;          // Frames published
+};
+
+
+static
+frame_ring_slot_t* frame_ring_slot(frame_ring_t* ring, int64_t n)
+{
+    frame_ring_header_t* h = ring->header;
+    return (frame_ring_slot_t*) (ring->map + FRAME_RING_ALIGN +
+                                 (n % h->nslot) * h->slot_size);
+}
+
+
+frame_ring_t* frame_ring_create(const char* fname,
+                                int nx, int ny, int nfield,
+                                float dx, float dy, int nslot)
+{
+    size_t data_size = (size_t) nx * ny * nfield * sizeof(float);
+    size_t slot_size = sizeof(frame_ring_slot_t) +
+        (data_size + FRAME_RING_ALIGN-1) / FRAME_RING_ALIGN * FRAME_RING_ALIGN;
+    nslot = (nslot < 2 ? 2 : nslot);
+    size_t size = FRAME_RING_ALIGN + nslot * slot_size;
+
+    // Replace rather than truncate, so readers of an old ring keep it
+    unlink(fname);
+    int fd = open(fname, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, size) != 0) {
+        close(fd);
+        return NULL;
+    }
+    char* map = (char*) mmap(NULL, size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    frame_ring_t* ring = (frame_ring_t*) malloc(sizeof(frame_ring_t));
+    ring->fd = fd;
+    ring->map = map;
+    ring->map_size = size;
+    ring->header = (frame_ring_header_t*) map;
+    ring->count = 0;
+
+    // The file is new, so the counts and sequence numbers start at zero
+    frame_ring_header_t* h = ring->header;
+    h->nx = nx;
+    h->ny = ny;
+    h->nfield = nfield;
+    h->nslot = nslot;
+    h->dx = dx;
+    h->dy = dy;
+    h->slot_size = slot_size;
+    __sync_synchronize();
+    memcpy(h->magic, "SWRING01", 8);
+    return ring;
+}
+
+
+float* frame_ring_begin(frame_ring_t* ring)
+{
+    frame_ring_slot_t* slot = frame_ring_slot(ring, ring->count);
+    *(volatile int64_t*) &slot->seq = 2*ring->count + 1;
+    __sync_synchronize();
+    return (float*) (slot + 1);
+}
+
+
+void frame_ring_publish(frame_ring_t* ring, double t)
+{
+    frame_ring_slot_t* slot = frame_ring_slot(ring, ring->count);
+    *(volatile double*) &slot->t = t;
+    __sync_synchronize();
+    *(volatile int64_t*) &slot->seq = 2*ring->count + 2;
+    __sync_synchronize();
+    *(volatile int64_t*) &ring->header->count = ++ring->count;
+}
+
+
+int frame_ring_close(frame_ring_t* ring)
+{
+    __sync_synchronize();
+    *(volatile int32_t*) &ring->header->done = 1;
+    int status = munmap(ring->map, ring->map_size);
+    status = (close(ring->fd) != 0 || status != 0);
+    free(ring);
+    return status;
+}
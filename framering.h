@@ -0,0 +1,73 @@
+#ifndef FRAMERING_H
+#define FRAMERING_H
+
+#include <stdint.h>
+
+//ldoc on
+/**
+ * # Shared memory frame rings
+ *
+ * To watch a run while it goes, without writing an output file and
+ * reading it back, the driver can publish its frames in a ring of
+ * `nslot` frame slots in a shared file, usually in a memory file
+ * system such as `/dev/shm` so that nothing reaches a disk.  The
+ * solver never waits for a reader: each frame goes into the next slot
+ * in turn, overwriting the oldest one, so a reader that falls behind
+ * just misses frames.  A reader maps the file and takes the newest
+ * frame (or any frame still in the ring) whenever it is ready for one.
+ *
+ * The file has a 64-byte header (`frame_ring_header_t`), starting
+ * with the magic string `"SWRING01"`, with the frame geometry (as in
+ * `framefile.h`), the number of frames published so far, and a flag
+ * set when the run is over.  The slots follow, each `slot_size` bytes
+ * (a multiple of 64): a 64-byte slot header (`frame_ring_slot_t`) with
+ * a sequence number and the simulated time, then `nfield` contiguous
+ * `nx`-by-`ny` fields.  All numbers are little-endian.
+ *
+ * Frame `n` goes in slot `n % nslot`.  Its writer sets the slot
+ * sequence number to `2n+1` before it touches the data and to `2n+2`
+ * after, and only then sets the header count to `n+1`.  To read frame
+ * `n`, a reader checks that the sequence number is `2n+2`, copies the
+ * slot, and checks the sequence number again; if it changed, the slot
+ * was overwritten during the copy and the reader should start over
+ * from the newest frame.
+ */
+
+typedef struct frame_ring_header_t {
+    char magic[8];          // "SWRING01"
+    int32_t nx, ny;         // Grid size (real cells)
+    int32_t nfield;         // Fields per frame
+    int32_t nslot;          // Frames in the ring
+    float dx, dy;           // Cell sizes
+    int64_t slot_size;      // Bytes per slot (header and fields)
+    int64_t count;          // Frames published
+    int32_t done;           // Nonzero once the run is over
+    char reserved[12];
+} frame_ring_header_t;
+
+typedef struct frame_ring_slot_t {
+    int64_t seq;            // 2n+1 while writing frame n, 2n+2 after
+    double t;               // Simulated time of the frame
+    char reserved[48];
+} frame_ring_slot_t;
+
+typedef struct frame_ring_t frame_ring_t;
+
+/**
+ * `frame_ring_create` makes (or replaces) the ring file and maps it,
+ * returning `NULL` if that fails.  `frame_ring_begin` returns the data
+ * of the slot for the next frame, and `frame_ring_publish` marks that
+ * frame complete at time `t`; neither ever blocks.
+ * `frame_ring_close` sets the done flag and unmaps the file (which
+ * stays behind for readers to drain; the caller or the reader removes
+ * it) and returns zero on success.
+ */
+frame_ring_t* frame_ring_create(const char* fname,
+                                int nx, int ny, int nfield,
+                                float dx, float dy, int nslot);
+float* frame_ring_begin(frame_ring_t* ring);
+void frame_ring_publish(frame_ring_t* ring, double t);
+int frame_ring_close(frame_ring_t* ring);
+
+//ldoc off
+#endif /* FRAMERING_H */
@@ -0,0 +1,130 @@
+#define _POSIX_C_SOURCE 200112L  // For pthreads
+#include "framewriter.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+//ldoc on
+/**
+ * ## Implementation
+ *
+ * The buffers are used strictly in ring order, so the state of the
+ * ring is just two counters: the number of frames `submitted` by the
+ * caller and the number `written` by the thread.  Buffer
+ * `submitted % nbuf` is the next one to hand out, and it is free once
+ * fewer than `nbuf` frames are waiting to be written; buffer
+ * `written % nbuf` is the next one to write.  The thread only counts
+ * a frame as written after the sink returns, so the caller never
+ * refills a buffer that is still being written.  Both sides wait on
+ * the same condition variable.
+ */
+
+struct frame_writer_t {
+    frame_sink_t sink;
+    size_t nbytes;
+    int nbuf;             // Ring size (1 for synchronous writes)
+    char** bufs;
+    double* times;        // Time stamp of each buffer
+
+    long submitted;       // Frames handed to the writer
+    long written;         // Frames passed to the sink
+    bool closing;         // Set by frame_writer_close
+    bool failed;          // Set if any sink call failed
+
+    bool threaded;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+
+static
+void* frame_writer_main(void* arg)
+{
+    frame_writer_t* w = (frame_writer_t*) arg;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->written == w->submitted && !w->closing)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if (w->written == w->submitted)
+            break;
+        int i = w->written % w->nbuf;
+        pthread_mutex_unlock(&w->lock);
+        bool ok = (w->sink.write(w->sink.ctx, w->bufs[i], w->nbytes,
+                                 w->times[i]) == 0);
+        pthread_mutex_lock(&w->lock);
+        w->failed = w->failed || !ok;
+        ++w->written;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+
+frame_writer_t* frame_writer_open(frame_sink_t sink, size_t nbytes, int nbuf)
+{
+    frame_writer_t* w = (frame_writer_t*) calloc(1, sizeof(frame_writer_t));
+    w->sink = sink;
+    w->nbytes = nbytes;
+    w->nbuf = (nbuf > 0 ? nbuf : 1);
+    w->bufs = (char**) malloc(w->nbuf * sizeof(char*));
+    w->times = (double*) malloc(w->nbuf * sizeof(double));
+    for (int i = 0; i < w->nbuf; ++i)
+        w->bufs[i] = (char*) malloc(nbytes);
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    w->threaded = (nbuf > 0 &&
+                   pthread_create(&w->thread, NULL, frame_writer_main, w) == 0);
+    return w;
+}
+
+
+void* frame_writer_acquire(frame_writer_t* w)
+{
+    if (!w->threaded)
+        return w->bufs[0];
+    pthread_mutex_lock(&w->lock);
+    while (w->submitted - w->written >= w->nbuf)
+        pthread_cond_wait(&w->cond, &w->lock);
+    void* buf = w->bufs[w->submitted % w->nbuf];
+    pthread_mutex_unlock(&w->lock);
+    return buf;
+}
+
+
+void frame_writer_submit(frame_writer_t* w, void* buf, double t)
+{
+    if (!w->threaded) {
+        if (w->sink.write(w->sink.ctx, buf, w->nbytes, t) != 0)
+            w->failed = true;
+        return;
+    }
+    pthread_mutex_lock(&w->lock);
+    w->times[w->submitted % w->nbuf] = t;
+    ++w->submitted;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+
+int frame_writer_close(frame_writer_t* w)
+{
+    if (w->threaded) {
+        pthread_mutex_lock(&w->lock);
+        w->closing = true;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+        pthread_join(w->thread, NULL);
+    }
+    bool failed = (w->sink.close(w->sink.ctx) != 0) || w->failed;
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+    for (int i = 0; i < w->nbuf; ++i)
+        free(w->bufs[i]);
+    free(w->bufs);
+    free(w->times);
+    free(w);
+    return failed;
+}
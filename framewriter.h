@@ -0,0 +1,47 @@
+#ifndef FRAMEWRITER_H
+#define FRAMEWRITER_H
+
+#include <stddef.h>
+
+//ldoc on
+/**
+ * # Asynchronous frame output
+ *
+ * Writing a frame of a big grid takes long enough that the solver
+ * would sit idle while the data goes to disk.  A frame writer owns an
+ * output sink and a fixed ring of `nbuf` frame buffers of `nbytes`
+ * bytes each.  The sink is a pair of callbacks: `write` stores one
+ * frame (with its simulated time) and `close` finishes the output;
+ * both return zero on success.  The caller snapshots a frame into a
+ * buffer obtained with `frame_writer_acquire` and hands it back with
+ * `frame_writer_submit`; a background thread passes the submitted
+ * buffers to the sink in order, so the next frame can be computed
+ * while the previous one is written (or compressed).  Once all the
+ * buffers are in flight, `frame_writer_acquire` waits for the oldest
+ * one to be written, which bounds the memory used to `nbuf` frames no
+ * matter how slow the disk is.
+ *
+ * With `nbuf == 0` (or if the thread cannot be started), there is a
+ * single buffer and `frame_writer_submit` writes it before returning.
+ * Only one buffer may be acquired at a time.
+ *
+ * `frame_writer_close` waits for the queued frames to be written,
+ * stops the thread, closes the sink, and returns zero if every sink
+ * call succeeded (and nonzero otherwise).
+ */
+
+typedef struct frame_sink_t {
+    void* ctx;
+    int (*write)(void* ctx, const void* frame, size_t nbytes, double t);
+    int (*close)(void* ctx);
+} frame_sink_t;
+
+typedef struct frame_writer_t frame_writer_t;
+
+frame_writer_t* frame_writer_open(frame_sink_t sink, size_t nbytes, int nbuf);
+void* frame_writer_acquire(frame_writer_t* w);
+void frame_writer_submit(frame_writer_t* w, void* buf, double t);
+int frame_writer_close(frame_writer_t* w);
+
+//ldoc off
+#endif /* FRAMEWRITER_H */
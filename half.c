@@ -0,0 +1,254 @@
+#include "half.h"
+#include "simd.h"
+
+#include <string.h>
+
+//ldoc on
+/**
+ * ## Implementation
+ *
+ * ### Scalar conversions
+ *
+ * The single value conversions work on the bit patterns.  For IEEE half
+ * precision, we follow the usual approach of rebiasing the exponent
+ * and rounding the significand with integer arithmetic for normal
+ * results; for results in the subnormal range, adding 0.5 makes the
+ * floating point hardware do the shift and the rounding for us, since
+ * the spacing of floats in [0.5, 1) is the smallest half precision
+ * subnormal.  Infinities stay infinite, NaNs stay NaN (quiet), and
+ * values that round past the largest half become infinite.
+ */
+
+static inline
+uint32_t float_bits(float x)
+{
+    uint32_t b;
+    memcpy(&b, &x, sizeof(b));
+    return b;
+}
+
+
+static inline
+float bits_float(uint32_t b)
+{
+    float x;
+    memcpy(&x, &b, sizeof(x));
+    return x;
+}
+
+
+static inline
+uint16_t fp16_from_float(float x)
+{
+    uint32_t b = float_bits(x);
+    uint32_t sign = (b >> 16) & 0x8000;
+    uint32_t a = b & 0x7fffffff;
+    if (a > 0x7f800000)                           // NaN (made quiet)
+        return sign | 0x7e00 | ((a >> 13) & 0x3ff);
+    if (a >= 0x477ff000)                          // Inf, or rounds to Inf
+        return sign | 0x7c00;
+    if (a < 0x38800000)                           // Subnormal or zero
+        return sign | (float_bits(bits_float(a) + 0.5f) - 0x3f000000);
+    a += 0xc8000fff + ((a >> 13) & 1);            // Rebias and round
+    return sign | (a >> 13);
+}
+
+
+static inline
+float fp16_to_float(uint16_t h)
+{
+    uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+    uint32_t e = (h >> 10) & 0x1f;
+    uint32_t m = h & 0x3ff;
+    if (e == 0x1f)
+        return bits_float(sign | 0x7f800000 | (m << 13));
+    if (e == 0)
+        return bits_float(sign | float_bits(m * (1.0f/16777216)));
+    return bits_float(sign | ((e + 112) << 23) | (m << 13));
+}
+
+
+static inline
+uint16_t bf16_from_float(float x)
+{
+    uint32_t b = float_bits(x);
+    if ((b & 0x7fffffff) > 0x7f800000)
+        return (b >> 16) | 0x40;                  // Quiet NaN
+    return (b + 0x7fff + ((b >> 16) & 1)) >> 16;
+}
+
+
+static inline
+float bf16_to_float(uint16_t h)
+{
+    return bits_float((uint32_t) h << 16);
+}
+
+
+/**
+ * ### Vector conversions
+ *
+ * The x86 half precision conversions are in the F16C extension, which
+ * every CPU with AVX2 also has, and in AVX-512F.  There are no bfloat16
+ * conversions in the base instruction sets, but the scalar loops for
+ * them are plain integer arithmetic that compilers vectorize well.
+ */
+
+#ifdef SIMD_X86
+#define HALF_TARGET_F16C __attribute__((target("avx2,f16c")))
+
+HALF_TARGET_F16C static
+int fp16_from_float_avx2(uint16_t* restrict dst, const float* restrict src,
+                         int n)
+{
+    int i = 0;
+    for (; i+8 <= n; i += 8) {
+        __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src+i),
+                                    _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i*) (dst+i), h);
+    }
+    return i;
+}
+
+
+HALF_TARGET_F16C static
+int fp16_to_float_avx2(float* restrict dst, const uint16_t* restrict src,
+                       int n)
+{
+    int i = 0;
+    for (; i+8 <= n; i += 8) {
+        __m128i h = _mm_loadu_si128((const __m128i*) (src+i));
+        _mm256_storeu_ps(dst+i, _mm256_cvtph_ps(h));
+    }
+    return i;
+}
+
+
+SIMD_TARGET_AVX512 static
+int fp16_from_float_avx512(uint16_t* restrict dst, const float* restrict src,
+                           int n)
+{
+    int i = 0;
+    for (; i+16 <= n; i += 16) {
+        __m256i h = _mm512_cvtps_ph(_mm512_loadu_ps(src+i),
+                                    _MM_FROUND_TO_NEAREST_INT);
+        _mm256_storeu_si256((__m256i*) (dst+i), h);
+    }
+    return i;
+}
+
+
+SIMD_TARGET_AVX512 static
+int fp16_to_float_avx512(float* restrict dst, const uint16_t* restrict src,
+                         int n)
+{
+    int i = 0;
+    for (; i+16 <= n; i += 16) {
+        __m256i h = _mm256_loadu_si256((const __m256i*) (src+i));
+        _mm512_storeu_ps(dst+i, _mm512_cvtph_ps(h));
+    }
+    return i;
+}
+#endif /* SIMD_X86 */
+
+
+#ifdef SIMD_NEON_ENABLED
+static
+int fp16_from_float_neon(uint16_t* restrict dst, const float* restrict src,
+                         int n)
+{
+    int i = 0;
+    for (; i+4 <= n; i += 4) {
+        float16x4_t h = vcvt_f16_f32(vld1q_f32(src+i));
+        vst1_u16(dst+i, vreinterpret_u16_f16(h));
+    }
+    return i;
+}
+
+
+static
+int fp16_to_float_neon(float* restrict dst, const uint16_t* restrict src,
+                       int n)
+{
+    int i = 0;
+    for (; i+4 <= n; i += 4) {
+        float16x4_t h = vreinterpret_f16_u16(vld1_u16(src+i));
+        vst1q_f32(dst+i, vcvt_f32_f16(h));
+    }
+    return i;
+}
+#endif /* SIMD_NEON_ENABLED */
+
+
+static
+int fp16_from_float_simd(uint16_t* restrict dst, const float* restrict src,
+                         int n)
+{
+    switch (simd_level()) {
+#ifdef SIMD_X86
+    case SIMD_AVX512:
+        return fp16_from_float_avx512(dst, src, n);
+    case SIMD_AVX2:
+        return fp16_from_float_avx2(dst, src, n);
+#endif
+#ifdef SIMD_NEON_ENABLED
+    case SIMD_NEON:
+        return fp16_from_float_neon(dst, src, n);
+#endif
+    default:
+        return 0;
+    }
+}
+
+
+static
+int fp16_to_float_simd(float* restrict dst, const uint16_t* restrict src,
+                       int n)
+{
+    switch (simd_level()) {
+#ifdef SIMD_X86
+    case SIMD_AVX512:
+        return fp16_to_float_avx512(dst, src, n);
+    case SIMD_AVX2:
+        return fp16_to_float_avx2(dst, src, n);
+#endif
+#ifdef SIMD_NEON_ENABLED
+    case SIMD_NEON:
+        return fp16_to_float_neon(dst, src, n);
+#endif
+    default:
+        return 0;
+    }
+}
+
+
+/**
+ * ### Row conversions
+ */
+
+void half_from_float(uint16_t* restrict dst, const float* restrict src,
+                     int n, int cs, half_format_t format)
+{
+    if (format == HALF_BF16) {
+        for (int i = 0; i < n; ++i)
+            dst[i*cs] = bf16_from_float(src[i]);
+        return;
+    }
+    int i = (cs == 1 ? fp16_from_float_simd(dst, src, n) : 0);
+    for (; i < n; ++i)
+        dst[i*cs] = fp16_from_float(src[i]);
+}
+
+
+void half_to_float(float* restrict dst, const uint16_t* restrict src,
+                   int n, int cs, half_format_t format)
+{
+    if (format == HALF_BF16) {
+        for (int i = 0; i < n; ++i)
+            dst[i] = bf16_to_float(src[i*cs]);
+        return;
+    }
+    int i = (cs == 1 ? fp16_to_float_simd(dst, src, n) : 0);
+    for (; i < n; ++i)
+        dst[i] = fp16_to_float(src[i*cs]);
+}
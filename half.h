@@ -0,0 +1,36 @@
+#ifndef HALF_H
+#define HALF_H
+
+#include <stdint.h>
+
+//ldoc on
+/**
+ * # Half precision storage
+ *
+ * The solver is limited by memory bandwidth for large grids, so it can
+ * keep the solution in 16-bit floating point numbers and widen them to
+ * single precision for the arithmetic.  We support two formats: IEEE
+ * half precision (`HALF_FP16`, with an 11 bit significand and a range
+ * up to about 65504) and "brain float" (`HALF_BF16`, with the range of
+ * single precision but only an 8 bit significand).
+ *
+ * The conversion routines convert `n` values between a row of floats
+ * and a row of 16-bit values `cs` entries apart (the floats are always
+ * contiguous).  Conversion to 16 bits rounds to nearest, with ties to
+ * even.  The contiguous case uses the vector conversion instructions
+ * where we have them (see `simd.h`), with the same results as the
+ * scalar code.
+ */
+
+typedef enum half_format_t {
+    HALF_FP16,
+    HALF_BF16
+} half_format_t;
+
+void half_from_float(uint16_t* dst, const float* src, int n, int cs,
+                     half_format_t format);
+void half_to_float(float* dst, const uint16_t* src, int n, int cs,
+                   half_format_t format);
+
+//ldoc off
+#endif /* HALF_H */
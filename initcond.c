@@ -0,0 +1,191 @@
+#include "initcond.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//ldoc on
+/**
+ * ## Built-in initial conditions
+ *
+ * These are the cases from `tests.lua`.  The Lua number type is a
+ * double, so we compute in double precision and round the results to
+ * single precision, as `lua_init_sim` does.
+ */
+
+static
+void init_pond(float* u, double x, double y)
+{
+    u[0] = 1;
+    u[1] = 0;
+    u[2] = 0;
+}
+
+
+static
+void init_river(float* u, double x, double y)
+{
+    u[0] = 1;
+    u[1] = 1;
+    u[2] = 0;
+}
+
+
+static
+void init_dam(float* u, double x, double y)
+{
+    u[0] = ((x-1)*(x-1) + (y-1)*(y-1) < 0.25 ? 1.5 : 1);
+    u[1] = 0;
+    u[2] = 0;
+}
+
+
+static
+void init_wave(float* u, double x, double y)
+{
+    u[0] = 1.0 + 0.2 * sin(3.141592653589793238462643383279502884 * x);
+    u[1] = 1;
+    u[2] = 0;
+}
+
+
+init_fun_t init_lookup(const char* name)
+{
+    static const struct {
+        const char* name;
+        init_fun_t init;
+    } table[] = {
+        {"pond", init_pond},
+        {"river", init_river},
+        {"dam", init_dam},
+        {"wave", init_wave}
+    };
+    for (int i = 0; i < (int) (sizeof(table) / sizeof(table[0])); ++i)
+        if (strcmp(name, table[i].name) == 0)
+            return table[i].init;
+    return NULL;
+}
+
+
+/**
+ * The cell centers are computed in single precision, as in
+ * `lua_init_sim`.
+ */
+
+void init_cells(central2d_t* sim, init_fun_t init, int x0, int y0)
+{
+    int nx = sim->nx, ny = sim->ny, nfield = sim->nfield;
+    float dx = sim->dx, dy = sim->dy;
+    #pragma omp parallel for schedule(static)
+    for (int iy = 0; iy < ny; ++iy) {
+        float cell[nfield];
+        float y = (y0 + iy + 0.5) * dy;
+        for (int ix = 0; ix < nx; ++ix) {
+            float x = (x0 + ix + 0.5) * dx;
+            init(cell, x, y);
+            for (int k = 0; k < nfield; ++k)
+                sim->u[central2d_offset(sim,k,ix,iy)] = cell[k];
+        }
+    }
+}
+
+
+/**
+ * ## Initial states from files
+ *
+ * A NumPy file starts with a magic string, a version number, and the
+ * length of a header that describes the array as a Python dictionary
+ * literal, something like
+ *
+ *     {'descr': '<f4', 'fortran_order': False, 'shape': (3, 200, 200), }
+ *
+ * We only need to check the three entries; the data follows the
+ * header.  A file that does not start with the magic string is taken
+ * to be raw single precision data.
+ */
+
+static
+int npy_header(FILE* fp, int* esize, long* data_start, int shape[3])
+{
+    unsigned char magic[10];
+    if (fread(magic, 1, 10, fp) != 10 || memcmp(magic, "\x93NUMPY", 6) != 0)
+        return -1;
+    long hlen = magic[8] | (magic[9] << 8);
+    long start = 10;
+    if (magic[6] >= 2) {
+        unsigned char more[2];
+        if (fread(more, 1, 2, fp) != 2)
+            return -1;
+        hlen |= ((long) more[0] << 16) | ((long) more[1] << 24);
+        start = 12;
+    }
+    char* header = (char*) calloc(hlen+1, 1);
+    int ok = (fread(header, 1, hlen, fp) == (size_t) hlen);
+    const char* descr = strstr(header, "'descr':");
+    const char* order = strstr(header, "'fortran_order':");
+    const char* dims = strstr(header, "'shape':");
+    if (order) {
+        order += strlen("'fortran_order':");
+        order += strspn(order, " ");
+    }
+    ok = ok && descr && order && dims &&
+        strncmp(order, "False", 5) == 0 &&
+        sscanf(dims, "'shape': (%d, %d, %d", shape, shape+1, shape+2) == 3;
+    if (ok && strstr(descr, "'<f4'"))
+        *esize = 4;
+    else if (ok && strstr(descr, "'<f8'"))
+        *esize = 8;
+    else
+        ok = 0;
+    free(header);
+    *data_start = start + hlen;
+    return (ok ? 0 : -1);
+}
+
+
+int init_load(central2d_t* sim, const char* fname,
+              int x0, int y0, int gnx, int gny)
+{
+    FILE* fp = fopen(fname, "rb");
+    if (!fp)
+        return -1;
+
+    int nx = sim->nx, ny = sim->ny, nfield = sim->nfield;
+    int esize = 4;
+    long data_start = 0;
+    int shape[3] = {nfield, gny, gnx};
+    if (npy_header(fp, &esize, &data_start, shape) != 0) {
+        // Not a NumPy file: the size of a raw file must match exactly
+        esize = 4;
+        data_start = 0;
+        fseek(fp, 0, SEEK_END);
+        if (ftell(fp) != (long) nfield * gny * gnx * esize)
+            shape[0] = -1;
+    }
+    int ok = (shape[0] == nfield && shape[1] == gny && shape[2] == gnx);
+
+    unsigned char* row = (unsigned char*) malloc((size_t) nx * esize);
+    for (int k = 0; ok && k < nfield; ++k)
+        for (int iy = 0; ok && iy < ny; ++iy) {
+            long offset = data_start +
+                (((long) k*gny + y0+iy) * gnx + x0) * esize;
+            ok = (fseek(fp, offset, SEEK_SET) == 0 &&
+                  fread(row, esize, nx, fp) == (size_t) nx);
+            float* u = sim->u + central2d_offset(sim,k,0,iy);
+            for (int ix = 0; ok && ix < nx; ++ix) {
+                float x4;
+                double x8;
+                if (esize == 4)
+                    memcpy(&x4, row + ix*esize, 4);
+                else {
+                    memcpy(&x8, row + ix*esize, 8);
+                    x4 = x8;
+                }
+                u[ix*sim->cell_stride] = x4;
+            }
+        }
+    free(row);
+    fclose(fp);
+    return (ok ? 0 : -1);
+}
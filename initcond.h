@@ -0,0 +1,49 @@
+#ifndef INITCOND_H
+#define INITCOND_H
+
+#include "stepper.h"
+
+//ldoc on
+/**
+ * # Initial conditions
+ *
+ * The Lua driver normally gets the initial conditions by calling a Lua
+ * function for every cell, which is slow for big grids.  This module
+ * has two faster ways to set up a solver.
+ *
+ * The first is a set of built-in initial conditions for the shallow
+ * water equations, written in C: the `"pond"`, `"river"`, `"dam"`, and
+ * `"wave"` cases of `tests.lua` (on the default 2-by-2 domain).  Each
+ * is a function that sets the `nfield` values at one cell center,
+ * computing in double precision just as the Lua versions do, so the
+ * results are the same.  `init_lookup` returns the function for a
+ * name (or `NULL`), and `init_cells` calls a function at every real
+ * cell of a solver whose lower left cell is cell `(x0, y0)` of the
+ * global grid.  The loop runs over rows in parallel with a static
+ * schedule, like the parallel first touch of the solver arrays (see
+ * `memalloc.h`).
+ */
+
+typedef void (*init_fun_t)(float* u, double x, double y);
+
+init_fun_t init_lookup(const char* name);
+void init_cells(central2d_t* sim, init_fun_t init, int x0, int y0);
+
+/**
+ * The second is to read the initial state from a file, either a NumPy
+ * `.npy` file or raw binary.  The array holds the real cells of the
+ * whole `gnx`-by-`gny` grid as `nfield` fields of `gny` rows of `gnx`
+ * values each (so a NumPy array with shape `(nfield, gny, gnx)` in C
+ * order); NumPy files may hold little-endian single or double
+ * precision values, and raw files hold little-endian single precision
+ * values, as in the chunks of a frame file (see `framefile.h`).
+ * `init_load` reads the part of the grid that belongs to the solver,
+ * starting at cell `(x0, y0)`, and returns zero on success or nonzero
+ * if the file cannot be read or has the wrong size.
+ */
+
+int init_load(central2d_t* sim, const char* fname,
+              int x0, int y0, int gnx, int gny);
+
+//ldoc off
+#endif /* INITCOND_H */
@@ -1,5 +1,20 @@
+#define _POSIX_C_SOURCE 200112L  // For ftruncate
 #include "stepper.h"
 #include "shallow2d.h"
+#include "simd.h"
+#include "memalloc.h"
+#include "framewriter.h"
+#include "framefile.h"
+#include "framering.h"
+#include "checkpoint.h"
+#include "initcond.h"
+#include "profile.h"
+
+#ifdef USE_MPI
+#include "stepper_mpi.h"
+#else
+#include "amr.h"
+#endif
 
 #ifdef _OPENMP
 #include <omp.h>
@@ -11,8 +26,20 @@
 #include <lauxlib.h>
 #include <lualib.h>
 
+#if LUA_VERSION_NUM < 502
+#define lua_rawlen lua_objlen
+#endif
+
 #include <assert.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 //ldoc on
 /**
@@ -30,31 +57,93 @@
  * since that will cause the system of equations to blow up.  For
  * debugging convenience, we'll plan to periodically print diagnostic
  * information about these conserved quantities (and about the range
- * of water heights).
+ * of water heights).  The range comes from `fminf` and `fmaxf`, which
+ * skip NaNs, but a NaN anywhere in the grid makes the sums NaN, so we
+ * check that they are finite as well as that the heights are positive.
+ *
+ * In the MPI build, each rank only has its own block of the grid, so
+ * we combine the local sums and ranges over all ranks and report
+ * only from rank 0.
+ *
+ * On big grids, single precision sums of millions of cells have
+ * rounding errors that swamp the changes we are looking for (and with
+ * the 16-bit storage formats, the changes are larger).  If
+ * `check_double` is set, we get the sums from `central2d_diagnostics`,
+ * which uses pairwise sums in double precision, sums the rows in
+ * parallel, and (with the fused engine) does the work as part of the
+ * last step of each run.  Otherwise, we add up the cells in order, and
+ * `check_round` rounds each partial result to single
+ * precision; since the double precision sum or product of two single
+ * precision numbers is exact before that rounding, this gives the
+ * same results as single precision arithmetic.
  */
 
+static int driver_rank = 0;
+static bool check_double = false;
+
+static inline
+double check_round(double x)
+{
+    return (check_double ? x : (float) x);
+}
+
 void solution_check(central2d_t* sim)
 {
-    int nx = sim->nx, ny = sim->ny;
-    float* u = sim->u;
-    float h_sum = 0, hu_sum = 0, hv_sum = 0;
-    float hmin = u[central2d_offset(sim,0,0,0)];
-    float hmax = hmin;
-    for (int j = 0; j < ny; ++j)
-        for (int i = 0; i < nx; ++i) {
-            float h = u[central2d_offset(sim,0,i,j)];
-            h_sum += h;
-            hu_sum += u[central2d_offset(sim,1,i,j)];
-            hv_sum += u[central2d_offset(sim,2,i,j)];
-            hmax = fmaxf(h, hmax);
-            hmin = fminf(h, hmin);
+    int nx = sim->nx, ny = sim->ny, cs = sim->cell_stride;
+    double h_sum = 0, hu_sum = 0, hv_sum = 0;
+    float hmin, hmax;
+    central2d_sync(sim);
+    if (check_double) {
+        double sums[3];
+        float range[2];
+        central2d_diagnostics(sim, sums, range);
+        h_sum = sums[0];
+        hu_sum = sums[1];
+        hv_sum = sums[2];
+        hmin = range[0];
+        hmax = range[1];
+    } else {
+        hmin = hmax = sim->u[central2d_offset(sim,0,0,0)];
+        for (int j = 0; j < ny; ++j) {
+            const float* h = sim->u + central2d_offset(sim,0,0,j);
+            const float* hu = sim->u + central2d_offset(sim,1,0,j);
+            const float* hv = sim->u + central2d_offset(sim,2,0,j);
+            for (int i = 0; i < nx; ++i) {
+                h_sum = check_round(h_sum + h[i*cs]);
+                hu_sum = check_round(hu_sum + hu[i*cs]);
+                hv_sum = check_round(hv_sum + hv[i*cs]);
+                hmax = fmaxf(h[i*cs], hmax);
+                hmin = fminf(h[i*cs], hmin);
+            }
         }
+    }
+#ifdef USE_MPI
+    if (check_double) {
+        double sums[3] = {h_sum, hu_sum, hv_sum};
+        MPI_Allreduce(MPI_IN_PLACE, sums, 3, MPI_DOUBLE, MPI_SUM,
+                      MPI_COMM_WORLD);
+        h_sum = sums[0];
+        hu_sum = sums[1];
+        hv_sum = sums[2];
+    } else {
+        float sums[3] = {h_sum, hu_sum, hv_sum};
+        MPI_Allreduce(MPI_IN_PLACE, sums, 3, MPI_FLOAT, MPI_SUM,
+                      MPI_COMM_WORLD);
+        h_sum = sums[0];
+        hu_sum = sums[1];
+        hv_sum = sums[2];
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &hmin, 1, MPI_FLOAT, MPI_MIN, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &hmax, 1, MPI_FLOAT, MPI_MAX, MPI_COMM_WORLD);
+#endif
     float cell_area = sim->dx * sim->dy;
-    h_sum *= cell_area;
-    hu_sum *= cell_area;
-    hv_sum *= cell_area;
-    printf("-\n  Volume: %g\n  Momentum: (%g, %g)\n  Range: [%g, %g]\n",
-           h_sum, hu_sum, hv_sum, hmin, hmax);
+    h_sum = check_round(h_sum * cell_area);
+    hu_sum = check_round(hu_sum * cell_area);
+    hv_sum = check_round(hv_sum * cell_area);
+    if (driver_rank == 0)
+        printf("-\n  Volume: %g\n  Momentum: (%g, %g)\n  Range: [%g, %g]\n",
+               h_sum, hu_sum, hv_sum, hmin, hmax);
+    assert(isfinite(h_sum) && isfinite(hu_sum) && isfinite(hv_sum));
     assert(hmin > 0);
 }
 
@@ -63,32 +152,321 @@ void solution_check(central2d_t* sim)
  *
  * After finishing a run (or every several steps), we might want to
  * write out a data file for further processing by some other program
- * -- in this case, a Python visualizer.  The visualizer takes the
- * number of pixels in x and y in the first two entries, then raw
- * single-precision raster pictures.
+ * -- in this case, a Python visualizer.  By default, we write a frame
+ * file (see `framefile.h`) with all the fields and the time of each
+ * frame, optionally compressed.  We can also write the original
+ * format: the number of pixels in x and y in the
+ * first two entries, then raw single-precision raster pictures of the
+ * water height.  (The MPI build always writes the original format,
+ * with `central2d_mpi_viz_frame`.)  The visualizer reads both.
+ *
+ * Frames go through a frame writer (see `framewriter.h`): `viz_frame`
+ * copies the real cells of the fields into a contiguous buffer and
+ * returns as soon as it has queued the buffer, and the writer thread
+ * compresses it and puts it on disk while the solver computes the
+ * next frame.  The `nbuf` field of the options is the number of
+ * frames that may be in flight (zero for synchronous writes).
+ *
+ * The original format has a fixed frame size, so it can also be
+ * written through a memory map (the `map` option).  Then `viz_open`
+ * sizes the file for the `nframe` frames of the run up front and maps
+ * it, and `viz_frame` copies the water height from `sim->u` straight
+ * into the frame's slot in the mapping, with no buffer or `write` call
+ * in between; the page cache writes the pages back in the background.
+ * If the run ends early (at a checkpoint stop), `viz_close` cuts the
+ * file down to the frames that were written.
+ *
+ * We rarely look at a frame at full resolution, so the output can be
+ * reduced before it is written.  The options give a window of the
+ * domain (`region`, in domain coordinates, widened to whole cells), a
+ * `stride` so that each output pixel covers `stride` by `stride`
+ * cells, either averaged or (with `average` off) sampled at the
+ * pixel's lower left cell, and a mask of the `fields` to keep (bit
+ * `k` for field `k`; the original format only has room for the first
+ * one).  The file then holds the reduced grid, and a frame file
+ * records the pixel size as its cell size.  The reduction is done in
+ * `viz_snapshot` as it copies the frame out of `sim->u`, in parallel
+ * over the output rows when the window is large enough to be worth
+ * the threads.
+ *
+ * For watching a run live, the frames can also be streamed to a
+ * shared memory ring (see `framering.h`) instead of a file (the
+ * `stream` option); the `nbuf` field is then the number of frames the
+ * ring holds.  Each frame is copied straight into the next slot of
+ * the ring, so the solver never waits: a reader that cannot keep up
+ * misses frames rather than holding up the run.  The `FrameRing`
+ * class in the visualizer reads the ring.
  */
 
-FILE* viz_open(const char* fname, central2d_t* sim)
+typedef struct viz_opts_t {
+    bool raw;               // Original format (water height only)
+    bool map;               // ... written through a memory map
+    bool stream;            // Shared memory ring (all fields)
+    frame_codec_t codec;    // Compression for frame files
+    int keep_bits;          // Significand bits kept (0 for lossless)
+    int nbuf;               // Frames that may be in flight
+    float region[4];        // Window xlo, ylo, xhi, yhi (all if empty)
+    int stride;             // Cells per output pixel in x and y
+    bool average;           // Average over pixels (else sample)
+    unsigned fields;        // Mask of fields written (0 for all)
+} viz_opts_t;
+
+typedef struct viz_t {
+    frame_writer_t* writer;
+    frame_ring_t* ring;     // Shared memory ring (NULL if not streaming)
+    int nfield;             // Fields per frame
+    float* map;             // Mapped output file (NULL if not mapped)
+    size_t map_size;        // Bytes mapped
+    int fd;                 // Descriptor of the mapped file
+    int frame, nframe;      // Frames written and room in the mapping
+    int x0, y0, wx, wy;     // Window of cells written
+    int nx, ny;             // Output pixels in x and y
+    int stride;             // Cells per output pixel in x and y
+    bool average;           // Average over pixels (else sample)
+    unsigned fields;        // Mask of fields written
+} viz_t;
+
+// Smallest window (in cells) that we copy out with several threads
+#define VIZ_PARALLEL_CELLS 65536
+
+
+static
+int viz_raw_write(void* ctx, const void* frame, size_t nbytes, double t)
+{
+    return fwrite(frame, 1, nbytes, (FILE*) ctx) != nbytes;
+}
+
+static
+int viz_raw_close(void* ctx)
+{
+    return fclose((FILE*) ctx);
+}
+
+static
+int viz_file_write(void* ctx, const void* frame, size_t nbytes, double t)
+{
+    return frame_file_write((frame_file_t*) ctx, (const float*) frame, t);
+}
+
+static
+int viz_file_close(void* ctx)
+{
+    return frame_file_close((frame_file_t*) ctx);
+}
+
+
+// Set up the window, pixels, and fields for the output options
+static
+viz_t* viz_alloc(central2d_t* sim, const viz_opts_t* opts)
 {
-    FILE* fp = fopen(fname, "w");
-    if (fp) {
-        float xy[2] = {sim->nx, sim->ny};
+    viz_t* viz = (viz_t*) calloc(1, sizeof(viz_t));
+    const float* r = opts->region;
+    int x0 = 0, y0 = 0, x1 = sim->nx, y1 = sim->ny;
+    if (r[2] > r[0] && r[3] > r[1]) {
+        x0 = floor(r[0] / sim->dx);
+        y0 = floor(r[1] / sim->dy);
+        x1 = ceil(r[2] / sim->dx);
+        y1 = ceil(r[3] / sim->dy);
+        x0 = (x0 < 0 ? 0 : x0);
+        y0 = (y0 < 0 ? 0 : y0);
+        x1 = (x1 > sim->nx ? sim->nx : x1);
+        y1 = (y1 > sim->ny ? sim->ny : y1);
+        if (x1 <= x0 || y1 <= y0) {
+            fprintf(stderr, "Output region is outside the domain\n");
+            free(viz);
+            return NULL;
+        }
+    }
+    int stride = (opts->stride > 1 ? opts->stride : 1);
+    unsigned all = (1u << sim->nfield) - 1;
+    unsigned fields = (opts->fields & all ? opts->fields & all : all);
+    if (opts->raw)
+        fields &= -fields;  // Lowest selected field only
+    viz->x0 = x0;
+    viz->y0 = y0;
+    viz->wx = x1 - x0;
+    viz->wy = y1 - y0;
+    viz->nx = (viz->wx + stride - 1) / stride;
+    viz->ny = (viz->wy + stride - 1) / stride;
+    viz->stride = stride;
+    viz->average = opts->average;
+    viz->fields = fields;
+    for (int k = 0; k < sim->nfield; ++k)
+        viz->nfield += (fields >> k) & 1;
+    return viz;
+}
+
+
+static
+viz_t* viz_map_open(const char* fname, viz_t* viz, int nframe)
+{
+    size_t frame_size = (size_t) viz->nx * viz->ny * sizeof(float);
+    size_t size = 2*sizeof(float) + nframe * frame_size;
+    int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, size) != 0) {
+        fprintf(stderr, "Could not create output file %s\n", fname);
+        if (fd >= 0)
+            close(fd);
+        free(viz);
+        return NULL;
+    }
+    float* map = (float*) mmap(NULL, size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Could not map output file %s\n", fname);
+        close(fd);
+        free(viz);
+        return NULL;
+    }
+    map[0] = viz->nx;
+    map[1] = viz->ny;
+    viz->map = map;
+    viz->map_size = size;
+    viz->fd = fd;
+    viz->frame = 0;
+    viz->nframe = nframe;
+    return viz;
+}
+
+viz_t* viz_open(const char* fname, central2d_t* sim, const viz_opts_t* opts,
+                int nframe)
+{
+    frame_sink_t sink;
+    viz_t* viz = viz_alloc(sim, opts);
+    if (!viz)
+        return NULL;
+    if (opts->raw && opts->map)
+        return viz_map_open(fname, viz, nframe);
+    if (opts->stream) {
+        viz->ring = frame_ring_create(fname, viz->nx, viz->ny, viz->nfield,
+                                      sim->dx * viz->stride,
+                                      sim->dy * viz->stride, opts->nbuf);
+        if (!viz->ring) {
+            fprintf(stderr, "Could not create frame ring %s\n", fname);
+            free(viz);
+            return NULL;
+        }
+        return viz;
+    }
+    if (opts->raw) {
+        FILE* fp = fopen(fname, "w");
+        if (!fp) {
+            free(viz);
+            return NULL;
+        }
+        float xy[2] = {viz->nx, viz->ny};
         fwrite(xy, sizeof(float), 2, fp);
+        sink.ctx = fp;
+        sink.write = viz_raw_write;
+        sink.close = viz_raw_close;
+    } else {
+        sink.ctx = frame_file_create(fname, viz->nx, viz->ny, viz->nfield,
+                                     sim->dx * viz->stride,
+                                     sim->dy * viz->stride,
+                                     opts->codec, opts->keep_bits);
+        if (!sink.ctx) {
+            fprintf(stderr, "Could not create frame file %s\n", fname);
+            free(viz);
+            return NULL;
+        }
+        sink.write = viz_file_write;
+        sink.close = viz_file_close;
     }
-    return fp;
+    viz->map = NULL;
+    viz->writer = frame_writer_open(sink,
+                                    viz->nfield * viz->nx * viz->ny *
+                                    sizeof(float),
+                                    opts->nbuf);
+    return viz;
 }
 
-void viz_close(FILE* fp)
+void viz_close(viz_t* viz)
 {
-    fclose(fp);
+    if (!viz)
+        return;
+    if (viz->map) {
+        size_t frame_size = (viz->map_size - 2*sizeof(float)) / viz->nframe;
+        size_t size = 2*sizeof(float) + viz->frame * frame_size;
+        if (munmap(viz->map, viz->map_size) != 0 ||
+            (size < viz->map_size && ftruncate(viz->fd, size) != 0) ||
+            close(viz->fd) != 0)
+            fprintf(stderr, "Error writing output frames\n");
+    } else if (viz->ring) {
+        if (frame_ring_close(viz->ring) != 0)
+            fprintf(stderr, "Error closing frame ring\n");
+    } else if (frame_writer_close(viz->writer) != 0) {
+        fprintf(stderr, "Error writing output frames\n");
+    }
+    free(viz);
 }
 
-void viz_frame(FILE* fp, central2d_t* sim)
+// Copy field k over the window into a contiguous nx-by-ny array of pixels
+void viz_snapshot(float* restrict dst, const viz_t* viz, central2d_t* sim,
+                  int k)
 {
-    if (fp)
-        for (int iy = 0; iy < sim->ny; ++iy)
-            fwrite(sim->u + central2d_offset(sim,0,0,iy),
-                   sizeof(float), sim->nx, fp);
+    int nx = viz->nx, wx = viz->wx, wy = viz->wy;
+    int s = viz->stride, cs = sim->cell_stride;
+    #pragma omp parallel for schedule(static) \
+        if ((long) wx * wy >= VIZ_PARALLEL_CELLS)
+    for (int j = 0; j < viz->ny; ++j) {
+        int iy0 = j*s, iy1 = (iy0 + s < wy ? iy0 + s : wy);
+        float* row = dst + j*nx;
+        const float* uk = sim->u + central2d_offset(sim, k, viz->x0,
+                                                    viz->y0 + iy0);
+        if (s == 1 && cs == 1) {
+            memcpy(row, uk, nx * sizeof(float));
+        } else if (s == 1 || !viz->average) {
+            for (int i = 0; i < nx; ++i)
+                row[i] = uk[i*s*cs];
+        } else {
+            for (int i = 0; i < nx; ++i)
+                row[i] = 0;
+            for (int iy = iy0; iy < iy1; ++iy) {
+                const float* ukr = sim->u +
+                    central2d_offset(sim, k, viz->x0, viz->y0 + iy);
+                for (int i = 0; i < nx; ++i) {
+                    int ix1 = ((i+1)*s < wx ? (i+1)*s : wx);
+                    float sum = 0;
+                    for (int ix = i*s; ix < ix1; ++ix)
+                        sum += ukr[ix*cs];
+                    row[i] += sum;
+                }
+            }
+            for (int i = 0; i < nx; ++i) {
+                int ix1 = ((i+1)*s < wx ? (i+1)*s : wx);
+                row[i] /= (ix1 - i*s) * (iy1 - iy0);
+            }
+        }
+    }
+}
+
+void viz_frame(viz_t* viz, central2d_t* sim, double t)
+{
+    if (!viz)
+        return;
+    central2d_sync(sim);
+    size_t frame_size = (size_t) viz->nx * viz->ny;
+    if (viz->map) {
+        int k = 0;
+        while (!((viz->fields >> k) & 1))
+            ++k;
+        if (viz->frame < viz->nframe)
+            viz_snapshot(viz->map + 2 + viz->frame * frame_size, viz, sim, k);
+        ++viz->frame;
+        return;
+    }
+    float* frame = (viz->ring ? frame_ring_begin(viz->ring) :
+                    (float*) frame_writer_acquire(viz->writer));
+    float* dst = frame;
+    for (int k = 0; k < sim->nfield; ++k)
+        if ((viz->fields >> k) & 1) {
+            viz_snapshot(dst, viz, sim, k);
+            dst += frame_size;
+        }
+    if (viz->ring)
+        frame_ring_publish(viz->ring, t);
+    else
+        frame_writer_submit(viz->writer, frame, t);
 }
 
 /**
@@ -152,23 +530,211 @@ const char* lget_string(lua_State* L, const char* name, const char* x)
  * We specify the initial conditions by providing the simulator
  * with a callback function to be called at each cell center.
  * The callback function is assumed to be the `init` field of
- * a table at index 1.
+ * a table at index 1.  The local cells of `sim` are offset by
+ * `(x0,y0)` from the global grid (this is only nonzero for the
+ * blocks in the MPI solver).  We go through the cells in row order, so
+ * that the writes to `sim->u` are contiguous.  If `init` is a string
+ * rather than a function, it names one of the built-in initial
+ * conditions of `initcond.h`, which we use instead.
+ *
+ * Calling Lua for every cell is slow on big grids, so with
+ * `nthreads` other than one (zero means all the OpenMP threads) we
+ * try to spread the calls over several threads, each with its own
+ * Lua state.  A Lua function cannot be shared between states, so we
+ * serialize the bytecode with `lua_dump` and load it in each worker
+ * state, then copy the values of its upvalues and of any globals that
+ * the standard libraries do not define.  Only numbers, strings, and
+ * booleans can be copied this way, so the parallel path works for
+ * functions like those in `tests.lua` that only compute from their
+ * arguments.  If a function refers to a table or to another function
+ * in an upvalue, or if a call fails in a worker (for example because
+ * the function calls a global helper function), we fall back to the
+ * serial loop.
  */
 
-void lua_init_sim(lua_State* L, central2d_t* sim)
+#ifdef _OPENMP
+typedef struct lua_chunk_t {
+    char* data;
+    size_t n;
+} lua_chunk_t;
+
+
+static
+int lua_chunk_writer(lua_State* L, const void* p, size_t sz, void* ud)
+{
+    lua_chunk_t* chunk = (lua_chunk_t*) ud;
+    chunk->data = (char*) realloc(chunk->data, chunk->n + sz);
+    memcpy(chunk->data + chunk->n, p, sz);
+    chunk->n += sz;
+    return 0;
+}
+
+
+// Push a copy of a number, string, or boolean value from L onto L2
+static
+bool lua_copy_scalar(lua_State* L, int i, lua_State* L2)
+{
+    switch (lua_type(L, i)) {
+    case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+        if (lua_isinteger(L, i)) {
+            lua_pushinteger(L2, lua_tointeger(L, i));
+            return true;
+        }
+#endif
+        lua_pushnumber(L2, lua_tonumber(L, i));
+        return true;
+    case LUA_TSTRING: {
+        size_t n;
+        const char* str = lua_tolstring(L, i, &n);
+        lua_pushlstring(L2, str, n);
+        return true;
+    }
+    case LUA_TBOOLEAN:
+        lua_pushboolean(L2, lua_toboolean(L, i));
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+// Copy the scalar globals of L that are not yet defined in L2
+static
+void lua_copy_globals(lua_State* L, lua_State* L2)
+{
+    lua_getglobal(L, "_G");
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        if (lua_type(L, -2) == LUA_TSTRING) {
+            const char* name = lua_tostring(L, -2);
+            lua_getglobal(L2, name);
+            bool defined = !lua_isnil(L2, -1);
+            lua_pop(L2, 1);
+            if (!defined && lua_copy_scalar(L, -1, L2))
+                lua_setglobal(L2, name);
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+
+// Make a Lua state with a copy of the function on top of the stack of L
+static
+lua_State* lua_init_worker(lua_State* L, const lua_chunk_t* chunk)
+{
+    lua_State* L2 = luaL_newstate();
+    luaL_openlibs(L2);
+    lua_copy_globals(L, L2);
+    if (luaL_loadbuffer(L2, chunk->data, chunk->n, "init") != 0) {
+        lua_close(L2);
+        return NULL;
+    }
+    const char* name;
+    for (int i = 1; (name = lua_getupvalue(L, -1, i)) != NULL; ++i) {
+        bool ok = true;
+        if (strcmp(name, "_ENV") == 0)
+            lua_getglobal(L2, "_G");
+        else
+            ok = lua_copy_scalar(L, -1, L2);
+        lua_pop(L, 1);
+        if (!ok) {
+            lua_close(L2);
+            return NULL;
+        }
+        lua_setupvalue(L2, -2, i);
+    }
+    return L2;
+}
+
+
+static
+bool lua_init_parallel(lua_State* L, central2d_t* sim, int x0, int y0,
+                       int nthreads)
+{
+    if (nthreads <= 0)
+        nthreads = omp_get_max_threads();
+    lua_chunk_t chunk = {NULL, 0};
+#if LUA_VERSION_NUM >= 503
+    bool ok = (lua_dump(L, lua_chunk_writer, &chunk, 0) == 0);
+#else
+    bool ok = (lua_dump(L, lua_chunk_writer, &chunk) == 0);
+#endif
+    lua_State** workers = (lua_State**) calloc(nthreads, sizeof(lua_State*));
+    for (int i = 0; ok && i < nthreads; ++i)
+        ok = ((workers[i] = lua_init_worker(L, &chunk)) != NULL);
+    free(chunk.data);
+
+    int nx = sim->nx, ny = sim->ny, nfield = sim->nfield;
+    float dx = sim->dx, dy = sim->dy;
+    float* u = sim->u;
+    int failed = !ok;
+    if (ok)
+    #pragma omp parallel for schedule(static) num_threads(nthreads) \
+        reduction(+:failed)
+    for (int iy = 0; iy < ny; ++iy) {
+        lua_State* L2 = workers[omp_get_thread_num()];
+        float y = (y0 + iy + 0.5) * dy;
+        for (int ix = 0; !failed && ix < nx; ++ix) {
+            float x = (x0 + ix + 0.5) * dx;
+            lua_pushvalue(L2, 1);
+            lua_pushnumber(L2, x);
+            lua_pushnumber(L2, y);
+            if (lua_pcall(L2, 2, nfield, 0) != 0) {
+                lua_settop(L2, 1);
+                failed = 1;
+                break;
+            }
+            for (int k = 0; k < nfield; ++k)
+                u[central2d_offset(sim,k,ix,iy)] = lua_tonumber(L2, k-nfield);
+            lua_pop(L2, nfield);
+        }
+    }
+
+    for (int i = 0; i < nthreads; ++i)
+        if (workers[i])
+            lua_close(workers[i]);
+    free(workers);
+    return !failed;
+}
+#else
+static
+bool lua_init_parallel(lua_State* L, central2d_t* sim, int x0, int y0,
+                       int nthreads)
+{
+    return false;
+}
+#endif
+
+
+void lua_init_sim(lua_State* L, central2d_t* sim, int x0, int y0,
+                  int nthreads)
 {
     lua_getfield(L, 1, "init");
+    if (lua_type(L, -1) == LUA_TSTRING) {
+        init_fun_t init = init_lookup(lua_tostring(L, -1));
+        if (!init)
+            luaL_error(L, "Unknown initial condition %s", lua_tostring(L, -1));
+        init_cells(sim, init, x0, y0);
+        lua_pop(L, 1);
+        return;
+    }
     if (lua_type(L, -1) != LUA_TFUNCTION)
-        luaL_error(L, "Expected init to be a string");
+        luaL_error(L, "Expected init to be a function or a string");
+    if (nthreads != 1 && lua_init_parallel(L, sim, x0, y0, nthreads)) {
+        lua_pop(L, 1);
+        return;
+    }
 
     int nx = sim->nx, ny = sim->ny, nfield = sim->nfield;
     float dx = sim->dx, dy = sim->dy;
     float* u = sim->u;
 
-    for (int ix = 0; ix < nx; ++ix) {
-        float x = (ix + 0.5) * dx;
-        for (int iy = 0; iy < ny; ++iy) {
-            float y = (iy + 0.5) * dy;
+    for (int iy = 0; iy < ny; ++iy) {
+        float y = (y0 + iy + 0.5) * dy;
+        for (int ix = 0; ix < nx; ++ix) {
+            float x = (x0 + ix + 0.5) * dx;
             lua_pushvalue(L, -1);
             lua_pushnumber(L, x);
             lua_pushnumber(L, y);
@@ -183,18 +749,417 @@ void lua_init_sim(lua_State* L, central2d_t* sim)
 }
 
 
+/**
+ * ### Checkpoints
+ *
+ * With a `checkpoint` file name, we save the solver state to that file
+ * (see `checkpoint.h`) every `checkpoint_every` frames, and also when
+ * the job gets a `SIGTERM` (which is how PBS warns a job that it is
+ * about to hit its wall time).  The signal handler only sets a flag;
+ * we check it after each frame, write the checkpoint, and then shut
+ * down as usual, so the output file is complete up to that frame.  In
+ * the MPI build, every rank writes its own file (with the rank number
+ * appended to the name), and the ranks agree on whether to stop so
+ * that they all save the same frame.
+ *
+ * A `restart` file name replaces the initial conditions: we read the
+ * solution from the checkpoint instead of calling the `init` function,
+ * and continue from the frame and time where it was saved.  The grid
+ * must be the same size (and, for MPI, split over the same number of
+ * ranks), but the other solver options may differ.  The output starts
+ * over in the `out` file, with the restart state as its first frame.
+ */
+
+static volatile sig_atomic_t driver_stop = 0;
+
+static
+void driver_sigterm(int sig)
+{
+    driver_stop = 1;
+}
+
+
+// Return whether any rank has been asked to stop
+static
+bool driver_stopping(void)
+{
+    int stop = driver_stop;
+#ifdef USE_MPI
+    MPI_Allreduce(MPI_IN_PLACE, &stop, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+#endif
+    return stop != 0;
+}
+
+
+// File name for this rank (the caller frees it)
+static
+char* driver_rank_name(const char* fname)
+{
+    char* name = (char*) malloc(strlen(fname) + 16);
+#ifdef USE_MPI
+    sprintf(name, "%s.%d", fname, driver_rank);
+#else
+    strcpy(name, fname);
+#endif
+    return name;
+}
+
+
+void lua_init_or_restart(lua_State* L, central2d_t* sim, int x0, int y0,
+                         int gnx, int gny,
+                         const char* restart, checkpoint_info_t* info)
+{
+    info->t = 0;
+    info->nstep = 0;
+    info->frame = 0;
+    if (!restart) {
+        const char* init_file = lget_string(L, "init_file", NULL);
+        if (!init_file)
+            lua_init_sim(L, sim, x0, y0, lget_int(L, "init_threads", 1));
+        else if (init_load(sim, init_file, x0, y0, gnx, gny) != 0)
+            luaL_error(L, "Could not load initial state from %s", init_file);
+        return;
+    }
+    char* name = driver_rank_name(restart);
+    int status = checkpoint_read(sim, name, info);
+    free(name);
+    if (status != 0)
+        luaL_error(L, "Could not restart from %s", restart);
+    if (driver_rank == 0)
+        printf("Restart: frame %d, time %g, %lld steps\n",
+               info->frame, info->t, (long long) info->nstep);
+}
+
+
+/**
+ * With adaptive mesh refinement, we build the refined levels from the
+ * initial state one at a time.  Unless the state came from a file or a
+ * checkpoint (which only hold the base grid), we set the initial
+ * condition on the new patches at their own resolution before picking
+ * the patches for the next level.
+ */
+
+#ifndef USE_MPI
+void lua_init_amr(lua_State* L, amr_t* amr, bool from_file)
+{
+    for (int l = 1; l < amr->nlevel; ++l) {
+        amr_regrid(amr);
+        for (int m = 1; !from_file && m < amr->nlevel; ++m)
+            for (int n = 0; n < amr->level[m].npatch; ++n) {
+                amr_patch_t* p = amr->level[m].patches[n];
+                lua_init_sim(L, p->sim, p->x0, p->y0,
+                             lget_int(L, "init_threads", 1));
+            }
+        amr_average(amr);
+    }
+}
+
+
+int driver_run(central2d_t* sim, amr_t* amr, float tfinal)
+{
+    return (amr ? amr_run(amr, tfinal) : central2d_run(sim, tfinal));
+}
+#endif
+
+
+void driver_checkpoint(central2d_t* sim, const char* fname,
+                       const checkpoint_info_t* info, bool direct)
+{
+    char* name = driver_rank_name(fname);
+    central2d_sync(sim);
+    if (checkpoint_write(sim, name, info, direct) != 0)
+        fprintf(stderr, "Could not write checkpoint %s\n", name);
+    else if (driver_rank == 0)
+        printf("Checkpoint: %s (frame %d)\n", fname, info->frame);
+    free(name);
+}
+
+
+/**
+ * ### Solver options
+ *
+ * Solver options given by name in the Lua table are translated
+ * to the corresponding settings in the solver structure.
+ */
+
+void lua_set_engine(lua_State* L, central2d_t* sim, const char* engine)
+{
+    if (strcmp(engine, "fused") == 0)
+        central2d_set_engine(sim, CENTRAL2D_FUSED);
+    else if (strcmp(engine, "reference") == 0)
+        central2d_set_engine(sim, CENTRAL2D_REFERENCE);
+    else if (strcmp(engine, "device") == 0)
+        central2d_set_engine(sim, CENTRAL2D_DEVICE);
+    else
+        luaL_error(L, "Unknown engine %s", engine);
+}
+
+
+void lua_set_kernels(lua_State* L, central2d_t* sim, const char* kernels)
+{
+    if (strcmp(kernels, "specialized") == 0)
+        central2d_set_kernels(sim, &shallow2d_kernels);
+    else if (strcmp(kernels, "general") == 0)
+        central2d_set_kernels(sim, NULL);
+    else
+        luaL_error(L, "Unknown kernels %s", kernels);
+}
+
+
+void lua_set_bc(lua_State* L, central2d_t* sim)
+{
+    const char* bc = lget_string(L, "bc", "periodic");
+    const char* dirs = lget_string(L, "bc_dirs", "xy");
+    int mask = 0;
+    for (const char* c = dirs; *c; ++c) {
+        if (*c == 'x')
+            mask |= CENTRAL2D_LEFT | CENTRAL2D_RIGHT;
+        else if (*c == 'y')
+            mask |= CENTRAL2D_BOTTOM | CENTRAL2D_TOP;
+        else
+            luaL_error(L, "Unknown direction %c in bc_dirs", *c);
+    }
+    if (strcmp(bc, "walls") == 0)
+        central2d_set_bc(sim, shallow2d_walls, mask);
+    else if (strcmp(bc, "outflow") == 0)
+        central2d_set_bc(sim, central2d_outflow, mask);
+    else if (strcmp(bc, "periodic") == 0)
+        central2d_set_bc(sim, NULL, 0);
+    else
+        luaL_error(L, "Unknown boundary condition %s", bc);
+}
+
+
+void lua_set_simd(lua_State* L, const char* name)
+{
+    int level = simd_parse(name);
+    if (level < 0)
+        luaL_error(L, "Unknown SIMD level %s", name);
+    simd_set_level((simd_level_t) level);
+}
+
+
+central2d_storage_t lua_get_storage(lua_State* L, const char* name)
+{
+    if (strcmp(name, "fp16") == 0)
+        return CENTRAL2D_FLOAT16;
+    else if (strcmp(name, "bf16") == 0)
+        return CENTRAL2D_BFLOAT16;
+    else if (strcmp(name, "float") != 0)
+        luaL_error(L, "Unknown storage format %s", name);
+    return CENTRAL2D_FLOAT32;
+}
+
+
+central2d_layout_t lua_get_layout(lua_State* L, const char* name)
+{
+    if (strcmp(name, "row") == 0)
+        return CENTRAL2D_ROW_INTERLEAVED;
+    else if (strcmp(name, "cell") == 0)
+        return CENTRAL2D_CELL_INTERLEAVED;
+    else if (strcmp(name, "field") != 0)
+        luaL_error(L, "Unknown layout %s", name);
+    return CENTRAL2D_FIELD_MAJOR;
+}
+
+
+speed_t lua_get_speed(lua_State* L, const char* name)
+{
+    if (strcmp(name, "fast") == 0)
+        return shallow2d_speed_fast;
+    else if (strcmp(name, "exact") != 0)
+        luaL_error(L, "Unknown speed estimate %s", name);
+    return shallow2d_speed;
+}
+
+
+void lua_set_check_sums(lua_State* L, const char* name)
+{
+    if (strcmp(name, "double") == 0)
+        check_double = true;
+    else if (strcmp(name, "float") == 0)
+        check_double = false;
+    else
+        luaL_error(L, "Unknown check_sums precision %s", name);
+}
+
+
+static
+void lua_get_viz_region(lua_State* L, float* region)
+{
+    for (int i = 0; i < 4; ++i)
+        region[i] = 0;
+    lua_getfield(L, 1, "out_region");
+    if (lua_type(L, -1) != LUA_TNIL) {
+        if (!lua_istable(L, -1) || lua_rawlen(L, -1) != 4)
+            luaL_error(L, "Expected out_region to be {xlo, ylo, xhi, yhi}");
+        for (int i = 0; i < 4; ++i) {
+            lua_rawgeti(L, -1, i+1);
+            if (lua_type(L, -1) != LUA_TNUMBER)
+                luaL_error(L, "Expected out_region to be {xlo, ylo, xhi, yhi}");
+            region[i] = lua_tonumber(L, -1);
+            lua_pop(L, 1);
+        }
+        if (region[2] <= region[0] || region[3] <= region[1])
+            luaL_error(L, "Empty out_region");
+    }
+    lua_pop(L, 1);
+}
+
+
+static
+unsigned lua_get_viz_fields(lua_State* L, const char* names)
+{
+    static const char* field_names[] = {"h", "hu", "hv"};
+    unsigned fields = 0;
+    while (*names) {
+        size_t n = strcspn(names, " ,");
+        if (n > 0) {
+            int k = 0;
+            while (k < 3 && (strlen(field_names[k]) != n ||
+                             strncmp(names, field_names[k], n) != 0))
+                ++k;
+            if (k == 3)
+                luaL_error(L, "Unknown output field %.*s", (int) n, names);
+            fields |= 1u << k;
+        }
+        names += n + (names[n] != 0);
+    }
+    return fields;
+}
+
+
+void lua_get_viz_opts(lua_State* L, viz_opts_t* opts)
+{
+    const char* out_format = lget_string(L, "out_format", "frames");
+    const char* compress = lget_string(L, "compress", "none");
+    opts->map = (strcmp(out_format, "mmap") == 0);
+    opts->raw = (opts->map || strcmp(out_format, "raw") == 0);
+    opts->stream = (strcmp(out_format, "stream") == 0);
+    opts->codec = (strcmp(compress, "zlib") == 0 ? FRAME_ZLIB : FRAME_RAW);
+    opts->keep_bits = lget_int(L, "keep_bits", 0);
+    opts->nbuf = lget_int(L, "out_buffers", 2);
+    if (!opts->raw && !opts->stream && strcmp(out_format, "frames") != 0)
+        luaL_error(L, "Unknown output format %s", out_format);
+    if (opts->codec == FRAME_RAW && strcmp(compress, "none") != 0)
+        luaL_error(L, "Unknown compression %s", compress);
+    const char* sample = lget_string(L, "out_sample", "average");
+    lua_get_viz_region(L, opts->region);
+    opts->stride = lget_int(L, "out_stride", 1);
+    opts->average = (strcmp(sample, "average") == 0);
+    opts->fields = lua_get_viz_fields(L, lget_string(L, "out_fields", ""));
+    if (opts->stride < 1)
+        luaL_error(L, "Expected out_stride to be positive");
+    if (!opts->average && strcmp(sample, "point") != 0)
+        luaL_error(L, "Unknown output sampling %s", sample);
+}
+
+
 /**
  * ### Running the simulation
  *
  * The `run_sim` function looks a lot like the main routine of the
  * "ordinary" command line driver.  We specify the initial conditions
  * by providing the simulator with a callback function to be called at
- * each cell center.  Note that we have two different options for
- * timing the steps -- we can use the OpenMP timing routines
- * (preferable if OpenMP is available) or the POSIX `gettimeofday`
- * if the `SYSTIME` macro is defined.  If there's no OpenMP and
- * `SYSTIME` is undefined, we fall back to just printing the number
- * of steps without timing information.
+ * each cell center.  Note that we have several different options for
+ * timing the steps -- we can use the MPI timer in the MPI build,
+ * the OpenMP timing routines (preferable if OpenMP is available),
+ * or the POSIX `gettimeofday` if the `SYSTIME` macro is defined.
+ * If there's no OpenMP and `SYSTIME` is undefined, we fall back to
+ * just printing the number of steps without timing information.
+ *
+ * The `engine` field selects the implementation of the time step
+ * (`"reference"`, `"fused"`, or `"device"`; see `central2d_engine_t`).
+ * With the device engine, the solution stays on the device between
+ * frames, and the diagnostics, output, and checkpoints copy it back
+ * (with `central2d_sync`) when they need it.  The
+ * `kernels` field says whether to use the step kernels specialized
+ * for the shallow water equations (`"specialized"`, the default) or
+ * the general ones (`"general"`; see `central2d_set_kernels`).
+ * The `simd` field selects the vector kernels (`"auto"` by default,
+ * or one of the names in `simd.h`), and setting `speed` to `"fast"`
+ * rather than `"exact"` uses the approximate wave speed estimates
+ * (see `shallow2d_speed_fast`).  With the exact speeds, the shared
+ * memory solver computes them together with the fluxes (see
+ * `central2d_set_flux_speed`).  The `layout` field sets the storage
+ * layout: `"field"` (field-major, the default), `"row"`, or `"cell"`
+ * (see `central2d_layout_t`).  The `bc` field is the boundary
+ * condition: `"periodic"` (the default), `"walls"` (see
+ * `shallow2d_walls`), or `"outflow"` (see `central2d_outflow`), on the
+ * sides in the directions listed in `bc_dirs` (`"xy"` by default, or
+ * `"x"` or `"y"` for a channel that stays periodic in the other
+ * direction).  Setting `hugepages` or `first_touch`
+ * to a nonzero value turns on huge page backing or parallel first
+ * touch for the solver arrays (see `memalloc.h`).  The `out_buffers`
+ * field is the number of output frames that may be queued for the
+ * background writer (2 by default, for double buffering; 0 writes
+ * each frame before continuing).  Setting `out_format` to `"raw"`
+ * rather than `"frames"` writes the original output format, and
+ * `"mmap"` writes the same format through a memory map of the output
+ * file (see the notes on I/O above; `out_buffers` does not apply).
+ * With `"stream"`, the frames go to a shared memory ring in the file
+ * `out` (best put in `/dev/shm`) holding `out_buffers` frames, for a
+ * live view with `visualizer.py`.  For frame files, `compress` is
+ * `"none"` (the default) or `"zlib"`, and a nonzero `keep_bits` rounds
+ * the output to that many significand bits (see `framefile.h`).  To
+ * write less than the full grid, set `out_region` to
+ * `{xlo, ylo, xhi, yhi}` (in domain coordinates) for a window of the
+ * domain, `out_stride` to the number of cells per output pixel in each
+ * direction, `out_sample` to `"average"` (the default) or `"point"`
+ * for how the pixels are computed, and `out_fields` to a list of the
+ * fields to write, such as `"h"` or `"h, hu"` (all three by default,
+ * and the original format only writes the first); see the notes on
+ * I/O above.  The MPI build always writes the whole grid.  The
+ * `storage`
+ * field keeps the solution in `"float"` (the default), `"fp16"`, or
+ * `"bf16"` between steps; the 16-bit formats are only used by the
+ * serial solver with the fused engine on a periodic domain (see
+ * `central2d_set_storage`).
+ * Setting `check_sums` to `"double"` rather than `"float"` accumulates
+ * the diagnostic sums in double precision (see the notes on diagnostics
+ * above).
+ * The `px`, `py`, and `nbatch` fields control the tiled parallel mode
+ * (see `central2d_tile`).  By default, we use one tile per OpenMP
+ * thread, and only one step pair per ghost cell exchange; with more
+ * than one pair per exchange, a nonzero `local_steps` lets each tile
+ * take only as many steps as it needs (see `central2d_set_local_steps`).
+ * In the MPI build, `nbatch` is the number of step pairs per exchange
+ * of ghost cells between ranks, which gives each rank a deep halo
+ * (see `central2d_mpi_init`).
+ * A `lagged_cfl` between 0 and 1 takes each time step from the wave
+ * speeds of the step pair before, scaled by that factor, so that the
+ * tiles, the MPI ranks, or the device do not wait on the speed
+ * reduction (see `central2d_set_lagged_cfl`); the number of step pairs
+ * that had to be taken again is reported at the end.
+ * The `bx`
+ * and `by` fields set the block size for the cache blocked mode
+ * (see `central2d_block`), which is off by default; a negative `bx`
+ * means that the block size should be chosen by `central2d_tune_block`.
+ * A nonnegative `skip_tol` skips the blocks that are uniform to within
+ * that tolerance (see `central2d_set_skip`), and reports the fraction
+ * skipped after each frame; it turns on the blocked mode with 128 by 16
+ * blocks if no block size is given, but it has no effect in the tiled
+ * mode.
+ * Instead of an `init` function, we can start from the state in an
+ * `init_file` (see `init_load`); with an `init` function, the
+ * `init_threads` field sets the number of threads that call it (one
+ * by default).  The `checkpoint`, `checkpoint_every`, and `restart`
+ * fields are described above; setting `checkpoint_direct` to a nonzero value
+ * writes checkpoints with `O_DIRECT` where the system supports it.
+ * Setting `amr_levels` to more than one (in the shared memory build)
+ * turns on adaptive mesh refinement with that many levels, the base
+ * grid being the `nx` by `ny` grid (see `amr.h`); `amr_block` is the
+ * block size (32 by default, and `nx` and `ny` must be multiples of
+ * half of it), `amr_threshold` is the refinement threshold (0.02 by
+ * default), and `amr_regrid` is the number of base step pairs between
+ * regrids (2 by default).  The output, diagnostics, and checkpoints
+ * are for the base grid, which holds the averages of the finer levels;
+ * the tiled and blocked modes do not apply, and the domain must be
+ * periodic.
+ * In a build with `USE_PROFILE`, the `profile` field names a file for
+ * a summary of the time spent in each phase of the solver over all the
+ * frames (JSON if the name ends in `.json`, CSV otherwise; see
+ * `profile.h`).  As with checkpoints, each MPI rank writes its own.
  */
 
 int run_sim(lua_State* L)
@@ -211,44 +1176,437 @@ int run_sim(lua_State* L)
     int ny = lget_int(L, "ny", nx);
     int frames = lget_int(L, "frames", 50);
     const char* fname = lget_string(L, "out", "sim.out");
+    const char* engine = lget_string(L, "engine", "reference");
+    const char* kernels = lget_string(L, "kernels", "specialized");
+    lua_set_simd(L, lget_string(L, "simd", "auto"));
+    speed_t speed = lua_get_speed(L, lget_string(L, "speed", "exact"));
+    central2d_layout_t layout =
+        lua_get_layout(L, lget_string(L, "layout", "field"));
+    mem_set_flags((lget_int(L, "hugepages", 0) ? MEM_HUGEPAGES : 0) |
+                  (lget_int(L, "first_touch", 0) ? MEM_FIRST_TOUCH : 0));
+    lua_set_check_sums(L, lget_string(L, "check_sums", "float"));
+    const char* checkpoint = lget_string(L, "checkpoint", NULL);
+    int checkpoint_every = lget_int(L, "checkpoint_every", 0);
+    bool checkpoint_direct = lget_int(L, "checkpoint_direct", 0);
+    const char* restart = lget_string(L, "restart", NULL);
+    const char* profile = lget_string(L, "profile", NULL);
+    double lagged_cfl = lget_number(L, "lagged_cfl", 0);
+    int nbatch = lget_int(L, "nbatch", 1);
+    if (profile && !profile_enabled() && driver_rank == 0)
+        fprintf(stderr, "Built without USE_PROFILE; no phase timings\n");
+    checkpoint_info_t info;
+    if (checkpoint)
+        signal(SIGTERM, driver_sigterm);
+
+#ifdef USE_MPI
+    central2d_mpi_t* msim =
+        central2d_mpi_init(MPI_COMM_WORLD, w,h, nx,ny,
+                           3, shallow2d_flux, speed, cfl, layout,
+                           4*(nbatch > 1 ? nbatch : 1));
+    central2d_t* sim = msim->sim;
+    central2d_set_diagnostics(sim, check_double);
+    lua_set_engine(L,sim, engine);
+    lua_set_kernels(L,sim, kernels);
+    lua_set_bc(L,sim);
+    central2d_set_lagged_cfl(sim, lagged_cfl);
+    lua_init_or_restart(L,sim, msim->x0,msim->y0, nx,ny, restart, &info);
+    if (driver_rank == 0)
+        printf("%g %g %d %d %g %d %g\n"
+               "Ranks: %d x %d (%d step pairs per exchange)\nSIMD: %s\n",
+               w, h, nx, ny, cfl, frames, ftime,
+               msim->dims[1], msim->dims[0], sim->ng/4,
+               simd_name(simd_level()));
+    MPI_File viz = central2d_mpi_viz_open(msim, fname);
+    solution_check(sim);
+    central2d_mpi_viz_frame(msim, viz);
+#else
+    int px = lget_int(L, "px", 0);
+    int py = lget_int(L, "py", 0);
+    bool local_steps = lget_int(L, "local_steps", 0);
+    int bx = lget_int(L, "bx", 0);
+    int by = lget_int(L, "by", bx);
+    double skip_tol = lget_number(L, "skip_tol", -1);
+    if (skip_tol >= 0 && bx == 0) {
+        bx = 128;
+        by = lget_int(L, "by", 16);
+    }
+    int amr_levels = lget_int(L, "amr_levels", 1);
+    int amr_block = lget_int(L, "amr_block", 32);
+    central2d_storage_t storage =
+        lua_get_storage(L, lget_string(L, "storage", "float"));
+    viz_opts_t viz_opts;
+    lua_get_viz_opts(L, &viz_opts);
 
-    central2d_t* sim = central2d_init(w,h, nx,ny,
-                                      3, shallow2d_flux, shallow2d_speed, cfl);
-    lua_init_sim(L,sim);
+    central2d_t* sim = central2d_init_layout(w,h, nx,ny,
+                                             3, shallow2d_flux, speed, cfl,
+                                             layout);
+    if (speed == shallow2d_speed)
+        central2d_set_flux_speed(sim, shallow2d_flux_speed);
+    central2d_set_diagnostics(sim, check_double);
+    lua_set_engine(L,sim, engine);
+    lua_set_kernels(L,sim, kernels);
+    lua_set_bc(L,sim);
+    central2d_set_lagged_cfl(sim, lagged_cfl);
+    central2d_set_storage(sim, storage);
+    lua_init_or_restart(L,sim, 0,0, nx,ny, restart, &info);
+    amr_t* amr = NULL;
+    if (amr_levels > 1) {
+        if (sim->bc)
+            luaL_error(L, "AMR needs a periodic domain");
+        if (amr_levels > AMR_MAXLEVEL || amr_block < 8 || amr_block % 2 ||
+            nx % (amr_block/2) || ny % (amr_block/2))
+            luaL_error(L, "AMR needs at most %d levels and an even block "
+                       "size of at least 8 with half of it dividing nx "
+                       "and ny", AMR_MAXLEVEL);
+        amr = amr_init(sim, amr_levels, amr_block,
+                       lget_number(L, "amr_threshold", 0.02),
+                       lget_int(L, "amr_regrid", 2));
+        lua_init_amr(L, amr,
+                     restart || lget_string(L, "init_file", NULL));
+        px = py = 1;
+        bx = by = 0;
+    }
+    central2d_tile(sim, px, py, nbatch);
+    central2d_set_local_steps(sim, local_steps);
     printf("%g %g %d %d %g %d %g\n", w, h, nx, ny, cfl, frames, ftime);
-    FILE* viz = viz_open(fname, sim);
+    printf("SIMD: %s\n", simd_name(simd_level()));
+    if (sim->tiles)
+        printf("Tiles: %d x %d (%d step pairs per exchange%s)\n",
+               sim->px, sim->py, sim->nbatch,
+               sim->local_steps && sim->nbatch > 1 && !sim->bc ?
+               ", local steps" : "");
+    else if (bx < 0)
+        central2d_tune_block(sim, stdout);
+    else
+        central2d_block(sim, bx, by);
+    if (sim->block)
+        printf("Blocks: %d x %d\n", sim->bx, sim->by);
+    if (sim->block && skip_tol >= 0)
+        central2d_set_skip(sim, skip_tol);
+    else if (skip_tol >= 0)
+        fprintf(stderr, "Not in the blocked mode; not skipping blocks\n");
+    if (amr)
+        printf("AMR: %d levels of %d x %d blocks\n",
+               amr_levels, amr_block, amr_block);
+    else if (!sim->tiles && sim->engine == CENTRAL2D_FUSED &&
+             storage != CENTRAL2D_FLOAT32 && !sim->bc)
+        printf("Storage: %s\n", storage == CENTRAL2D_FLOAT16 ? "fp16" : "bf16");
+    viz_t* viz = viz_open(fname, sim, &viz_opts, frames - info.frame + 1);
     solution_check(sim);
-    viz_frame(viz, sim);
+    viz_frame(viz, sim, info.t);
+#endif
 
     double tcompute = 0;
-    for (int i = 0; i < frames; ++i) {
-#ifdef _OPENMP
+    profile_reset();
+    for (int i = info.frame; i < frames; ++i) {
+#ifdef USE_MPI
+        double t0 = MPI_Wtime();
+        int nstep = central2d_mpi_run(msim, ftime);
+        double t1 = MPI_Wtime();
+        double elapsed = t1-t0;
+#elif defined _OPENMP
         double t0 = omp_get_wtime();
-        int nstep = central2d_run(sim, ftime);
+        int nstep = driver_run(sim, amr, ftime);
         double t1 = omp_get_wtime();
         double elapsed = t1-t0;
 #elif defined SYSTIME
         struct timeval t0, t1;
         gettimeofday(&t0, NULL);
-        int nstep = central2d_run(sim, ftime);
+        int nstep = driver_run(sim, amr, ftime);
         gettimeofday(&t1, NULL);
         double elapsed = (t1.tv_sec-t0.tv_sec) + (t1.tv_usec-t0.tv_usec)*1e-6;
 #else
-        int nstep = central2d_run(sim, ftime);
+        int nstep = driver_run(sim, amr, ftime);
         double elapsed = 0;
 #endif
         solution_check(sim);
         tcompute += elapsed;
-        printf("  Time: %e (%e for %d steps)\n", elapsed, elapsed/nstep, nstep);
-        viz_frame(viz, sim);
+        info.t += ftime;
+        info.nstep += nstep;
+        info.frame = i+1;
+        if (driver_rank == 0)
+            printf("  Time: %e (%e for %d steps)\n",
+                   elapsed, elapsed/nstep, nstep);
+#ifdef USE_MPI
+        central2d_mpi_viz_frame(msim, viz);
+#else
+        if (sim->skip_tol >= 0) {
+            long long nskip, nblock;
+            central2d_skip_stats(sim, &nskip, &nblock);
+            printf("  Skipped: %.1f%% of %lld block steps\n",
+                   nblock ? 100.0 * nskip / nblock : 0.0, nblock);
+        }
+        if (amr) {
+            int npatch;
+            long ncell = amr_cells(amr, &npatch);
+            double nfine = (double) (nx << (amr_levels-1)) *
+                (ny << (amr_levels-1));
+            printf("  AMR: %d patches, %ld cells (%.1f%% of uniform)\n",
+                   npatch, ncell, 100 * ncell / nfine);
+        }
+        viz_frame(viz, sim, info.t);
+#endif
+        bool stop = (checkpoint && driver_stopping());
+        if (checkpoint && (stop || (checkpoint_every > 0 &&
+                                    info.frame % checkpoint_every == 0)))
+            driver_checkpoint(sim, checkpoint, &info, checkpoint_direct);
+        if (stop)
+            break;
+    }
+    if (driver_rank == 0)
+        printf("Total compute time: %e\n", tcompute);
+    if (driver_rank == 0) {
+        if (sim->tiles && sim->local_steps && sim->nbatch > 1 && !sim->bc)
+            printf("Batches taken again: %lld\n", sim->nrollback);
+        else if (sim->lag_safety > 0)
+            printf("Step pairs taken again: %lld\n", sim->nrollback);
+    }
+    if (profile && profile_enabled()) {
+        char* name = driver_rank_name(profile);
+        if (profile_write(name, tcompute) != 0)
+            fprintf(stderr, "Could not write profile %s\n", name);
+        free(name);
     }
-    printf("Total compute time: %e\n", tcompute);
 
+#ifdef USE_MPI
+    central2d_mpi_viz_close(viz);
+    central2d_mpi_free(msim);
+    return 0;
+#else
+    viz_close(viz);
+    if (amr)
+        amr_free(amr);
     central2d_free(sim);
     return 0;
+#endif
 }
 
 
+/**
+ * ### Ensembles
+ *
+ * Parameter sweeps are many small runs, and as separate jobs each pays
+ * for starting Lua, allocating and touching its arrays, and spinning
+ * up the threads.  The `simulate_batch` function (in the shared memory
+ * build) runs them in one process instead.  Its argument is a table
+ * whose list entries are the option tables for the runs, as they
+ * would be passed to `simulate`, and whose named fields are defaults
+ * shared by all the runs.  For example,
+ *
+ *     simulate_batch {
+ *       { cfl = 0.3 }, { cfl = 0.45 }, { nx = 400, out = "big.out" },
+ *       init = "dam", nx = 200, frames = 20, out = "sweep.out"
+ *     }
+ *
+ * A run without its own `out` writes to the shared name with its
+ * number appended (`sweep.out.1` and `sweep.out.2` here).  The runs
+ * may have any of the options for the grid, the physics, the boundary
+ * conditions, the step engine and kernels, the layout and storage, the
+ * output format, the initial state (`init`, `init_file`, and
+ * `init_threads`), and the tiled (`px`, `py`, `nbatch`) or blocked
+ * (`bx`, `by`) modes; the
+ * options that affect the whole process (`simd`, `hugepages`,
+ * `first_touch`, and `check_sums`) are taken from the shared fields.
+ * Checkpoints, restarts, adaptive refinement, and profiles are only
+ * for single runs.
+ *
+ * By default a run is not tiled (`px` and `py` are one), since the
+ * parallelism is across the runs: each frame, we advance all the runs
+ * that have frames left with `central2d_run_batch`, then check and
+ * write out each one in order, so the output is the same as from
+ * running them one at a time.  The runs can have different numbers of
+ * frames and frame times; the time reported for each frame is for the
+ * whole batch.
+ */
+
+#ifndef USE_MPI
+typedef struct batch_run_t {
+    central2d_t* sim;
+    viz_t* viz;
+    char* fname;            // Output file name
+    int frames;             // Number of frames
+    float ftime;            // Time between frames
+    double t;               // Current time
+    long long nstep;        // Steps taken
+} batch_run_t;
+
+
+static
+double driver_wtime(void)
+{
+#if defined _OPENMP
+    return omp_get_wtime();
+#elif defined SYSTIME
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec + t.tv_usec*1e-6;
+#else
+    return 0;
+#endif
+}
+
+
+// Copy the fields of the table at index src with string keys into the
+// table on top of the stack
+static
+void lua_copy_fields(lua_State* L, int src)
+{
+    lua_pushnil(L);
+    while (lua_next(L, src)) {
+        if (lua_type(L, -2) == LUA_TSTRING) {
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_settable(L, -4);
+        } else {
+            lua_pop(L, 1);
+        }
+    }
+}
+
+
+// Set up run i from the options at index 1 (the batch table is at 2)
+static
+void lua_batch_run(lua_State* L, batch_run_t* run, int i, bool own_out)
+{
+    double w = lget_number(L, "w", 2.0);
+    double h = lget_number(L, "h", w);
+    double cfl = lget_number(L, "cfl", 0.45);
+    int nx = lget_int(L, "nx", 200);
+    int ny = lget_int(L, "ny", nx);
+    int px = lget_int(L, "px", 1);
+    int py = lget_int(L, "py", 1);
+    int nbatch = lget_int(L, "nbatch", 1);
+    int bx = lget_int(L, "bx", 0);
+    int by = lget_int(L, "by", bx);
+    const char* fname = lget_string(L, "out", "sim.out");
+    const char* engine = lget_string(L, "engine", "reference");
+    const char* kernels = lget_string(L, "kernels", "specialized");
+    speed_t speed = lua_get_speed(L, lget_string(L, "speed", "exact"));
+    central2d_layout_t layout =
+        lua_get_layout(L, lget_string(L, "layout", "field"));
+    central2d_storage_t storage =
+        lua_get_storage(L, lget_string(L, "storage", "float"));
+    viz_opts_t viz_opts;
+    lua_get_viz_opts(L, &viz_opts);
+    run->frames = lget_int(L, "frames", 50);
+    run->ftime = lget_number(L, "ftime", 0.01);
+    run->t = 0;
+    run->nstep = 0;
+    run->fname = (char*) malloc(strlen(fname) + 16);
+    if (own_out)
+        strcpy(run->fname, fname);
+    else
+        sprintf(run->fname, "%s.%d", fname, i);
+
+    central2d_t* sim = central2d_init_layout(w,h, nx,ny,
+                                             3, shallow2d_flux, speed, cfl,
+                                             layout);
+    if (speed == shallow2d_speed)
+        central2d_set_flux_speed(sim, shallow2d_flux_speed);
+    central2d_set_diagnostics(sim, check_double);
+    lua_set_engine(L,sim, engine);
+    lua_set_kernels(L,sim, kernels);
+    lua_set_bc(L,sim);
+    central2d_set_storage(sim, storage);
+    checkpoint_info_t info;
+    lua_init_or_restart(L,sim, 0,0, nx,ny, NULL, &info);
+    central2d_tile(sim, px, py, nbatch);
+    if (!sim->tiles && bx > 0)
+        central2d_block(sim, bx, by);
+    run->sim = sim;
+    printf("Run %d: %g %g %d %d %g %d %g -> %s\n", i,
+           w, h, nx, ny, cfl, run->frames, run->ftime, run->fname);
+    if (sim->tiles)
+        printf("  Tiles: %d x %d (%d step pairs per exchange)\n",
+               sim->px, sim->py, sim->nbatch);
+    if (sim->block)
+        printf("  Blocks: %d x %d\n", sim->bx, sim->by);
+    run->viz = viz_open(run->fname, sim, &viz_opts, run->frames + 1);
+}
+
+
+int run_batch(lua_State* L)
+{
+    int n = lua_gettop(L);
+    if (n != 1 || !lua_istable(L, 1))
+        luaL_error(L, "Argument must be a table");
+    int nrun = lua_rawlen(L, 1);
+    if (nrun < 1)
+        luaL_error(L, "Expected a list of runs");
+    lua_set_simd(L, lget_string(L, "simd", "auto"));
+    mem_set_flags((lget_int(L, "hugepages", 0) ? MEM_HUGEPAGES : 0) |
+                  (lget_int(L, "first_touch", 0) ? MEM_FIRST_TOUCH : 0));
+    lua_set_check_sums(L, lget_string(L, "check_sums", "float"));
+    printf("Batch: %d runs\nSIMD: %s\n", nrun, simd_name(simd_level()));
+
+    batch_run_t* runs = (batch_run_t*) calloc(nrun, sizeof(batch_run_t));
+    int maxframes = 0;
+    for (int i = 0; i < nrun; ++i) {
+        lua_rawgeti(L, 1, i+1);
+        if (!lua_istable(L, -1))
+            luaL_error(L, "Expected run %d to be a table", i+1);
+        lua_getfield(L, -1, "out");
+        bool own_out = !lua_isnil(L, -1);
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_copy_fields(L, 1);
+        lua_copy_fields(L, 2);
+        lua_insert(L, 1);
+        lua_pop(L, 1);
+        lua_batch_run(L, runs + i, i+1, own_out);
+        lua_remove(L, 1);
+        if (runs[i].frames > maxframes)
+            maxframes = runs[i].frames;
+    }
+    for (int i = 0; i < nrun; ++i) {
+        solution_check(runs[i].sim);
+        viz_frame(runs[i].viz, runs[i].sim, runs[i].t);
+    }
+
+    central2d_t** sims = (central2d_t**) malloc(nrun * sizeof(central2d_t*));
+    float* tfinal = (float*) malloc(nrun * sizeof(float));
+    int* nstep = (int*) malloc(nrun * sizeof(int));
+    int* active = (int*) malloc(nrun * sizeof(int));
+    double tcompute = 0;
+    for (int frame = 0; frame < maxframes; ++frame) {
+        int nactive = 0;
+        for (int i = 0; i < nrun; ++i)
+            if (frame < runs[i].frames) {
+                sims[nactive] = runs[i].sim;
+                tfinal[nactive] = runs[i].ftime;
+                active[nactive++] = i;
+            }
+        double t0 = driver_wtime();
+        int total = central2d_run_batch(sims, tfinal, nstep, nactive);
+        double elapsed = driver_wtime() - t0;
+        tcompute += elapsed;
+        for (int j = 0; j < nactive; ++j) {
+            batch_run_t* run = runs + active[j];
+            solution_check(run->sim);
+            run->t += run->ftime;
+            run->nstep += nstep[j];
+            printf("  Run %d: %d steps\n", active[j]+1, nstep[j]);
+            viz_frame(run->viz, run->sim, run->t);
+        }
+        printf("  Time: %e (%d runs, %d steps)\n", elapsed, nactive, total);
+    }
+    printf("Total compute time: %e\n", tcompute);
+
+    for (int i = 0; i < nrun; ++i) {
+        viz_close(runs[i].viz);
+        central2d_free(runs[i].sim);
+        free(runs[i].fname);
+    }
+    free(active);
+    free(nstep);
+    free(tfinal);
+    free(sims);
+    free(runs);
+    return 0;
+}
+#endif
+
+
 /**
  * ### Main
  *
@@ -257,12 +1615,18 @@ int run_sim(lua_State* L)
  *     lshallow tests.lua args
  *
  * where `tests.lua` has a call to the `simulate` function to run
- * the simulation.  The arguments after the Lua file name are passed
- * into the Lua script via a global array called `args`.
+ * the simulation (or to `simulate_batch` to run several).  The
+ * arguments after the Lua file name are passed into the Lua script
+ * via a global array called `args`.  The MPI build (`lshallow-mpi`)
+ * is run the same way under `mpirun`.
  */
 
 int main(int argc, char** argv)
 {
+#ifdef USE_MPI
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &driver_rank);
+#endif
     if (argc < 2) {
         fprintf(stderr, "Usage: %s fname args\n", argv[0]);
         return -1;
@@ -271,6 +1635,9 @@ int main(int argc, char** argv)
     lua_State* L = luaL_newstate();
     luaL_openlibs(L);
     lua_register(L, "simulate", run_sim);
+#ifndef USE_MPI
+    lua_register(L, "simulate_batch", run_batch);
+#endif
 
     lua_newtable(L);
     for (int i = 2; i < argc; ++i) {
@@ -282,5 +1649,8 @@ int main(int argc, char** argv)
     if (luaL_dofile(L, argv[1]))
         printf("%s\n", lua_tostring(L,-1));
     lua_close(L);
+#ifdef USE_MPI
+    MPI_Finalize();
+#endif
     return 0;
 }
@@ -0,0 +1,97 @@
+#define _GNU_SOURCE  // For MAP_ANONYMOUS, MAP_HUGETLB, and MADV_HUGEPAGE
+#include "memalloc.h"
+
+#include <stdlib.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define MEM_MMAP
+#endif
+
+//ldoc on
+/**
+ * ## Implementation
+ *
+ * Huge pages are only worth it for blocks of a few megabytes or more,
+ * but we do not try to be clever: with the flag set, every block is
+ * mapped separately and its size is rounded up to a whole number of
+ * 2 MB pages.  If the explicit huge page mapping fails (typically
+ * because no huge pages are reserved), we fall back to an ordinary
+ * anonymous mapping with a transparent huge page hint.  On systems
+ * without `mmap`, the flag is ignored.
+ */
+
+#define MEM_ALIGN     64
+#define MEM_HUGE_PAGE (2 << 20)
+
+static int mem_current = 0;
+
+void mem_set_flags(int flags)
+{
+    mem_current = flags;
+}
+
+
+int mem_flags(void)
+{
+    return mem_current;
+}
+
+
+static inline
+size_t mem_round(size_t n, size_t align)
+{
+    return (n + align-1) / align * align;
+}
+
+
+void* mem_alloc(size_t nbytes, int flags)
+{
+#ifdef MEM_MMAP
+    if (flags & MEM_HUGEPAGES) {
+        size_t n = mem_round(nbytes, MEM_HUGE_PAGE);
+        void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        p = mmap(NULL, n, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+        if (p == MAP_FAILED) {
+            p = mmap(NULL, n, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+            if (p != MAP_FAILED)
+                madvise(p, n, MADV_HUGEPAGE);
+#endif
+        }
+        return (p == MAP_FAILED ? NULL : p);
+    }
+#endif
+    void* p = NULL;
+    if (posix_memalign(&p, MEM_ALIGN, mem_round(nbytes, MEM_ALIGN)) != 0)
+        return NULL;
+    return p;
+}
+
+
+void mem_free(void* p, size_t nbytes, int flags)
+{
+    if (!p)
+        return;
+#ifdef MEM_MMAP
+    if (flags & MEM_HUGEPAGES) {
+        munmap(p, mem_round(nbytes, MEM_HUGE_PAGE));
+        return;
+    }
+#endif
+    free(p);
+}
+
+
+int mem_pad(int n)
+{
+    int floats_per_line = MEM_ALIGN / sizeof(float);
+    n = (n + floats_per_line-1) / floats_per_line * floats_per_line;
+    if (n % (2048 / sizeof(float)) == 0)
+        n += floats_per_line;
+    return n;
+}
@@ -0,0 +1,57 @@
+#ifndef MEMALLOC_H
+#define MEMALLOC_H
+
+#include <stddef.h>
+
+//ldoc on
+/**
+ * # Array allocation
+ *
+ * The solver arrays are large and are swept row by row, so where they
+ * live matters almost as much as how we loop over them.  We allocate
+ * them through a small set of routines that
+ *
+ * - align every block to a cache line (64 bytes), so that rows start
+ *   on vector boundaries;
+ * - optionally back the blocks with huge pages (with `mmap` and
+ *   `MAP_HUGETLB` when the system has reserved huge pages, and
+ *   otherwise with a hint for transparent huge pages), which cuts
+ *   down on TLB misses for big grids; and
+ * - optionally ask the solvers to do a parallel first touch of their
+ *   arrays, so that on NUMA machines the pages of each band of rows
+ *   are placed near the thread that works on them.
+ *
+ * The options are flags that apply to solvers created after they are
+ * set.  The default is aligned allocation with neither option.
+ */
+
+typedef enum mem_flags_t {
+    MEM_HUGEPAGES   = 1,  // Back large blocks with huge pages
+    MEM_FIRST_TOUCH = 2   // Parallel first touch of the solver arrays
+} mem_flags_t;
+
+void mem_set_flags(int flags);
+int mem_flags(void);
+
+/**
+ * `mem_alloc` returns a cache-line aligned block of at least `nbytes`
+ * bytes (or `NULL` on failure), and `mem_free` releases it; the size and
+ * flags passed to `mem_free` must be the ones used for the allocation.
+ * Huge page blocks come from the OS already zeroed; others are not
+ * initialized.
+ */
+void* mem_alloc(size_t nbytes, int flags);
+void mem_free(void* p, size_t nbytes, int flags);
+
+/**
+ * The solvers pad their row and field strides with `mem_pad`, which
+ * rounds a number of floats up to a whole number of cache lines and
+ * adds one more line when the result is a multiple of 2 KB.  Strides
+ * that are multiples of large powers of two map the same column of
+ * successive rows (or the same cell of successive fields) to the same
+ * cache sets, so the three-row stencils would evict their own data.
+ */
+int mem_pad(int n);
+
+//ldoc off
+#endif /* MEMALLOC_H */
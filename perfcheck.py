@@ -0,0 +1,225 @@
+#!/usr/bin/env python
+
+"""
+Performance regression check for the tests.lua scenarios.
+
+Runs each scenario at each size with the Lua driver, appends the step
+rate and cell update rate of every run to a history file (CSV), and
+checks two things:
+
+ - The final state, as summarized by the conserved quantities and the
+   range of the water height that the driver prints after each frame
+   (see solution_check in ldriver.c), matches the stored reference for
+   that scenario and size within a tolerance.  A scenario and size with
+   no reference yet gets one from this run.
+
+ - The cell update rate is no more than a threshold fraction below the
+   median of the last few runs of the same case on the same host in
+   the history.
+
+The exit status is nonzero if any check fails.  Use --update to replace
+the references after a change that is meant to alter the results.
+"""
+
+from __future__ import print_function
+
+import argparse
+import csv
+import json
+import os
+import re
+import socket
+import subprocess
+import sys
+import time
+
+
+FLOAT = r'([-+0-9.eEinfa]+)'
+SIZE_RE = re.compile(r'^\S+ \S+ (\d+) (\d+) \S+ \d+ \S+$')
+TIME_RE = re.compile(r'^\s*Time: \S+ \(\S+ for (\d+) steps\)')
+TOTAL_RE = re.compile(r'^Total compute time: ' + FLOAT)
+VOLUME_RE = re.compile(r'^\s*Volume: ' + FLOAT)
+MOMENTUM_RE = re.compile(r'^\s*Momentum: \(' + FLOAT + ', ' + FLOAT + r'\)')
+RANGE_RE = re.compile(r'^\s*Range: \[' + FLOAT + ', ' + FLOAT + r'\]')
+
+HISTORY_FIELDS = ['date', 'host', 'revision', 'scenario', 'nx',
+                  'steps', 'seconds', 'steps_per_s', 'cells_per_s']
+
+
+def run_case(args, scenario, nx):
+    """Run one scenario at one size and return its summary (the grid
+    size, step count, compute time, and final conserved quantities)."""
+    cmd = args.driver + [args.script, scenario, str(nx)]
+    out = subprocess.check_output(cmd, universal_newlines=True)
+    cells = None
+    steps = 0
+    seconds = None
+    state = {}
+    for line in out.splitlines():
+        m = SIZE_RE.match(line)
+        if m and cells is None:
+            cells = int(m.group(1)) * int(m.group(2))
+        m = TIME_RE.match(line)
+        if m:
+            steps += int(m.group(1))
+        m = TOTAL_RE.match(line)
+        if m:
+            seconds = float(m.group(1))
+        m = VOLUME_RE.match(line)
+        if m:
+            state['volume'] = float(m.group(1))
+        m = MOMENTUM_RE.match(line)
+        if m:
+            state['momentum'] = [float(m.group(1)), float(m.group(2))]
+        m = RANGE_RE.match(line)
+        if m:
+            state['range'] = [float(m.group(1)), float(m.group(2))]
+    if not cells or not steps or not seconds or len(state) != 3:
+        raise RuntimeError("Could not parse the output of {0}:\n{1}".format(
+            ' '.join(cmd), out))
+    return {'cells': cells, 'steps': steps, 'seconds': seconds,
+            'state': state}
+
+
+def state_values(state):
+    return ([state['volume']] + list(state['momentum']) +
+            list(state['range']))
+
+
+def state_matches(state, ref, rtol, atol):
+    """Compare two final states value by value, with a relative
+    tolerance scaled by the larger value and an absolute floor (for
+    momenta that should be near zero)."""
+    for a, b in zip(state_values(state), state_values(ref)):
+        if abs(a-b) > rtol * max(abs(a), abs(b)) + atol:
+            return False
+    return True
+
+
+def read_history(fname):
+    if not os.path.exists(fname):
+        return []
+    with open(fname) as f:
+        return list(csv.DictReader(f))
+
+
+def append_history(fname, rows):
+    new = not os.path.exists(fname)
+    with open(fname, 'a') as f:
+        writer = csv.DictWriter(f, HISTORY_FIELDS)
+        if new:
+            writer.writeheader()
+        for row in rows:
+            writer.writerow(row)
+
+
+def baseline_rate(history, host, scenario, nx, window):
+    """Median cell update rate over the last runs of a case on a host
+    (None if there are none)."""
+    rates = [float(row['cells_per_s']) for row in history
+             if row['host'] == host and row['scenario'] == scenario and
+             int(row['nx']) == nx]
+    rates = sorted(rates[-window:])
+    if not rates:
+        return None
+    mid = len(rates) // 2
+    if len(rates) % 2:
+        return rates[mid]
+    return 0.5 * (rates[mid-1] + rates[mid])
+
+
+def git_revision():
+    try:
+        return subprocess.check_output(
+            ['git', 'rev-parse', '--short', 'HEAD'],
+            universal_newlines=True, stderr=subprocess.STDOUT).strip()
+    except (OSError, subprocess.CalledProcessError):
+        return 'unknown'
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[1])
+    parser.add_argument('--driver', default='./lshallow',
+                        help="driver command (may include a launcher)")
+    parser.add_argument('--script', default='tests.lua')
+    parser.add_argument('--scenarios',
+                        default='pond river dam wave dam_fp16 dam_bf16')
+    parser.add_argument('--sizes', default='100 200 400')
+    parser.add_argument('--history', default='perf_history.csv')
+    parser.add_argument('--reference', default='perf_reference.json')
+    parser.add_argument('--threshold', type=float, default=0.1,
+                        help="largest allowed drop in cell updates/s")
+    parser.add_argument('--window', type=int, default=5,
+                        help="past runs in the throughput baseline")
+    parser.add_argument('--rtol', type=float, default=1e-4)
+    parser.add_argument('--atol', type=float, default=1e-6)
+    parser.add_argument('--update', action='store_true',
+                        help="replace the stored references")
+    args = parser.parse_args()
+    args.driver = args.driver.split()
+
+    history = read_history(args.history)
+    reference = {}
+    if os.path.exists(args.reference):
+        with open(args.reference) as f:
+            reference = json.load(f)
+
+    host = socket.gethostname()
+    revision = git_revision()
+    date = time.strftime('%Y-%m-%dT%H:%M:%S')
+    rows = []
+    failures = []
+    print("{0:8s} {1:>5s} {2:>8s} {3:>10s} {4:>12s} {5:>8s}  {6}".format(
+        'scenario', 'nx', 'steps', 'steps/s', 'cells/s', 'change', 'state'))
+    for scenario in args.scenarios.split():
+        for nx in [int(n) for n in args.sizes.split()]:
+            result = run_case(args, scenario, nx)
+            steps_per_s = result['steps'] / result['seconds']
+            cells_per_s = steps_per_s * result['cells']
+            key = '{0}/{1}'.format(scenario, nx)
+
+            if args.update or key not in reference:
+                reference[key] = result['state']
+                status = 'stored'
+            elif state_matches(result['state'], reference[key],
+                               args.rtol, args.atol):
+                status = 'ok'
+            else:
+                status = 'MISMATCH'
+                failures.append('{0}: final state {1} != reference {2}'.format(
+                    key, state_values(result['state']),
+                    state_values(reference[key])))
+
+            base = baseline_rate(history, host, scenario, nx, args.window)
+            change = ''
+            if base:
+                drop = 1 - cells_per_s / base
+                change = '{0:+.1f}%'.format(100 * (cells_per_s/base - 1))
+                if drop > args.threshold:
+                    failures.append(
+                        '{0}: {1:.3g} cells/s is {2:.1f}% below the '
+                        'baseline {3:.3g}'.format(key, cells_per_s,
+                                                  100 * drop, base))
+
+            print("{0:8s} {1:5d} {2:8d} {3:10.4g} {4:12.4g} {5:>8s}  "
+                  "{6}".format(scenario, nx, result['steps'], steps_per_s,
+                               cells_per_s, change, status))
+            rows.append({'date': date, 'host': host, 'revision': revision,
+                         'scenario': scenario, 'nx': nx,
+                         'steps': result['steps'],
+                         'seconds': '{0:.6g}'.format(result['seconds']),
+                         'steps_per_s': '{0:.6g}'.format(steps_per_s),
+                         'cells_per_s': '{0:.6g}'.format(cells_per_s)})
+
+    append_history(args.history, rows)
+    with open(args.reference, 'w') as f:
+        json.dump(reference, f, indent=2, sort_keys=True)
+        f.write('\n')
+
+    for failure in failures:
+        print("FAIL " + failure, file=sys.stderr)
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
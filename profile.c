@@ -0,0 +1,352 @@
+#define _POSIX_C_SOURCE 200809L  // For clock_gettime
+#include "profile.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef USE_PAPI
+#include <papi.h>
+#include <pthread.h>
+#endif
+
+//ldoc on
+/**
+ * ## Implementation
+ *
+ * The records live in a static table with one block of phases for
+ * each thread, aligned to cache lines so that threads do not share
+ * lines when they update their own records.  Threads with numbers
+ * past the end of the table are not recorded.
+ */
+
+#define PROFILE_MAXTHREADS 256
+
+typedef struct profile_record_t {
+    double time;                         // Seconds in the phase
+    double ncell;                        // Cells processed
+    long long ncall;                     // Number of timings
+    long long count[PROFILE_NCOUNTER];   // Hardware counter totals
+} profile_record_t;
+
+typedef struct profile_thread_t {
+    profile_record_t phase[PROFILE_NPHASE];
+#ifdef USE_PAPI
+    bool started;                        // Event set created?
+    int events;                          // PAPI event set (or PAPI_NULL)
+    int slot[PROFILE_NCOUNTER];          // Counter of each event (or -1)
+#endif
+} __attribute__((aligned(64))) profile_thread_t;
+
+static profile_thread_t profile_threads[PROFILE_MAXTHREADS];
+
+static const char* profile_names[PROFILE_NPHASE] = {
+    "periodic", "speed", "step", "flux", "predict", "correct"
+};
+
+
+/**
+ * The default cost model is for the three fields of the shallow water
+ * equations.  In the operation counts, a limited difference is three
+ * subtractions, two multiplications, two additions, and two minimums
+ * (nine operations; we do not count sign manipulation), the flux has
+ * one division and ten other operations, and the speed has a
+ * division, a square root, and seven other operations.  The predictor
+ * takes two limited differences and four more operations per field,
+ * and the corrector takes two limited differences and sixteen more.
+ * A step (counted per cell of its output) has two flux passes, a
+ * predictor, and a corrector, and its bytes are the minimum transfer:
+ * reading the solution and writing the result.  The ghost cell fill
+ * reads and writes each ghost cell.
+ */
+
+static double profile_flops[PROFILE_NPHASE] = {
+    0,                        // periodic
+    9,                        // speed
+    2*11 + 3*22 + 3*34,       // step
+    11,                       // flux
+    3*22,                     // predict
+    3*34                      // correct
+};
+
+static double profile_bytes[PROFILE_NPHASE] = {
+    2*3*4,                    // periodic: read and write u
+    3*4,                      // speed: read u
+    2*3*4,                    // step: read u and write v
+    3*3*4,                    // flux: read u and write f and g
+    4*3*4,                    // predict: read u, f, g and write v
+    4*3*4                     // correct: read u, f, g and write v
+};
+
+
+void profile_model(profile_phase_t phase, double flops, double bytes)
+{
+    profile_flops[phase] = flops;
+    profile_bytes[phase] = bytes;
+}
+
+
+void profile_cost(profile_phase_t phase, double* flops, double* bytes)
+{
+    *flops = profile_flops[phase];
+    *bytes = profile_bytes[phase];
+}
+
+
+bool profile_enabled(void)
+{
+#ifdef USE_PROFILE
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+static inline
+int profile_thread_id(void)
+{
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+
+/**
+ * ### Hardware counters
+ *
+ * With PAPI, each thread builds its own event set the first time it
+ * takes a mark, adding whichever of the events the machine supports;
+ * the unsupported counters read as zero.  The OpenMP runtime keeps the
+ * same system thread for each thread number from one parallel region
+ * to the next, so a thread's event set is always read by the thread
+ * that started it.
+ */
+
+#ifdef USE_PAPI
+
+static const char* profile_counter_names[PROFILE_NCOUNTER] = {
+    "PAPI_TOT_CYC", "PAPI_L2_TCM", "PAPI_L3_TCM", "PAPI_SP_OPS"
+};
+
+static const int profile_counter_events[PROFILE_NCOUNTER] = {
+    PAPI_TOT_CYC, PAPI_L2_TCM, PAPI_L3_TCM, PAPI_SP_OPS
+};
+
+static bool profile_papi_ok = false;
+
+static
+unsigned long profile_pthread_id(void)
+{
+    return (unsigned long) pthread_self();
+}
+
+
+static
+void profile_papi_init(void)
+{
+    static bool initialized = false;
+    if (initialized)
+        return;
+    initialized = true;
+    profile_papi_ok =
+        (PAPI_library_init(PAPI_VER_CURRENT) == PAPI_VER_CURRENT &&
+         PAPI_thread_init(profile_pthread_id) == PAPI_OK);
+}
+
+
+static
+void profile_papi_start(profile_thread_t* pt)
+{
+    int events = PAPI_NULL;
+    int n = 0;
+    pt->started = true;
+    pt->events = PAPI_NULL;
+    for (int j = 0; j < PROFILE_NCOUNTER; ++j)
+        pt->slot[j] = -1;
+    if (PAPI_create_eventset(&events) != PAPI_OK)
+        return;
+    for (int j = 0; j < PROFILE_NCOUNTER; ++j)
+        if (PAPI_add_event(events, profile_counter_events[j]) == PAPI_OK)
+            pt->slot[j] = n++;
+    if (n > 0 && PAPI_start(events) == PAPI_OK)
+        pt->events = events;
+}
+
+
+static
+void profile_papi_read(profile_thread_t* pt, long long* count)
+{
+    long long values[PROFILE_NCOUNTER] = {0};
+    if (!pt->started)
+        profile_papi_start(pt);
+    if (pt->events != PAPI_NULL)
+        PAPI_read(pt->events, values);
+    for (int j = 0; j < PROFILE_NCOUNTER; ++j)
+        count[j] = (pt->slot[j] >= 0 ? values[pt->slot[j]] : 0);
+}
+
+#endif /* USE_PAPI */
+
+
+/**
+ * ### Marks and records
+ */
+
+void profile_mark(profile_mark_t* mark)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    mark->t = ts.tv_sec + 1e-9 * ts.tv_nsec;
+#ifdef USE_PAPI
+    int id = profile_thread_id();
+    if (profile_papi_ok && id < PROFILE_MAXTHREADS) {
+        profile_papi_read(profile_threads + id, mark->count);
+        return;
+    }
+#endif
+    memset(mark->count, 0, sizeof(mark->count));
+}
+
+
+void profile_add(profile_phase_t phase, const profile_mark_t* mark,
+                 double ncell)
+{
+    int id = profile_thread_id();
+    if (id >= PROFILE_MAXTHREADS)
+        return;
+    profile_mark_t now;
+    profile_mark(&now);
+    profile_record_t* r = profile_threads[id].phase + phase;
+    r->time += now.t - mark->t;
+    r->ncell += ncell;
+    r->ncall += 1;
+    for (int j = 0; j < PROFILE_NCOUNTER; ++j)
+        r->count[j] += now.count[j] - mark->count[j];
+}
+
+
+void profile_reset(void)
+{
+#ifdef USE_PAPI
+    profile_papi_init();
+#endif
+    for (int i = 0; i < PROFILE_MAXTHREADS; ++i)
+        memset(profile_threads[i].phase, 0, sizeof(profile_threads[i].phase));
+}
+
+
+/**
+ * ### Summary
+ *
+ * We sum the records for each phase over the threads, keeping track of
+ * how many threads ran the phase, and write one line per phase.
+ */
+
+typedef struct profile_summary_t {
+    profile_record_t total;
+    int nthread;
+    double seconds, gflops, gbytes;
+} profile_summary_t;
+
+
+static
+void profile_summarize(profile_summary_t* sum, int phase)
+{
+    memset(sum, 0, sizeof(*sum));
+    for (int i = 0; i < PROFILE_MAXTHREADS; ++i) {
+        const profile_record_t* r = profile_threads[i].phase + phase;
+        if (r->ncall == 0)
+            continue;
+        sum->nthread += 1;
+        sum->total.time += r->time;
+        sum->total.ncell += r->ncell;
+        sum->total.ncall += r->ncall;
+        for (int j = 0; j < PROFILE_NCOUNTER; ++j)
+            sum->total.count[j] += r->count[j];
+    }
+    if (sum->nthread == 0 || sum->total.time <= 0)
+        return;
+    sum->seconds = sum->total.time / sum->nthread;
+    sum->gflops = 1e-9 * profile_flops[phase] * sum->total.ncell / sum->seconds;
+    sum->gbytes = 1e-9 * profile_bytes[phase] * sum->total.ncell / sum->seconds;
+}
+
+
+static
+void profile_write_json(FILE* fp, double elapsed)
+{
+    fprintf(fp, "{\n  \"elapsed\": %.9g,\n  \"papi\": %s,\n  \"phases\": [",
+            elapsed,
+#ifdef USE_PAPI
+            profile_papi_ok ? "true" : "false"
+#else
+            "false"
+#endif
+            );
+    for (int p = 0; p < PROFILE_NPHASE; ++p) {
+        profile_summary_t sum;
+        profile_summarize(&sum, p);
+        fprintf(fp, "%s\n    {\"phase\": \"%s\", \"calls\": %lld, "
+                "\"cells\": %.17g, \"threads\": %d, \"seconds\": %.9g, "
+                "\"thread_seconds\": %.9g, \"gflops\": %.6g, "
+                "\"gbytes_per_s\": %.6g",
+                (p > 0 ? "," : ""), profile_names[p], sum.total.ncall,
+                sum.total.ncell, sum.nthread, sum.seconds, sum.total.time,
+                sum.gflops, sum.gbytes);
+#ifdef USE_PAPI
+        for (int j = 0; profile_papi_ok && j < PROFILE_NCOUNTER; ++j)
+            fprintf(fp, ", \"%s\": %lld",
+                    profile_counter_names[j], sum.total.count[j]);
+#endif
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "\n  ]\n}\n");
+}
+
+
+static
+void profile_write_csv(FILE* fp, double elapsed)
+{
+    fprintf(fp, "phase,calls,cells,threads,seconds,thread_seconds,"
+            "gflops,gbytes_per_s");
+#ifdef USE_PAPI
+    for (int j = 0; profile_papi_ok && j < PROFILE_NCOUNTER; ++j)
+        fprintf(fp, ",%s", profile_counter_names[j]);
+#endif
+    fprintf(fp, "\n");
+    for (int p = 0; p < PROFILE_NPHASE; ++p) {
+        profile_summary_t sum;
+        profile_summarize(&sum, p);
+        fprintf(fp, "%s,%lld,%.17g,%d,%.9g,%.9g,%.6g,%.6g",
+                profile_names[p], sum.total.ncall, sum.total.ncell,
+                sum.nthread, sum.seconds, sum.total.time,
+                sum.gflops, sum.gbytes);
+#ifdef USE_PAPI
+        for (int j = 0; profile_papi_ok && j < PROFILE_NCOUNTER; ++j)
+            fprintf(fp, ",%lld", sum.total.count[j]);
+#endif
+        fprintf(fp, "\n");
+    }
+    fprintf(fp, "elapsed,,,,%.9g,,,\n", elapsed);
+}
+
+
+int profile_write(const char* fname, double elapsed)
+{
+    FILE* fp = fopen(fname, "w");
+    if (!fp)
+        return -1;
+    size_t n = strlen(fname);
+    if (n >= 5 && strcmp(fname + n-5, ".json") == 0)
+        profile_write_json(fp, elapsed);
+    else
+        profile_write_csv(fp, elapsed);
+    return fclose(fp);
+}
@@ -0,0 +1,107 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdbool.h>
+
+//ldoc on
+/**
+ * # Phase timing
+ *
+ * The driver times whole calls to `central2d_run`, which tells us how
+ * fast we are but not where the time goes.  With the `USE_PROFILE`
+ * macro defined, the solver also records the time spent in each phase
+ * of the step:
+ *
+ * - `PROFILE_PERIODIC`: filling the ghost cells (`central2d_periodic`
+ *   and the other boundary conditions);
+ * - `PROFILE_SPEED`: computing the wave speeds for the time step;
+ * - `PROFILE_STEP`: the step functions as a whole;
+ * - `PROFILE_FLUX`, `PROFILE_PREDICT`, `PROFILE_CORRECT`: the flux
+ *   computations, predictor, and corrector inside the steps.
+ *
+ * The last three are nested in `PROFILE_STEP`, and the difference is
+ * the time spent copying data around (in the fused engine, for
+ * example, rows are copied into scratch space before the flux
+ * computation).  When the fluxes and speeds are computed together
+ * (see `central2d_set_flux_speed`), the combined pass is counted as
+ * flux time.  In the fused engine, the phases are interleaved row by
+ * row, so they are timed one row at a time; that adds several clock
+ * reads per row of each step, which is why the timing is compiled in
+ * only on request.  Without `USE_PROFILE`, the hooks expand to nothing.
+ *
+ * Each phase also counts the number of cells it processed, and with
+ * the `USE_PAPI` macro a few hardware counters from the PAPI library
+ * (cycles, L2 and L3 cache misses, and single precision operations,
+ * where the machine supports them).  The records are kept per OpenMP
+ * thread, so the tiled solver can be profiled without locks; the PAPI
+ * counters are read by each thread for itself.
+ *
+ * A phase is timed by taking a mark at the start and passing it to
+ * `profile_add` with the cell count at the end.  The `PROFILE_BEGIN`
+ * and `PROFILE_END` macros do this (and nothing without `USE_PROFILE`):
+ *
+ *     PROFILE_BEGIN(mark);
+ *     ...
+ *     PROFILE_END(PROFILE_FLUX, mark, ncell);
+ */
+
+typedef enum profile_phase_t {
+    PROFILE_PERIODIC,
+    PROFILE_SPEED,
+    PROFILE_STEP,
+    PROFILE_FLUX,
+    PROFILE_PREDICT,
+    PROFILE_CORRECT,
+    PROFILE_NPHASE
+} profile_phase_t;
+
+#define PROFILE_NCOUNTER 4
+
+typedef struct profile_mark_t {
+    double t;                            // Wall clock time
+    long long count[PROFILE_NCOUNTER];   // Hardware counters
+} profile_mark_t;
+
+void profile_mark(profile_mark_t* mark);
+void profile_add(profile_phase_t phase, const profile_mark_t* mark,
+                 double ncell);
+
+#ifdef USE_PROFILE
+#define PROFILE_BEGIN(mark) profile_mark_t mark; profile_mark(&mark)
+#define PROFILE_END(phase, mark, ncell) profile_add(phase, &mark, ncell)
+#else
+#define PROFILE_BEGIN(mark) ((void) 0)
+#define PROFILE_END(phase, mark, ncell) ((void) 0)
+#endif
+
+/**
+ * To turn cell counts into rates, each phase has a cost model: the
+ * floating point operations and the bytes of solution, flux, and
+ * output data touched per cell.  The defaults are counted from the
+ * kernels for the shallow water equations (three fields), and a
+ * different physics module can install its own with `profile_model`
+ * (and `profile_cost` returns the model for a phase).
+ * The bytes are what the loops read and write, which is the memory
+ * traffic of the reference engine; the fused engine keeps most of that
+ * in cache, so its apparent bandwidth is correspondingly higher.
+ *
+ * `profile_enabled` says whether the hooks were compiled in, and
+ * `profile_reset` clears the records (and sets up PAPI the first
+ * time).  `profile_write` writes a summary of everything recorded
+ * since the reset to `fname`: JSON if the name ends in `.json`, and
+ * CSV otherwise.  The summary has a row for each phase with the
+ * number of calls and cells, the time (the thread-seconds divided by
+ * the number of threads that ran the phase), the achieved GFLOP/s and
+ * GB/s under the cost model, and any hardware counter totals.  The
+ * `elapsed` argument (total wall clock time, as timed by the caller)
+ * goes in the summary header.  It returns zero on success.
+ */
+
+void profile_model(profile_phase_t phase, double flops, double bytes);
+void profile_cost(profile_phase_t phase, double* flops, double* bytes);
+bool profile_enabled(void);
+void profile_reset(void);
+int profile_write(const char* fname, double elapsed);
+
+//ldoc off
+#endif /* PROFILE_H */
@@ -1,6 +1,8 @@
 #ifndef SHALLOW2D_H
 #define SHALLOW2D_H
 
+#include "stepper.h"
+
 //ldoc on
 /**
  * # Shallow water equations
@@ -48,13 +50,49 @@
  * in sequential arrays separated by `field_stride`: for example,
  * the start of the height field data is at `U`, the start of
  * the $x$ momentum is at `U+field_stride`, and the start of the
- * $y$ momentum is at `U+2*field_stride`.
+ * $y$ momentum is at `U+2*field_stride`.  Successive cells are
+ * `cell_stride` apart (this is one, except in the cell-interleaved
+ * layout).
  */
 
 void shallow2d_flux(float* FU, float* GU, const float* U,
-                    int ncell, int field_stride);
+                    int ncell, int field_stride, int cell_stride);
 void shallow2d_speed(float* cxy, const float* U,
-                     int ncell, int field_stride);
+                     int ncell, int field_stride, int cell_stride);
+
+/**
+ * The `shallow2d_speed_fast` function can be used in place of
+ * `shallow2d_speed`.  It uses approximate reciprocals and square roots
+ * where the vector hardware has them, and returns a slight overestimate
+ * of the wave speeds (by under about 0.15%), so the time steps are
+ * always safe, but the results will differ slightly from the exact
+ * version.
+ */
+void shallow2d_speed_fast(float* cxy, const float* U,
+                          int ncell, int field_stride, int cell_stride);
+
+/**
+ * The `shallow2d_flux_speed` function computes the same fluxes as
+ * `shallow2d_flux` and the same speeds as `shallow2d_speed` in a single
+ * pass (see `central2d_set_flux_speed`).
+ */
+void shallow2d_flux_speed(float* FU, float* GU, float* cxy, const float* U,
+                          int ncell, int field_stride, int cell_stride);
+
+/**
+ * The `shallow2d_walls` boundary condition makes the sides of the
+ * domain in its mask solid walls (see `central2d_set_bc`): the ghost
+ * cells mirror the real cells with the momentum normal to the wall
+ * negated, so nothing flows through the wall.
+ */
+void shallow2d_walls(float* u, int nx, int ny, int ng, int nfield,
+                     int s, int fs, int cs, int sides);
+
+/**
+ * Finally, `shallow2d_kernels` are the step kernels specialized for
+ * these physics (see `central2d_set_kernels`).
+ */
+extern const central2d_kernels_t shallow2d_kernels;
 
 //ldoc off
 #endif /* SHALLOW2D_H */
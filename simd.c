@@ -0,0 +1,72 @@
+#include "simd.h"
+
+#include <string.h>
+
+//ldoc on
+/**
+ * ## Implementation
+ *
+ * On x86, we ask the CPU through the GCC/Clang builtins (which also check
+ * that the OS saves the wide registers).  The detected level is cached
+ * on first use; the solvers call `simd_level` during initialization,
+ * so the cache is filled before any parallel region reads it.
+ */
+
+static int simd_current = -1;
+
+simd_level_t simd_detect(void)
+{
+#if defined(SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+    return SIMD_SCALAR;
+#elif defined(SIMD_NEON_ENABLED)
+    return SIMD_NEON;
+#else
+    return SIMD_SCALAR;
+#endif
+}
+
+
+simd_level_t simd_level(void)
+{
+    if (simd_current < 0)
+        simd_current = simd_detect();
+    return (simd_level_t) simd_current;
+}
+
+
+void simd_set_level(simd_level_t level)
+{
+    simd_level_t best = simd_detect();
+    if (level == SIMD_SCALAR || level == best ||
+        (level == SIMD_AVX2 && best == SIMD_AVX512))
+        simd_current = level;
+    else
+        simd_current = best;
+}
+
+
+const char* simd_name(simd_level_t level)
+{
+    switch (level) {
+    case SIMD_NEON:   return "neon";
+    case SIMD_AVX2:   return "avx2";
+    case SIMD_AVX512: return "avx512";
+    default:          return "scalar";
+    }
+}
+
+
+int simd_parse(const char* name)
+{
+    if (strcmp(name, "auto") == 0)
+        return simd_detect();
+    for (int level = SIMD_SCALAR; level <= SIMD_AVX512; ++level)
+        if (strcmp(name, simd_name((simd_level_t) level)) == 0)
+            return level;
+    return -1;
+}
@@ -0,0 +1,69 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+//ldoc on
+/**
+ * # Vector instruction sets
+ *
+ * The limiter and the physics kernels are simple enough that a good
+ * compiler will usually vectorize them, but "usually" depends on the
+ * compiler, the flags, and on details like whether there is an `assert`
+ * or a division in the loop.  We therefore also provide explicitly
+ * vectorized versions of the inner loops for the instruction sets on
+ * our machines, and choose between them at run time.  The vector
+ * kernels do the same floating point operations in the same order as
+ * the scalar code, so the results do not depend on the choice.
+ *
+ * The AVX2 and AVX-512 kernels are compiled with per-function target
+ * attributes, so they are available regardless of the `-march` flags,
+ * and are only used when the CPU reports that it supports them.  The
+ * NEON kernels are used whenever we are compiled for 64-bit ARM (where
+ * NEON is always available).
+ */
+
+typedef enum simd_level_t {
+    SIMD_SCALAR,   // Plain C loops (left to the compiler)
+    SIMD_NEON,     // ARM NEON (128 bit)
+    SIMD_AVX2,     // x86 AVX2 (256 bit)
+    SIMD_AVX512    // x86 AVX-512F (512 bit)
+} simd_level_t;
+
+/**
+ * `simd_detect` returns the best level supported by both the build
+ * and the CPU.  `simd_level` returns the level currently in use, which
+ * is the detected level unless it has been lowered by `simd_set_level`
+ * (requests for a level that is not supported fall back to the
+ * detected level).  The level should only be changed between runs,
+ * not while a solver is stepping.
+ */
+simd_level_t simd_detect(void);
+simd_level_t simd_level(void);
+void simd_set_level(simd_level_t level);
+
+/**
+ * Names for levels are `"scalar"`, `"neon"`, `"avx2"`, and `"avx512"`;
+ * `simd_parse` also accepts `"auto"` for the detected level, and returns
+ * -1 for an unknown name.
+ */
+const char* simd_name(simd_level_t level);
+int simd_parse(const char* name);
+
+//ldoc off
+
+/*
+ * Support macros for the kernel implementations.
+ */
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#include <immintrin.h>
+#define SIMD_TARGET_AVX2   __attribute__((target("avx2")))
+#define SIMD_TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define SIMD_NEON_ENABLED
+#include <arm_neon.h>
+#endif
+
+#endif /* SIMD_H */
@@ -1,10 +1,24 @@
 #include "stepper.h"
+#include "simd.h"
+#include "memalloc.h"
+#include "profile.h"
+
+// General step kernels (physics through function pointers)
+#define KERNEL_NFIELD nfield
+#define KERNEL_FLUX(FU, GU, U, ncell, fs, cs) flux(FU, GU, U, ncell, fs, cs)
+#include "stepper_kernels.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 //ldoc on
 /**
@@ -13,51 +27,312 @@
  * ### Structure allocation
  */
 
-central2d_t* central2d_init(float w, float h, int nx, int ny,
-                            int nfield, flux_t flux, speed_t speed,
-                            float cfl)
+/**
+ * The scratch space holds a few rows worth of data.  The reference
+ * engine only needs six rows, but the fused engine keeps rolling
+ * windows of fluxes and intermediate values for every field.
+ */
+
+static inline
+int central2d_scratch_size(int nfield, int nx_all)
+{
+    return (16*nfield + 4) * nx_all;
+}
+
+
+/**
+ * The solution-sized arrays are allocated in one block with the
+ * scratch space, but each array starts on a cache line, and the
+ * strides are padded as described in `memalloc.h`.  We zero the arrays
+ * when we allocate them; with the
+ * `MEM_FIRST_TOUCH` flag, we do this a band of rows at a time
+ * in a parallel loop with a static schedule, so that on a NUMA machine
+ * each band of rows lives near the thread that first touched it.  This
+ * matches the decomposition by rows of tiles in the tiled solver.
+ * Tiles are allocated by their
+ * owning threads (see `central2d_tile`), so there the loop runs
+ * serially in the owner.
+ */
+
+static
+void central2d_touch(central2d_t* sim, float* a)
+{
+    if (!(sim->mem_flags & MEM_FIRST_TOUCH)) {
+        memset(a, 0, sim->array_size * sizeof(float));
+        return;
+    }
+    int ny_all = sim->ny + 2*sim->ng;
+    int nk = (sim->layout == CENTRAL2D_FIELD_MAJOR ? sim->nfield : 1);
+    int s = sim->row_stride, fs = sim->field_stride;
+    #pragma omp parallel for schedule(static)
+    for (int iy = 0; iy < ny_all; ++iy)
+        for (int k = 0; k < nk; ++k)
+            memset(a + k*fs + iy*s, 0, s * sizeof(float));
+}
+
+
+float* central2d_alloc_array(central2d_t* sim)
+{
+    float* a = (float*) mem_alloc(sim->array_size * sizeof(float),
+                                  sim->mem_flags);
+    central2d_touch(sim, a);
+    return a;
+}
+
+
+void central2d_free_array(central2d_t* sim, float* a)
+{
+    mem_free(a, sim->array_size * sizeof(float), sim->mem_flags);
+}
+
+
+// Size of the storage block in bytes
+static inline
+size_t central2d_mem_size(central2d_t* sim)
 {
-    // We extend to a four cell buffer to avoid BC comm on odd time steps
-    int ng = 4;
+    int nx_all = sim->nx + 2*sim->ng;
+    return (4 * (size_t) sim->array_size +
+            central2d_scratch_size(sim->nfield, nx_all)) * sizeof(float);
+}
 
+
+static
+central2d_t* central2d_alloc(int nx, int ny, int ng,
+                             int nfield, flux_t flux, speed_t speed,
+                             float cfl, central2d_layout_t layout)
+{
     central2d_t* sim = (central2d_t*) malloc(sizeof(central2d_t));
     sim->nx = nx;
     sim->ny = ny;
     sim->ng = ng;
     sim->nfield = nfield;
-    sim->dx = w/nx;
-    sim->dy = h/ny;
     sim->flux = flux;
     sim->speed = speed;
+    sim->flux_speed = NULL;
     sim->cfl = cfl;
 
     int nx_all = nx + 2*ng;
     int ny_all = ny + 2*ng;
-    int nc = nx_all * ny_all;
-    int N  = nfield * nc;
-    sim->u  = (float*) malloc((4*N + 6*nx_all)* sizeof(float));
+    sim->layout = layout;
+    if (layout == CENTRAL2D_CELL_INTERLEAVED) {
+        sim->field_stride = 1;
+        sim->row_stride = mem_pad(nfield * nx_all);
+        sim->cell_stride = nfield;
+        sim->array_size = mem_pad(sim->row_stride * ny_all);
+    } else if (layout == CENTRAL2D_ROW_INTERLEAVED) {
+        sim->field_stride = mem_pad(nx_all);
+        sim->row_stride = mem_pad(nfield * sim->field_stride);
+        sim->cell_stride = 1;
+        sim->array_size = mem_pad(sim->row_stride * ny_all);
+    } else {
+        sim->row_stride = mem_pad(nx_all);
+        sim->field_stride = mem_pad(sim->row_stride * ny_all);
+        sim->cell_stride = 1;
+        sim->array_size = nfield * sim->field_stride;
+    }
+    int N = sim->array_size;
+    sim->mem_flags = mem_flags();
+    sim->mem = (float*) mem_alloc(central2d_mem_size(sim), sim->mem_flags);
+    sim->u  = sim->mem;
     sim->v  = sim->u +   N;
     sim->f  = sim->u + 2*N;
     sim->g  = sim->u + 3*N;
     sim->scratch = sim->u + 4*N;
 
+    sim->px = 0;
+    sim->py = 0;
+    sim->nbatch = 1;
+    sim->nthreads = 1;
+    sim->vh = NULL;
+    sim->engine = CENTRAL2D_REFERENCE;
+    sim->kernels = NULL;
+    sim->bx = 0;
+    sim->by = 0;
+    sim->block = NULL;
+    sim->skip_tol = -1;
+    sim->block_nstep = 0;
+    sim->block_nskip = 0;
+    sim->tiles = NULL;
+    sim->tile_cxy = NULL;
+
+    sim->storage = CENTRAL2D_FLOAT32;
+    sim->u16 = NULL;
+    sim->v16 = NULL;
+
+    sim->diag_fused = false;
+    sim->diag_valid = false;
+    sim->diag_rows = NULL;
+    sim->local_steps = false;
+    sim->w = NULL;
+
+    sim->bc = NULL;
+    sim->bc_sides = 0;
+
+    sim->lag_safety = 0;
+    sim->nrollback = 0;
+
+    sim->on_device = false;
+    sim->host_stale = false;
+    sim->device_stale = false;
+
+    for (int i = 0; i < 4; ++i)
+        central2d_touch(sim, sim->mem + i*N);
+
+    simd_level();  // Detect the vector instruction set before any steps
+    return sim;
+}
+
+
+/**
+ * ### Device storage
+ *
+ * For the device engine, the solution, the half-step solution, and the
+ * fluxes are mapped to the device (as OpenMP target data) on the first
+ * run, and stay there until the engine is changed or the solver is
+ * freed.  Only `u` is copied in; the others are device scratch space.
+ * The two flags record which copy of `u` is out of date, so that we
+ * copy only when the other side needs the solution.
+ */
+
+// Map an array of n floats to the device (copying it in if copy) or back
+static
+void device_map_array(float* a, int n, bool copy)
+{
+    if (copy) {
+        #pragma omp target enter data map(to: a[0:n])
+    } else {
+        #pragma omp target enter data map(alloc: a[0:n])
+    }
+}
+
+
+static
+void device_unmap_array(float* a, int n)
+{
+    #pragma omp target exit data map(delete: a[0:n])
+}
+
+
+// Copy an array to the device (if to_device) or from it
+static
+void device_update_array(float* a, int n, bool to_device)
+{
+    if (to_device) {
+        #pragma omp target update to(a[0:n])
+    } else {
+        #pragma omp target update from(a[0:n])
+    }
+}
+
+
+static
+void central2d_device_map(central2d_t* sim)
+{
+    int n = sim->array_size;
+    if (!sim->on_device) {
+        device_map_array(sim->u, n, true);
+        device_map_array(sim->v, n, false);
+        device_map_array(sim->f, n, false);
+        device_map_array(sim->g, n, false);
+        sim->on_device = true;
+    } else if (sim->device_stale) {
+        device_update_array(sim->u, n, true);
+    }
+    sim->device_stale = false;
+}
+
+
+void central2d_sync(central2d_t* sim)
+{
+    if (sim->on_device && sim->host_stale)
+        device_update_array(sim->u, sim->array_size, false);
+    sim->host_stale = false;
+}
+
+
+static
+void central2d_device_free(central2d_t* sim)
+{
+    int n = sim->array_size;
+    if (!sim->on_device)
+        return;
+    central2d_sync(sim);
+    device_unmap_array(sim->u, n);
+    device_unmap_array(sim->v, n);
+    device_unmap_array(sim->f, n);
+    device_unmap_array(sim->g, n);
+    sim->on_device = false;
+    sim->device_stale = false;
+}
+
+
+central2d_t* central2d_init_ghost(float w, float h, int nx, int ny,
+                                  int nfield, flux_t flux, speed_t speed,
+                                  float cfl, central2d_layout_t layout,
+                                  int ng)
+{
+    // We need at least a four cell buffer to avoid BC comm on odd time steps
+    if (ng < 4)
+        ng = 4;
+
+    central2d_t* sim = central2d_alloc(nx, ny, ng, nfield, flux, speed,
+                                       cfl, layout);
+    sim->dx = w/nx;
+    sim->dy = h/ny;
     return sim;
 }
 
 
+central2d_t* central2d_init_layout(float w, float h, int nx, int ny,
+                                   int nfield, flux_t flux, speed_t speed,
+                                   float cfl, central2d_layout_t layout)
+{
+    return central2d_init_ghost(w, h, nx, ny, nfield, flux, speed, cfl,
+                                layout, 4);
+}
+
+
+central2d_t* central2d_init(float w, float h, int nx, int ny,
+                            int nfield, flux_t flux, speed_t speed,
+                            float cfl)
+{
+    return central2d_init_layout(w, h, nx, ny, nfield, flux, speed, cfl,
+                                 CENTRAL2D_FIELD_MAJOR);
+}
+
+
 void central2d_free(central2d_t* sim)
 {
-    free(sim->u);
+    central2d_device_free(sim);
+    central2d_untile(sim);
+    central2d_block(sim, 0, 0);
+    central2d_set_storage(sim, CENTRAL2D_FLOAT32);
+    central2d_free_array(sim, sim->vh);
+    central2d_free_array(sim, sim->w);
+    free(sim->diag_rows);
+    mem_free(sim->mem, central2d_mem_size(sim), sim->mem_flags);
     free(sim);
 }
 
 
 int central2d_offset(central2d_t* sim, int k, int ix, int iy)
 {
-    int nx = sim->nx, ny = sim->ny, ng = sim->ng;
-    int nx_all = nx + 2*ng;
-    int ny_all = ny + 2*ng;
-    return (k*ny_all+(ng+iy))*nx_all+(ng+ix);
+    int ng = sim->ng;
+    return k*sim->field_stride + (ng+iy)*sim->row_stride +
+        (ng+ix)*sim->cell_stride;
+}
+
+
+// Copy n cells of one field between rows with cell stride cs
+static inline
+void copy_cells(float* restrict dst, const float* restrict src, int n, int cs)
+{
+    if (cs == 1) {
+        memcpy(dst, src, n * sizeof(float));
+        return;
+    }
+    for (int i = 0; i < n; ++i)
+        dst[i*cs] = src[i*cs];
 }
 
 
@@ -65,281 +340,328 @@ int central2d_offset(central2d_t* sim, int k, int ix, int iy)
  * ### Boundary conditions
  *
  * In finite volume methods, boundary conditions are typically applied by
- * setting appropriate values in ghost cells.  For our framework, we will
- * apply periodic boundary conditions; that is, waves that exit one side
+ * setting appropriate values in ghost cells.  By default, we apply
+ * periodic boundary conditions; that is, waves that exit one side
  * of the domain will enter from the other side.
  *
  * We apply the conditions by assuming that the cells with coordinates
  * `nghost <= ix <= nx+nghost` and `nghost <= iy <= ny+nghost` are
  * "canonical", and setting the values for all other cells `(ix,iy)`
  * to the corresponding canonical values `(ix+p*nx,iy+q*ny)` for some
- * integers `p` and `q`.
+ * integers `p` and `q`.  We go through the rows once: a ghost row is
+ * copied whole from its image row (wrapping around in x), and a real
+ * row only gets its ghost cells on the left and right.  Each row
+ * segment is copied for all the fields at once; in the cell-interleaved
+ * layout, that is a single contiguous copy.
  */
 
+// Copy n cells of every field between rows, negating field kneg (if any)
 static inline
-void copy_subgrid(float* restrict dst,
-                  const float* restrict src,
-                  int nx, int ny, int stride)
+void copy_row_cells(float* restrict dst, const float* restrict src, int n,
+                    int nfield, int fs, int cs, int kneg)
 {
-    for (int iy = 0; iy < ny; ++iy)
-        for (int ix = 0; ix < nx; ++ix)
-            dst[iy*stride+ix] = src[iy*stride+ix];
+    if (fs == 1 && cs == nfield)
+        memcpy(dst, src, n * nfield * sizeof(float));
+    else
+        for (int k = 0; k < nfield; ++k)
+            copy_cells(dst + k*fs, src + k*fs, n, cs);
+    if (kneg >= 0 && kneg < nfield)
+        for (int i = 0; i < n; ++i)
+            dst[kneg*fs + i*cs] = -dst[kneg*fs + i*cs];
 }
 
 void central2d_periodic(float* restrict u,
-                        int nx, int ny, int ng, int nfield)
+                        int nx, int ny, int ng, int nfield,
+                        int s, int fs, int cs)
 {
-    // Stride and number per field
-    int s = nx + 2*ng;
-    int field_stride = (ny+2*ng)*s;
-
-    // Offsets of left, right, top, and bottom data blocks and ghost blocks
-    int l = nx,   lg = 0;
-    int r = ng,   rg = nx+ng;
-    int b = ny*s, bg = 0;
-    int t = ng*s, tg = (nx+ng)*s;
-
-    // Copy data into ghost cells on each side
-    for (int k = 0; k < nfield; ++k) {
-        float* uk = u + k*field_stride;
-        copy_subgrid(uk+lg, uk+l, ng, ny+2*ng, s);
-        copy_subgrid(uk+rg, uk+r, ng, ny+2*ng, s);
-        copy_subgrid(uk+tg, uk+t, nx+2*ng, ng, s);
-        copy_subgrid(uk+bg, uk+b, nx+2*ng, ng, s);
+    PROFILE_BEGIN(periodic);
+    for (int iy = -ng; iy < ny+ng; ++iy) {
+        float* row = u + (ng+iy)*s + ng*cs;
+        if (iy >= 0 && iy < ny) {
+            copy_row_cells(row - ng*cs, row + (nx-ng)*cs, ng,
+                           nfield, fs, cs, -1);
+            copy_row_cells(row + nx*cs, row, ng, nfield, fs, cs, -1);
+        } else {
+            int jy = (iy < 0 ? iy+ny : iy-ny);
+            const float* src = u + (ng+jy)*s + ng*cs;
+            copy_row_cells(row - ng*cs, src + (nx-ng)*cs, ng,
+                           nfield, fs, cs, -1);
+            copy_row_cells(row, src, nx, nfield, fs, cs, -1);
+            copy_row_cells(row + nx*cs, src, ng, nfield, fs, cs, -1);
+        }
     }
+    PROFILE_END(PROFILE_PERIODIC, periodic, 2.0*ng*(nx+ny+4*ng));
 }
 
 
 /**
- * ### Derivatives with limiters
- *
- * In order to advance the time step, we also need to estimate
- * derivatives of the fluxes and the solution values at each cell.
- * In order to maintain stability, we apply a limiter here.
- *
- * The minmod limiter *looks* like it should be expensive to computer,
- * since superficially it seems to require a number of branches.
- * We do something a little tricky, getting rid of the condition
- * on the sign of the arguments using the `copysign` instruction.
- * If the compiler does the "right" thing with `max` and `min`
- * for floating point arguments (translating them to branch-free
- * intrinsic operations), this implementation should be relatively fast.
+ * The mirror and outflow conditions fill ghost cell `-1-i` from real
+ * cell `i` (or `0`), and similarly on the other sides.  The sides in x
+ * cover the ghost rows of the periodic sides in y as well, and the
+ * sides in y then copy whole rows, ghost cells in x included.
  */
 
-
-// Branch-free computation of minmod of two numbers times 2s
 static inline
-float xmin2s(float s, float a, float b) {
-    float sa = copysignf(s, a);
-    float sb = copysignf(s, b);
-    float abs_a = fabsf(a);
-    float abs_b = fabsf(b);
-    float min_abs = (abs_a < abs_b ? abs_a : abs_b);
-    return (sa+sb) * min_abs;
+int central2d_nsides(int sides)
+{
+    int n = 0;
+    for (int side = 1; side <= CENTRAL2D_TOP; side *= 2)
+        n += (sides & side ? 1 : 0);
+    return n;
+}
+
+static
+void central2d_mirror(float* restrict u, int nx, int ny, int ng, int nfield,
+                      int s, int fs, int cs, int sides,
+                      bool reflect, int kx, int ky)
+{
+    int xsides = CENTRAL2D_LEFT | CENTRAL2D_RIGHT;
+    int ylo = (sides & CENTRAL2D_BOTTOM ? 0 : -ng);
+    int yhi = (sides & CENTRAL2D_TOP ? ny : ny+ng);
+    PROFILE_BEGIN(mark);
+    if (sides & xsides) {
+        for (int iy = ylo; iy < yhi; ++iy) {
+            float* row = u + (ng+iy)*s + ng*cs;
+            for (int k = 0; k < nfield; ++k) {
+                float* rk = row + k*fs;
+                float sign = (k == kx ? -1.0f : 1.0f);
+                for (int i = 0; i < ng; ++i) {
+                    int j = (reflect ? i : 0);
+                    if (sides & CENTRAL2D_LEFT)
+                        rk[(-1-i)*cs] = sign * rk[j*cs];
+                    if (sides & CENTRAL2D_RIGHT)
+                        rk[(nx+i)*cs] = sign * rk[(nx-1-j)*cs];
+                }
+            }
+        }
+    }
+    for (int i = 0; i < ng; ++i) {
+        int j = (reflect ? i : 0);
+        if (sides & CENTRAL2D_BOTTOM)
+            copy_row_cells(u + (ng-1-i)*s, u + (ng+j)*s, nx + 2*ng,
+                           nfield, fs, cs, ky);
+        if (sides & CENTRAL2D_TOP)
+            copy_row_cells(u + (ng+ny+i)*s, u + (ng+ny-1-j)*s, nx + 2*ng,
+                           nfield, fs, cs, ky);
+    }
+    PROFILE_END(PROFILE_PERIODIC, mark,
+                (double) ng * (central2d_nsides(sides & xsides) * (yhi-ylo) +
+                               central2d_nsides(sides & ~xsides) * (nx+2*ng)));
 }
 
+void central2d_outflow(float* u, int nx, int ny, int ng, int nfield,
+                       int s, int fs, int cs, int sides)
+{
+    central2d_mirror(u, nx, ny, ng, nfield, s, fs, cs, sides, false, -1, -1);
+}
 
-// Limited combined slope estimate
-static inline
-float limdiff(float um, float u0, float up) {
-    const float theta = 2.0;
-    const float quarter = 0.25;
-    float du1 = u0-um;   // Difference to left
-    float du2 = up-u0;   // Difference to right
-    float duc = up-um;   // Twice centered difference
-    return xmin2s( quarter, xmin2s(theta, du1, du2), duc );
+void central2d_reflect(float* u, int nx, int ny, int ng, int nfield,
+                       int s, int fs, int cs, int sides, int kx, int ky)
+{
+    central2d_mirror(u, nx, ny, ng, nfield, s, fs, cs, sides, true, kx, ky);
 }
 
 
-// Compute limited derivs
+// Same as copy_row_cells (without the negation), for 16-bit storage
 static inline
-void limited_deriv1(float* restrict du,
-                    const float* restrict u,
-                    int ncell)
+void copy_row_cells16(uint16_t* restrict dst, const uint16_t* restrict src,
+                      int n, int nfield, int fs, int cs)
 {
-    for (int i = 0; i < ncell; ++i)
-        du[i] = limdiff(u[i-1], u[i], u[i+1]);
+    if (fs == 1 && cs == nfield)
+        memcpy(dst, src, n * nfield * sizeof(uint16_t));
+    else
+        for (int k = 0; k < nfield; ++k)
+            for (int i = 0; i < n; ++i)
+                dst[k*fs + i*cs] = src[k*fs + i*cs];
 }
 
+// Same as central2d_periodic, for 16-bit storage
+static
+void central2d_periodic16(uint16_t* restrict u,
+                          int nx, int ny, int ng, int nfield,
+                          int s, int fs, int cs)
+{
+    PROFILE_BEGIN(periodic);
+    for (int iy = -ng; iy < ny+ng; ++iy) {
+        uint16_t* row = u + (ng+iy)*s + ng*cs;
+        if (iy >= 0 && iy < ny) {
+            copy_row_cells16(row - ng*cs, row + (nx-ng)*cs, ng,
+                             nfield, fs, cs);
+            copy_row_cells16(row + nx*cs, row, ng, nfield, fs, cs);
+        } else {
+            int jy = (iy < 0 ? iy+ny : iy-ny);
+            const uint16_t* src = u + (ng+jy)*s + ng*cs;
+            copy_row_cells16(row - ng*cs, src + (nx-ng)*cs, ng,
+                             nfield, fs, cs);
+            copy_row_cells16(row, src, nx, nfield, fs, cs);
+            copy_row_cells16(row + nx*cs, src, ng, nfield, fs, cs);
+        }
+    }
+    PROFILE_END(PROFILE_PERIODIC, periodic, 2.0*ng*(nx+ny+4*ng));
+}
+
+
+// Fill the ghost cells of an array: bc on the given sides, and periodic
+// elsewhere (bc may be NULL)
+static
+void central2d_fill_ghost(central2d_bc_t bc, int sides, float* u,
+                          int nx, int ny, int ng, int nfield,
+                          int s, int fs, int cs)
+{
+    if (!bc || sides != CENTRAL2D_ALL_SIDES)
+        central2d_periodic(u, nx, ny, ng, nfield, s, fs, cs);
+    if (bc && sides)
+        bc(u, nx, ny, ng, nfield, s, fs, cs, sides);
+}
 
-// Compute limited derivs across stride
+
+// Apply the BCs to the solution of a solver
 static inline
-void limited_derivk(float* restrict du,
-                    const float* restrict u,
-                    int ncell, int stride)
+void central2d_fill_ghost_sim(central2d_t* sim)
 {
-    assert(stride > 0);
-    for (int i = 0; i < ncell; ++i)
-        du[i] = limdiff(u[i-stride], u[i], u[i+stride]);
+    central2d_fill_ghost(sim->bc, sim->bc_sides, sim->u,
+                         sim->nx, sim->ny, sim->ng, sim->nfield,
+                         sim->row_stride, sim->field_stride,
+                         sim->cell_stride);
 }
 
 
 /**
- * ### Advancing a time step
- *
- * Take one step of the numerical scheme.  This consists of two pieces:
- * a first-order corrector computed at a half time step, which is used
- * to obtain new $F$ and $G$ values; and a corrector step that computes
- * the solution at the full step.  For full details, we refer to the
- * [Jiang and Tadmor paper][jt].
+ * ### Step pairs
  *
- * The `compute_step` function takes two arguments: the `io` flag
- * which is the time step modulo 2 (0 if even, 1 if odd); and the `dt`
- * flag, which actually determines the time step length.  We need
- * to know the even-vs-odd distinction because the Jiang-Tadmor
- * scheme alternates between a primary grid (on even steps) and a
- * staggered grid (on odd steps).  This means that the data at $(i,j)$
- * in an even step and the data at $(i,j)$ in an odd step represent
- * values at different locations in space, offset by half a space step
- * in each direction.  Every other step, we shift things back by one
- * mesh cell in each direction, essentially resetting to the primary
- * indexing scheme.
- *
- * We're slightly tricky in the corrector in that we write
- * $$
- *   v(i,j) = (s(i+1,j) + s(i,j)) - (d(i+1,j)-d(i,j))
- * $$
- * where $s(i,j)$ comprises the $u$ and $x$-derivative terms in the
- * update formula, and $d(i,j)$ the $y$-derivative terms.  This cuts
- * the arithmetic cost a little (not that it's that big to start).
- * It also makes it more obvious that we only need four rows worth
- * of scratch space.
+ * Steps always come in pairs (a step to the staggered grid and a step
+ * back).  The `central2d_step2` function takes a pair of steps on a
+ * window with `nx` by `ny` real cells and four ghost cells on each
+ * side, reading from `u` and writing the new real cell values to `w`
+ * (which may be the same as `u`).  The second step puts its half-step
+ * predictions in `wh`; if this is `w`, then the whole window of `w`
+ * is overwritten, and the result is only valid on the real cells.
+ * The `step` argument is one of the step functions in
+ * `stepper_kernels.h`, either from the general kernels compiled here
+ * or from a specialized set (see `central2d_set_kernels`).
  */
 
+static const central2d_kernels_t central2d_general_kernels = {
+    0, NULL, central2d_step, central2d_step_fluxed, central2d_step_fused,
+    central2d_step_fused16, central2d_step_fused_diag, NULL
+};
 
-// Predictor half-step
-static
-void central2d_predict(float* restrict v,
-                       float* restrict scratch,
-                       const float* restrict u,
-                       const float* restrict f,
-                       const float* restrict g,
-                       float dtcdx2, float dtcdy2,
-                       int nx, int ny, int nfield)
-{
-    float* restrict fx = scratch;
-    float* restrict gy = scratch+nx;
-    for (int k = 0; k < nfield; ++k) {
-        for (int iy = 1; iy < ny-1; ++iy) {
-            int offset = (k*ny+iy)*nx+1;
-            limited_deriv1(fx+1, f+offset, nx-2);
-            limited_derivk(gy+1, g+offset, nx-2, nx);
-            for (int ix = 1; ix < nx-1; ++ix) {
-                int offset = (k*ny+iy)*nx+ix;
-                v[offset] = u[offset] - dtcdx2 * fx[ix] - dtcdy2 * gy[ix];
-            }
-        }
-    }
-}
 
+static inline
+const central2d_kernels_t* central2d_kernels(const central2d_t* sim)
+{
+    return (sim->kernels ? sim->kernels : &central2d_general_kernels);
+}
 
-// Corrector
-static
-void central2d_correct_sd(float* restrict s,
-                          float* restrict d,
-                          const float* restrict ux,
-                          const float* restrict uy,
-                          const float* restrict u,
-                          const float* restrict f,
-                          const float* restrict g,
-                          float dtcdx2, float dtcdy2,
-                          int xlo, int xhi)
-{
-    for (int ix = xlo; ix < xhi; ++ix)
-        s[ix] =
-            0.2500f * (u [ix] + u [ix+1]) +
-            0.0625f * (ux[ix] - ux[ix+1]) +
-            dtcdx2  * (f [ix] - f [ix+1]);
-    for (int ix = xlo; ix < xhi; ++ix)
-        d[ix] =
-            0.0625f * (uy[ix] + uy[ix+1]) +
-            dtcdy2  * (g [ix] + g [ix+1]);
-}
-
-
-// Corrector
-static
-void central2d_correct(float* restrict v,
-                       float* restrict scratch,
-                       const float* restrict u,
-                       const float* restrict f,
-                       const float* restrict g,
-                       float dtcdx2, float dtcdy2,
-                       int xlo, int xhi, int ylo, int yhi,
-                       int nx, int ny, int nfield)
-{
-    assert(0 <= xlo && xlo < xhi && xhi <= nx);
-    assert(0 <= ylo && ylo < yhi && yhi <= ny);
-
-    float* restrict ux = scratch;
-    float* restrict uy = scratch +   nx;
-    float* restrict s0 = scratch + 2*nx;
-    float* restrict d0 = scratch + 3*nx;
-    float* restrict s1 = scratch + 4*nx;
-    float* restrict d1 = scratch + 5*nx;
-
-    for (int k = 0; k < nfield; ++k) {
-
-        float*       restrict vk = v + k*ny*nx;
-        const float* restrict uk = u + k*ny*nx;
-        const float* restrict fk = f + k*ny*nx;
-        const float* restrict gk = g + k*ny*nx;
-
-        limited_deriv1(ux+1, uk+ylo*nx+1, nx-2);
-        limited_derivk(uy+1, uk+ylo*nx+1, nx-2, nx);
-        central2d_correct_sd(s1, d1, ux, uy,
-                             uk + ylo*nx, fk + ylo*nx, gk + ylo*nx,
-                             dtcdx2, dtcdy2, xlo, xhi);
 
-        for (int iy = ylo; iy < yhi; ++iy) {
+static inline
+central2d_step_t central2d_stepper(const central2d_t* sim)
+{
+    const central2d_kernels_t* k = central2d_kernels(sim);
+    return (sim->engine == CENTRAL2D_FUSED ? k->step_fused : k->step);
+}
 
-            float* tmp;
-            tmp = s0; s0 = s1; s1 = tmp;
-            tmp = d0; d0 = d1; d1 = tmp;
 
-            limited_deriv1(ux+1, uk+(iy+1)*nx+1, nx-2);
-            limited_derivk(uy+1, uk+(iy+1)*nx+1, nx-2, nx);
-            central2d_correct_sd(s1, d1, ux, uy,
-                                 uk + (iy+1)*nx, fk + (iy+1)*nx, gk + (iy+1)*nx,
-                                 dtcdx2, dtcdy2, xlo, xhi);
+// Combined flux and speed function to use with the solver's engine
+static inline
+flux_speed_t central2d_flux_speeder(central2d_t* sim)
+{
+    return (sim->engine != CENTRAL2D_FUSED ? sim->flux_speed : NULL);
+}
 
-            for (int ix = xlo; ix < xhi; ++ix)
-                vk[iy*nx+ix] = (s1[ix]+s0[ix])-(d1[ix]-d0[ix]);
-        }
-    }
+static
+void central2d_step2(central2d_step_t step,
+                     float* u, float* restrict v, float* w, float* wh,
+                     float* restrict scratch,
+                     float* restrict f,
+                     float* restrict g,
+                     int nx, int ny, int s, int fs, int cs,
+                     int nfield, flux_t flux,
+                     float dt, float dx, float dy)
+{
+    PROFILE_BEGIN(mark);
+    step(u, v, v, scratch, f, g,
+         0, nx+4, ny+4, 2, s, fs, cs,
+         nfield, flux, dt, dx, dy);
+    step(v, w, wh, scratch, f, g,
+         1, nx, ny, 4, s, fs, cs,
+         nfield, flux, dt, dx, dy);
+    PROFILE_END(PROFILE_STEP, mark, (nx+4.0)*(ny+4) + (double) nx*ny);
 }
 
 
+/**
+ * When the step pair starts with a combined flux and speed pass, the
+ * fluxes for the first (reference) step are computed before we know
+ * the time step.  `central2d_flux_speed` does this pass over the `nx`
+ * by `ny` window in the same layout as `central2d_step2`, and
+ * `central2d_step2_fluxed` takes the step pair afterward.  Since the
+ * window includes the ghost cells, the wave speeds are computed over
+ * more cells than the real cells; this is harmless, as the ghost cells
+ * hold copies of real cell values at the same time.
+ */
+
 static
-void central2d_step(float* restrict u, float* restrict v,
-                    float* restrict scratch,
-                    float* restrict f,
-                    float* restrict g,
-                    int io, int nx, int ny, int ng,
-                    int nfield, flux_t flux, speed_t speed,
-                    float dt, float dx, float dy)
+void central2d_flux_speed(flux_speed_t flux_speed,
+                          float* restrict cxy,
+                          const float* restrict u,
+                          float* restrict f,
+                          float* restrict g,
+                          int nx, int ny, int s, int fs, int cs)
 {
-    int nx_all = nx + 2*ng;
-    int ny_all = ny + 2*ng;
+    PROFILE_BEGIN(mark);
+    for (int iy = 0; iy < ny+8; ++iy)
+        flux_speed(f+iy*s, g+iy*s, cxy, u+iy*s, nx+8, fs, cs);
+    PROFILE_END(PROFILE_FLUX, mark, (nx+8.0)*(ny+8));
+}
 
-    float dtcdx2 = 0.5 * dt / dx;
-    float dtcdy2 = 0.5 * dt / dy;
 
-    flux(f, g, u, nx_all * ny_all, nx_all * ny_all);
+static
+void central2d_step2_fluxed(const central2d_kernels_t* k,
+                            float* u, float* restrict v, float* w, float* wh,
+                            float* restrict scratch,
+                            float* restrict f,
+                            float* restrict g,
+                            int nx, int ny, int s, int fs, int cs,
+                            int nfield, flux_t flux,
+                            float dt, float dx, float dy)
+{
+    PROFILE_BEGIN(mark);
+    k->step_fluxed(u, v, v, scratch, f, g,
+                   0, nx+4, ny+4, 2, s, fs, cs,
+                   nfield, flux, dt, dx, dy);
+    k->step(v, w, wh, scratch, f, g,
+            1, nx, ny, 4, s, fs, cs,
+            nfield, flux, dt, dx, dy);
+    PROFILE_END(PROFILE_STEP, mark, (nx+4.0)*(ny+4) + (double) nx*ny);
+}
 
-    central2d_predict(v, scratch, u, f, g, dtcdx2, dtcdy2,
-                      nx_all, ny_all, nfield);
 
-    // Flux values of f and g at half step
-    for (int iy = 1; iy < ny_all-1; ++iy) {
-        int jj = iy*nx_all+1;
-        flux(f+jj, g+jj, v+jj, nx_all-2, nx_all * ny_all);
-    }
+/**
+ * The last step pair of a run with the fused engine can also compute
+ * the diagnostics of the result (see `central2d_diagnostics`), with
+ * row sums going into `rowsum` and the range of field 0 into `range`.
+ */
 
-    central2d_correct(v+io*(nx_all+1), scratch, u, f, g, dtcdx2, dtcdy2,
-                      ng-io, nx+ng-io,
-                      ng-io, ny+ng-io,
-                      nx_all, ny_all, nfield);
+static
+void central2d_step2_diag(const central2d_kernels_t* k,
+                          float* u, float* restrict v, float* w,
+                          float* restrict scratch,
+                          int nx, int ny, int s, int fs, int cs,
+                          int nfield, flux_t flux,
+                          float dt, float dx, float dy,
+                          double* rowsum, float* range)
+{
+    PROFILE_BEGIN(mark);
+    k->step_fused(u, v, v, scratch, NULL, NULL,
+                  0, nx+4, ny+4, 2, s, fs, cs,
+                  nfield, flux, dt, dx, dy);
+    range[0] = INFINITY;
+    range[1] = -INFINITY;
+    k->step_fused_diag(v, w, scratch,
+                       1, nx, ny, 4, s, fs, cs,
+                       nfield, flux, dt, dx, dy, rowsum, range);
+    PROFILE_END(PROFILE_STEP, mark, (nx+4.0)*(ny+4) + (double) nx*ny);
 }
 
 
@@ -355,51 +677,1796 @@ void central2d_step(float* restrict u, float* restrict v,
  *
  * We always take an even number of steps so that the solution
  * at the end lives on the main grid instead of the staggered grid.
+ * If `flux_speed` is not `NULL` (which is only allowed with the
+ * reference step), we get the wave speeds from the first flux pass
+ * of each step pair rather than from a separate pass.  If `rowsum` is
+ * not `NULL` (which is only allowed with the fused step and four
+ * ghost cells), the last step pair computes the diagnostics.
+ *
+ * With `ng` ghost cells, we fill them once for each batch of `ng/4`
+ * step pairs, as in the tiled solver (see `tiles_step2`).  Step pair
+ * `j` of a batch is taken on the window of cells that are still valid
+ * after the pairs before it: it reads a window starting `4*j` cells
+ * in from the edge of the ghost cell region (plus any cells beyond a
+ * multiple of four), and its new values cover the window of the next
+ * pair.  The wave speeds are taken over the same window; the ghost
+ * cells there are copies of real cells, so the max is the same as over
+ * the real cells, and so is the time step.  (With a non-periodic
+ * boundary condition, we apply it again to the ghost cells of each
+ * window after the first; see `central2d_set_bc`.)
  */
 
 static
-int central2d_xrun(float* restrict u, float* restrict v,
+int central2d_xrun(const central2d_kernels_t* k, central2d_step_t step,
+                   float* restrict u, float* restrict v,
                    float* restrict scratch,
                    float* restrict f,
                    float* restrict g,
-                   int nx, int ny, int ng,
+                   int nx, int ny, int ng, int s, int fs, int cs,
                    int nfield, flux_t flux, speed_t speed,
+                   flux_speed_t flux_speed,
+                   central2d_bc_t bc, int sides,
+                   double* rowsum, float* range,
                    float tfinal, float dx, float dy, float cfl)
 {
     int nstep = 0;
-    int nx_all = nx + 2*ng;
-    int ny_all = ny + 2*ng;
+    int nbatch = ng/4;
+    bool done = false;
+    float t = 0;
+    while (!done) {
+        central2d_fill_ghost(bc, sides, u, nx, ny, ng, nfield, s, fs, cs);
+        for (int j = 0; j < nbatch && !done; ++j) {
+            int o = (ng - 4*(nbatch-j)) * (s+cs);
+            if (j > 0 && bc && sides)
+                bc(u+o, nx, ny, 4*(nbatch-j), nfield, s, fs, cs, sides);
+            int nxw = nx + 8*(nbatch-1-j);
+            int nyw = ny + 8*(nbatch-1-j);
+            int nx_all = nxw + 8;
+            int ny_all = nyw + 8;
+            float cxy[2] = {1.0e-15f, 1.0e-15f};
+            if (flux_speed) {
+                central2d_flux_speed(flux_speed, cxy, u+o, f+o, g+o,
+                                     nxw, nyw, s, fs, cs);
+            } else {
+                PROFILE_BEGIN(mark);
+                if (s == nx_all*cs)
+                    speed(cxy, u+o, nx_all * ny_all, fs, cs);
+                else
+                    for (int iy = 0; iy < ny_all; ++iy)
+                        speed(cxy, u + o + iy*s, nx_all, fs, cs);
+                PROFILE_END(PROFILE_SPEED, mark, (double) nx_all*ny_all);
+            }
+            float dt = cfl / fmaxf(cxy[0]/dx, cxy[1]/dy);
+            if (t + 2*dt >= tfinal) {
+                dt = (tfinal-t)/2;
+                done = true;
+            }
+            if (flux_speed)
+                central2d_step2_fluxed(k, u+o, v+o, u+o, u+o, scratch,
+                                       f+o, g+o, nxw, nyw, s, fs, cs,
+                                       nfield, flux, dt, dx, dy);
+            else if (done && rowsum)
+                central2d_step2_diag(k, u+o, v+o, u+o, scratch,
+                                     nxw, nyw, s, fs, cs,
+                                     nfield, flux, dt, dx, dy,
+                                     rowsum, range);
+            else
+                central2d_step2(step, u+o, v+o, u+o, u+o, scratch,
+                                f+o, g+o, nxw, nyw, s, fs, cs,
+                                nfield, flux, dt, dx, dy);
+            t += 2*dt;
+            nstep += 2;
+        }
+    }
+    return nstep;
+}
+
+
+/**
+ * With 16-bit storage, the loop is the same, but the solution lives in
+ * `u16` and `v16`.  We widen each row of real cells into the scratch
+ * space to compute the wave speeds, and the 16-bit fused step does the
+ * rest of the conversions as it reads and writes rows.  Since the two
+ * arrays have the same strides as `u`, we convert to and from `u` in
+ * one pass over the whole block (ghost cells and padding included).
+ * With a deep halo, we take one step pair per ghost cell fill, on the
+ * window of cells four layers out from the real cells.
+ */
+
+static
+int central2d_half_run(central2d_t* sim, float tfinal)
+{
+    const central2d_kernels_t* k = central2d_kernels(sim);
+    half_format_t format =
+        (sim->storage == CENTRAL2D_BFLOAT16 ? HALF_BF16 : HALF_FP16);
+    uint16_t* restrict u = sim->u16;
+    uint16_t* restrict v = sim->v16;
+    float* restrict scratch = sim->scratch;
+    int nx = sim->nx, ny = sim->ny, ng = sim->ng, nfield = sim->nfield;
+    int s = sim->row_stride, fs = sim->field_stride, cs = sim->cell_stride;
+    float dx = sim->dx, dy = sim->dy;
+    int o = (ng-4) * (s+cs);
+
+    half_from_float(u, sim->u, sim->array_size, 1, format);
+    int nstep = 0;
     bool done = false;
     float t = 0;
     while (!done) {
         float cxy[2] = {1.0e-15f, 1.0e-15f};
-        central2d_periodic(u, nx, ny, ng, nfield);
-        speed(cxy, u, nx_all * ny_all, nx_all * ny_all);
-        float dt = cfl / fmaxf(cxy[0]/dx, cxy[1]/dy);
+        central2d_periodic16(u, nx, ny, ng, nfield, s, fs, cs);
+        PROFILE_BEGIN(speed);
+        for (int iy = 0; iy < ny; ++iy) {
+            for (int kf = 0; kf < nfield; ++kf)
+                half_to_float(scratch + kf*nx, u + kf*fs + (ng+iy)*s + ng*cs,
+                              nx, cs, format);
+            sim->speed(cxy, scratch, nx, nx, 1);
+        }
+        PROFILE_END(PROFILE_SPEED, speed, (double) nx*ny);
+        float dt = sim->cfl / fmaxf(cxy[0]/dx, cxy[1]/dy);
         if (t + 2*dt >= tfinal) {
             dt = (tfinal-t)/2;
             done = true;
         }
-        central2d_step(u, v, scratch, f, g,
-                       0, nx+4, ny+4, ng-2,
-                       nfield, flux, speed,
-                       dt, dx, dy);
-        central2d_step(v, u, scratch, f, g,
-                       1, nx, ny, ng,
-                       nfield, flux, speed,
-                       dt, dx, dy);
+        PROFILE_BEGIN(step);
+        k->step_fused16(u+o, v+o, scratch, 0, nx+4, ny+4, 2, s, fs, cs,
+                        nfield, sim->flux, dt, dx, dy, format);
+        k->step_fused16(v+o, u+o, scratch, 1, nx, ny, 4, s, fs, cs,
+                        nfield, sim->flux, dt, dx, dy, format);
+        PROFILE_END(PROFILE_STEP, step, (nx+4.0)*(ny+4) + (double) nx*ny);
         t += 2*dt;
         nstep += 2;
     }
+    half_to_float(sim->u, u, sim->array_size, 1, format);
     return nstep;
 }
 
 
-int central2d_run(central2d_t* sim, float tfinal)
+/**
+ * ### Advancing part of the grid
+ *
+ * Solvers that manage their own ghost cell data (e.g. the distributed
+ * memory solver) use the following two functions rather than
+ * `central2d_run`.  Each updates a running max wave speed or takes a
+ * step pair on a block of real cells; see the interface notes.
+ */
+
+void central2d_speed(central2d_t* sim, float* cxy)
+{
+    PROFILE_BEGIN(mark);
+    for (int iy = 0; iy < sim->ny; ++iy)
+        sim->speed(cxy, sim->u + central2d_offset(sim, 0, 0, iy),
+                   sim->nx, sim->field_stride, sim->cell_stride);
+    PROFILE_END(PROFILE_SPEED, mark, (double) sim->nx*sim->ny);
+}
+
+
+void central2d_step_block(central2d_t* sim, float* w,
+                          int ix, int iy, int nx, int ny, float dt)
+{
+    int e = sim->ng - 4;
+    assert(-e <= ix && ix+nx <= sim->nx+e && nx > 0);
+    assert(-e <= iy && iy+ny <= sim->ny+e && ny > 0);
+    int o = central2d_offset(sim, 0, ix-4, iy-4);
+    float* wh = w;
+    if (sim->engine != CENTRAL2D_FUSED) {
+        if (!sim->vh)
+            sim->vh = central2d_alloc_array(sim);
+        wh = sim->vh;
+    }
+    central2d_step2(central2d_stepper(sim),
+                    sim->u + o, sim->v + o, w + o, wh + o,
+                    sim->scratch, sim->f + o, sim->g + o,
+                    nx, ny, sim->row_stride, sim->field_stride,
+                    sim->cell_stride,
+                    sim->nfield, sim->flux, dt, sim->dx, sim->dy);
+}
+
+
+float central2d_limdiff(float um, float u0, float up)
+{
+    return limdiff(um, u0, up);
+}
+
+
+float central2d_roughness(central2d_t* sim, int ix, int iy, int nx, int ny)
+{
+    int s = sim->row_stride, cs = sim->cell_stride;
+    float rmax = 0;
+    for (int k = 0; k < sim->nfield; ++k)
+        for (int j = iy; j < iy+ny; ++j) {
+            const float* u = sim->u + central2d_offset(sim, k, ix, j);
+            for (int i = 0; i < nx; ++i, u += cs) {
+                float du = fabsf(limdiff(u[-cs], u[0], u[cs])) +
+                    fabsf(limdiff(u[-s], u[0], u[s]));
+                float jump = fmaxf(fabsf(u[cs]-u[0]), fabsf(u[s]-u[0]));
+                rmax = fmaxf(rmax, fmaxf(du, jump));
+            }
+        }
+    return rmax;
+}
+
+
+/**
+ * ### Cache blocked solver
+ *
+ * For large grids, even a single row of one field may not fit in
+ * the L1 cache, and the limited derivatives in the $y$ direction touch
+ * three rows at a time.  In the blocked mode, we advance the grid
+ * in `bx` by `by` blocks.  For each block, we copy the block together
+ * with four layers of surrounding cells (the step pair only depends on
+ * cells within three layers of the block, but the staggered grid indexing
+ * in the step functions reads one more) into a small workspace solver,
+ * take a step pair there with the usual step engine, and copy the new
+ * real cell values into `v`.  When all the blocks are done, `v` holds
+ * the new solution, and we swap `u` and `v`.
+ *
+ * The workspace is a solver structure of its own, with the size of a full
+ * block; blocks at the right and top edges of the grid may be smaller,
+ * and use only part of the workspace.
+ */
+
+/**
+ * When skipping uniform blocks (see `central2d_set_skip`), we check the
+ * copy of the block and its halo in the workspace, which is in cache;
+ * a skipped block is copied back to `v` unchanged.
+ */
+
+static
+bool block_uniform(central2d_t* blk, int nx, int ny, float tol)
+{
+    int cs = blk->cell_stride;
+    for (int k = 0; k < blk->nfield; ++k) {
+        float umin = blk->u[central2d_offset(blk, k, -4, -4)];
+        float umax = umin;
+        for (int j = -4; j < ny+4; ++j) {
+            const float* u = blk->u + central2d_offset(blk, k, -4, j);
+            for (int i = 0; i < nx+8; ++i) {
+                umin = (u[i*cs] < umin ? u[i*cs] : umin);
+                umax = (u[i*cs] > umax ? u[i*cs] : umax);
+            }
+            if (umax-umin > tol)
+                return false;
+        }
+    }
+    return true;
+}
+
+
+static
+void block_step2(central2d_t* sim, int ix, int iy, int nx, int ny, float dt)
+{
+    central2d_t* blk = sim->block;
+    int cs = sim->cell_stride;
+    for (int k = 0; k < sim->nfield; ++k)
+        for (int j = -4; j < ny+4; ++j)
+            copy_cells(blk->u + central2d_offset(blk, k, -4, j),
+                       sim->u + central2d_offset(sim, k, ix-4, iy+j),
+                       nx+8, cs);
+    bool skip = (sim->skip_tol >= 0 &&
+                 block_uniform(blk, nx, ny, sim->skip_tol));
+    if (!skip)
+        central2d_step2(central2d_stepper(sim),
+                        blk->u, blk->v, blk->u, blk->u,
+                        blk->scratch, blk->f, blk->g,
+                        nx, ny, blk->row_stride, blk->field_stride, cs,
+                        sim->nfield, sim->flux, dt, sim->dx, sim->dy);
+    sim->block_nstep += 1;
+    sim->block_nskip += skip;
+    for (int k = 0; k < sim->nfield; ++k)
+        for (int j = 0; j < ny; ++j)
+            copy_cells(sim->v + central2d_offset(sim, k, ix, iy+j),
+                       blk->u + central2d_offset(blk, k, 0, j),
+                       nx, cs);
+}
+
+
+// Update the v array for all blocks in rows [0,ny) of the grid
+static
+void blocks_step2(central2d_t* sim, int ny, float dt)
+{
+    int bx = sim->bx, by = sim->by;
+    for (int iy = 0; iy < ny; iy += by)
+        for (int ix = 0; ix < sim->nx; ix += bx)
+            block_step2(sim, ix, iy,
+                        (ix+bx <= sim->nx ? bx : sim->nx-ix),
+                        (iy+by <= ny ? by : ny-iy), dt);
+}
+
+
+static
+int central2d_blocked_run(central2d_t* sim, float tfinal)
 {
-    return central2d_xrun(sim->u, sim->v, sim->scratch,
-                          sim->f, sim->g,
-                          sim->nx, sim->ny, sim->ng,
-                          sim->nfield, sim->flux, sim->speed,
-                          tfinal, sim->dx, sim->dy, sim->cfl);
+    int ny = sim->ny;
+    int nstep = 0;
+    bool done = false;
+    float t = 0;
+    while (!done) {
+        float cxy[2] = {1.0e-15f, 1.0e-15f};
+        central2d_fill_ghost_sim(sim);
+        central2d_speed(sim, cxy);
+        float dt = sim->cfl / fmaxf(cxy[0]/sim->dx, cxy[1]/sim->dy);
+        if (t + 2*dt >= tfinal) {
+            dt = (tfinal-t)/2;
+            done = true;
+        }
+        blocks_step2(sim, ny, dt);
+        float* tmp = sim->u;
+        sim->u = sim->v;
+        sim->v = tmp;
+        t += 2*dt;
+        nstep += 2;
+    }
+    return nstep;
+}
+
+
+void central2d_block(central2d_t* sim, int bx, int by)
+{
+    if (sim->block)
+        central2d_free(sim->block);
+    sim->block = NULL;
+    sim->bx = 0;
+    sim->by = 0;
+    if (bx <= 0 || by <= 0)
+        return;
+    if (bx > sim->nx) bx = sim->nx;
+    if (by > sim->ny) by = sim->ny;
+    sim->bx = bx;
+    sim->by = by;
+    sim->block = central2d_alloc(bx, by, 4, sim->nfield,
+                                 sim->flux, sim->speed, sim->cfl,
+                                 sim->layout);
+}
+
+
+/**
+ * The best block size depends on the cache sizes of the machine (and on
+ * the step engine), so we provide a simple tuner.  For each candidate
+ * size, we time block step pairs on a band of rows near the bottom of the
+ * grid (enough to cover about a million cells), writing only to `v`, so
+ * the state of the simulation is unchanged.  We report the time per cell
+ * for each candidate to `log` (unless it is `NULL`) and leave the solver
+ * set up with the fastest block size.
+ */
+
+static
+double central2d_wtime(void)
+{
+#ifdef _OPENMP
+    return omp_get_wtime();
+#else
+    return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+
+void central2d_tune_block(central2d_t* sim, FILE* log)
+{
+    static const int widths[]  = {32, 64, 128, 256, 512, 1024, 0};
+    static const int heights[] = {4, 8, 16, 32, 64, 128, 0};
+    int nx = sim->nx, ny = sim->ny;
+
+    central2d_fill_ghost_sim(sim);
+    float cxy[2] = {1.0e-15f, 1.0e-15f};
+    central2d_speed(sim, cxy);
+    float dt = sim->cfl / fmaxf(cxy[0]/sim->dx, cxy[1]/sim->dy);
+
+    int best_bx = nx, best_by = ny;
+    double best_time = -1;
+    for (int i = 0; ; ++i) {
+        int bx = (widths[i] && widths[i] < nx ? widths[i] : nx);
+        for (int j = 0; ; ++j) {
+            int by = (heights[j] && heights[j] < ny ? heights[j] : ny);
+            int nrow = (1 << 20)/nx + 1;
+            nrow = ((nrow + by-1)/by) * by;
+            if (nrow > ny)
+                nrow = ny;
+
+            central2d_block(sim, bx, by);
+            double elapsed = 0;
+            for (int trial = 0; trial < 2; ++trial) {
+                double t0 = central2d_wtime();
+                blocks_step2(sim, nrow, dt);
+                elapsed = central2d_wtime() - t0;
+            }
+            double tcell = elapsed / ((double) nx * nrow);
+            if (log)
+                fprintf(log, "  Block %d x %d: %g ns/cell\n",
+                        bx, by, 1e9*tcell);
+            if (best_time < 0 || tcell < best_time) {
+                best_time = tcell;
+                best_bx = bx;
+                best_by = by;
+            }
+            if (by == ny)
+                break;
+        }
+        if (bx == nx)
+            break;
+    }
+    central2d_block(sim, best_bx, best_by);
+    sim->block_nstep = 0;
+    sim->block_nskip = 0;
+}
+
+
+void central2d_set_skip(central2d_t* sim, float tol)
+{
+    sim->skip_tol = tol;
+    sim->block_nstep = 0;
+    sim->block_nskip = 0;
+}
+
+
+void central2d_skip_stats(central2d_t* sim, long long* nskip,
+                          long long* nstep)
+{
+    *nskip = sim->block_nskip;
+    *nstep = sim->block_nstep;
+    sim->block_nskip = 0;
+    sim->block_nstep = 0;
+}
+
+
+/**
+ * ### Tiled parallel solver
+ *
+ * In the tiled mode, the grid is partitioned into `px` by `py`
+ * subdomains, each of which is owned by a thread and has its own
+ * solver structure (with its own copies of `u`, `v`, `f`, `g`, and
+ * scratch).  Following the stencil analysis in the discussion of the
+ * Jiang-Tadmor scheme, each step pair consumes four layers of ghost
+ * cells; by giving the tiles `4*nbatch` ghost cells, we can take
+ * `nbatch` step pairs between ghost cell exchanges.  On the `j`th pair
+ * in a batch, we only advance the window of cells that is still valid,
+ * which shrinks by four cells on each side per pair.
+ *
+ * The time step still has to agree across the tiles, so every step pair
+ * involves a (cheap) reduction of the tile wave speeds; but the data
+ * exchange happens only once per batch, and it only touches the ghost
+ * cells.  With a combined flux and speed function, each tile gets its
+ * wave speeds from the first flux pass over its window.  The tiles read
+ * their ghost data directly from the neighboring tiles, so the main `u`
+ * array is only read at the start of a call to `central2d_run` and
+ * written at the end.  Across the periodic sides of the domain, the
+ * neighbors are the tiles on the other side; on a side with another
+ * boundary condition, the tiles along it then apply the condition to
+ * their own ghost cells there, after loading them and again on the
+ * window of each later pair in the batch.
+ *
+ * Tile `(i,j)` owns the cells with `x0(i) <= ix < x0(i+1)` and
+ * `y0(j) <= iy < y0(j+1)`, where `x0(i) = (i*nx)/px` and similarly
+ * for `y0`.
+ */
+
+static inline
+int partition_start(int i, int n, int p)
+{
+    return (int) (((long) i * n) / p);
+}
+
+static inline
+int partition_size(int i, int n, int p)
+{
+    return partition_start(i+1, n, p) - partition_start(i, n, p);
+}
+
+static inline
+int partition_owner(int ix, int n, int p)
+{
+    return (int) (((long) (ix+1) * p - 1) / n);
+}
+
+static inline
+int wrap_index(int i, int n)
+{
+    i %= n;
+    return (i < 0 ? i+n : i);
+}
+
+
+// Copy n values from global row iy of field k, starting at column ix
+// (both taken modulo the grid size), into dst.
+static
+void tiles_read_row(central2d_t* sim, float* restrict dst,
+                    int k, int ix, int iy, int n, bool from_tiles)
+{
+    int nx = sim->nx, ny = sim->ny, px = sim->px, py = sim->py;
+    int cs = sim->cell_stride;
+    iy = wrap_index(iy, ny);
+    ix = wrap_index(ix, nx);
+    int j  = partition_owner(iy, ny, py);
+    while (n > 0) {
+        int i = partition_owner(ix, nx, px);
+        int x1 = partition_start(i+1, nx, px);
+        int m = (x1-ix < n ? x1-ix : n);
+        const float* src;
+        if (from_tiles) {
+            central2d_t* tile = sim->tiles[j*px+i];
+            src = tile->u + central2d_offset(tile, k,
+                                             ix - partition_start(i, nx, px),
+                                             iy - partition_start(j, ny, py));
+        } else {
+            src = sim->u + central2d_offset(sim, k, ix, iy);
+        }
+        copy_cells(dst, src, m, cs);
+        dst += m*cs;
+        n -= m;
+        ix = (x1 == nx ? 0 : x1);
+    }
+}
+
+
+// Apply the BCs on the domain edges of a tile to the window of pair j
+static inline
+void tiles_bc(central2d_t* tile, float* u, int j)
+{
+    int s = tile->row_stride, fs = tile->field_stride, cs = tile->cell_stride;
+    if (tile->bc && tile->bc_sides)
+        tile->bc(u + 4*j*(s+cs), tile->nx, tile->ny, tile->ng - 4*j,
+                 tile->nfield, s, fs, cs, tile->bc_sides);
+}
+
+
+// Fill tile data from the global grid (or only ghost cells from neighbors)
+static
+void tiles_load(central2d_t* sim, int id, bool ghost_only)
+{
+    central2d_t* tile = sim->tiles[id];
+    int x0 = partition_start(id % sim->px, sim->nx, sim->px);
+    int y0 = partition_start(id / sim->px, sim->ny, sim->py);
+    int nx = tile->nx, ny = tile->ny, ng = tile->ng, cs = tile->cell_stride;
+    for (int k = 0; k < tile->nfield; ++k)
+        for (int iy = -ng; iy < ny+ng; ++iy) {
+            float* row = tile->u + central2d_offset(tile, k, 0, iy);
+            if (ghost_only && iy >= 0 && iy < ny) {
+                tiles_read_row(sim, row-ng*cs, k, x0-ng, y0+iy, ng, true);
+                tiles_read_row(sim, row+nx*cs, k, x0+nx, y0+iy, ng, true);
+            } else {
+                tiles_read_row(sim, row-ng*cs, k, x0-ng, y0+iy, nx+2*ng,
+                               ghost_only);
+            }
+        }
+    tiles_bc(tile, tile->u, 0);
+}
+
+
+// Copy tile real cell data back to the global grid
+static
+void tiles_store(central2d_t* sim, int id)
+{
+    central2d_t* tile = sim->tiles[id];
+    int x0 = partition_start(id % sim->px, sim->nx, sim->px);
+    int y0 = partition_start(id / sim->px, sim->ny, sim->py);
+    for (int k = 0; k < tile->nfield; ++k)
+        for (int iy = 0; iy < tile->ny; ++iy)
+            copy_cells(sim->u + central2d_offset(sim, k, x0, y0+iy),
+                       tile->u + central2d_offset(tile, k, 0, iy),
+                       tile->nx, sim->cell_stride);
+}
+
+
+// Take the jth step pair in a batch, with the result in w
+static
+void tiles_step2_to(central2d_t* tile, float* w, int j, float dt)
+{
+    int nbatch = tile->ng/4;
+    int s = tile->row_stride, fs = tile->field_stride, cs = tile->cell_stride;
+    int o = 4*j*(s+cs);
+    int shrink = 8*(nbatch-1-j);
+    if (central2d_flux_speeder(tile))
+        central2d_step2_fluxed(central2d_kernels(tile),
+                               tile->u + o, tile->v + o,
+                               w + o, w + o,
+                               tile->scratch, tile->f + o, tile->g + o,
+                               tile->nx + shrink, tile->ny + shrink,
+                               s, fs, cs,
+                               tile->nfield, tile->flux,
+                               dt, tile->dx, tile->dy);
+    else
+        central2d_step2(central2d_stepper(tile),
+                        tile->u + o, tile->v + o, w + o, w + o,
+                        tile->scratch, tile->f + o, tile->g + o,
+                        tile->nx + shrink, tile->ny + shrink,
+                        s, fs, cs,
+                        tile->nfield, tile->flux, dt, tile->dx, tile->dy);
+    if (j+1 < nbatch)
+        tiles_bc(tile, w, j+1);
+}
+
+
+static inline
+void tiles_step2(central2d_t* tile, int j, float dt)
+{
+    tiles_step2_to(tile, tile->u, j, dt);
+}
+
+
+// Wave speeds for step pair j of a batch (and fluxes, if combined)
+static
+void tiles_speed(central2d_t* tile, int j, float* cxy)
+{
+    flux_speed_t flux_speed = central2d_flux_speeder(tile);
+    if (!flux_speed) {
+        central2d_speed(tile, cxy);
+        return;
+    }
+    int nbatch = tile->ng/4;
+    int s = tile->row_stride, fs = tile->field_stride, cs = tile->cell_stride;
+    int o = 4*j*(s+cs);
+    int shrink = 8*(nbatch-1-j);
+    central2d_flux_speed(flux_speed, cxy,
+                         tile->u + o, tile->f + o, tile->g + o,
+                         tile->nx + shrink, tile->ny + shrink,
+                         s, fs, cs);
+}
+
+
+/**
+ * With local time steps, the tiles do not need to agree on the time
+ * step within a batch.  Each batch advances every tile by the same
+ * time `T`, but a tile takes only as many step pairs as its own wave
+ * speeds require, up to `nbatch`.  A tile needs the wave speeds over
+ * its whole window (not just its real cells), since the ghost cells it
+ * advances on its own may be moving faster than its real cells.  We
+ * choose `T` so that the fastest tile needs `nbatch` pairs at the
+ * fraction `LOCAL_STEP_SAFETY` of the CFL limit, at the wave speeds at
+ * the start of the batch.  A tile starts with a single pair of length
+ * `T/2` and, at the start of each pair, halves the step until it meets
+ * the CFL limit at the current speeds, so the steps are always `T`
+ * over a power of two.  The steps of different tiles then line up
+ * exactly, and a tile with no flow (still water) stays exactly still,
+ * whatever steps its neighbors take.  If the speeds grow so
+ * much that a tile would need more pairs than the batch has left, the
+ * tiles go back to the state at the start of the batch (which they
+ * keep in `w`) and take it again in half the time; so every pair
+ * satisfies the CFL condition.  As with lagged steps, `nrollback`
+ * counts the batches taken again.
+ *
+ * A tile computes the fluxes through its edges from its own copy of
+ * its neighbors' cells, at its own time steps, so when two neighbors
+ * take different steps, the fluxes they see through their shared edge
+ * do not quite agree, and the scheme no longer conserves the totals.
+ * We fix this by refluxing.  In a step pair, each real cell gives a
+ * part of itself (a quarter of its value, plus slope and flux terms)
+ * to each of the four staggered cells that overlap it, and then gets a
+ * part of each of them back.  The parts of a cell add up to the whole
+ * in both steps, so all that a tile gains or loses goes through the
+ * ring of staggered cells that straddle its edges.  For each staggered
+ * cell in its ring, a tile adds up what its real cells give to it and
+ * get back from it over all of the tile's pairs in the batch
+ * (`central2d_ring_out` and `central2d_ring_in` recompute these parts
+ * with the formulas of the step, for the cells along the edges only).  The
+ * sums of the tiles that share a staggered cell would add up to zero
+ * if they had taken the same steps.  After the batch, each of these
+ * tiles corrects its real cells under the staggered cell by an equal
+ * share of what their sums add up to, which is the same as having them
+ * all use the average of their transfers.  The totals are then
+ * conserved to rounding.  We skip the correction for the staggered
+ * cells shared only by tiles that took the same time steps, since the
+ * scheme conserves the totals through them without it.
+ *
+ * This is a correct scheme, but not a faster one on the test
+ * problems.  The ring sums cost about a tenth of the time of the
+ * steps, the batch has to be saved in `w` before it starts, and the
+ * fastest tile may take more pairs than in the ordinary run, because
+ * of the safety margin, the power of two steps, the batches taken
+ * again, and the batches cut short at the end of each frame.  At 400
+ * by 400 with 4 by 4 tiles and batches of 4 pairs, on one core, the
+ * dam break took 2 percent more steps and 18 percent more time than
+ * the ordinary run, and the wave 16 percent more steps and 30 percent
+ * more time.  The savings from the slower tiles only make
+ * up for this when the wave speeds vary a lot from tile to tile, or
+ * there are many small tiles and a deep halo; for gravity waves on
+ * water of nearly uniform depth, local steps are slower.
+ */
+
+#define LOCAL_STEP_SAFETY 0.95f
+
+// Wave speeds over the whole window for step pair j of a batch
+static
+void tiles_window_speed(central2d_t* tile, int j, float* cxy)
+{
+    if (central2d_flux_speeder(tile)) {
+        tiles_speed(tile, j, cxy);
+        return;
+    }
+    int nbatch = tile->ng/4;
+    int s = tile->row_stride, fs = tile->field_stride, cs = tile->cell_stride;
+    int o = 4*j*(s+cs);
+    int shrink = 8*(nbatch-1-j);
+    int n = tile->nx + shrink + 8;
+    PROFILE_BEGIN(mark);
+    for (int iy = 0; iy < tile->ny + shrink + 8; ++iy)
+        tile->speed(cxy, tile->u + o + iy*s, n, fs, cs);
+    PROFILE_END(PROFILE_SPEED, mark, (double) n * (tile->ny + shrink + 8));
+}
+
+
+/**
+ * The ring of a tile is the staggered cells `(bx, by)` with
+ * `-1 <= bx < nx` and `-1 <= by < ny` (staggered cell `(bx, by)` sits
+ * over the cells `bx` and `bx+1` in x and `by` and `by+1` in y) that
+ * are on the edges of that range: the bottom row, the top row, then
+ * the left and right columns without the corners.
+ */
+
+static inline
+int tiles_ring_size(const central2d_t* tile)
+{
+    return 2*(tile->nx + tile->ny);
+}
+
+// Index of staggered cell (bx, by) in the ring (-1 if not in it)
+static inline
+int tiles_ring_index(int bx, int by, int nx, int ny)
+{
+    if (bx < -1 || bx >= nx || by < -1 || by >= ny)
+        return -1;
+    if (by == -1)
+        return bx+1;
+    if (by == ny-1)
+        return (nx+1) + bx+1;
+    if (bx == -1)
+        return 2*(nx+1) + by;
+    if (bx == nx-1)
+        return 2*(nx+1) + (ny-1) + by;
+    return -1;
+}
+
+// Staggered cell at index r in the ring
+static inline
+void tiles_ring_cell(int r, int nx, int ny, int* bx, int* by)
+{
+    if (r < 2*(nx+1)) {
+        *bx = r % (nx+1) - 1;
+        *by = (r < nx+1 ? -1 : ny-1);
+    } else {
+        r -= 2*(nx+1);
+        *bx = (r < ny-1 ? -1 : nx-1);
+        *by = r % (ny-1);
+    }
+}
+
+
+// Parts of the m cells (ix + i*ex, iy + i*ey) of u that go to the
+// cells of the other grid that overlap them in a step of length dt, as
+// computed by the step: q[((2*qy+qx)*nfield + k)*m + i] goes toward +x
+// if qx is 1 (-x if it is 0), and similarly for qy.  The result is at
+// the start of the scratch, which has room for m up to half a row.
+static
+const float* tiles_quadrants(central2d_t* tile, const float* u,
+                             int ix, int iy, int ex, int ey, int m,
+                             float dt)
+{
+    static const int nbr[5][2] = {{0,0}, {-1,0}, {1,0}, {0,-1}, {0,1}};
+    int nfield = tile->nfield, n = nfield*m;
+    int step = ex*tile->cell_stride + ey*tile->row_stride;
+    float* q  = tile->scratch;
+    float* c  = q + 4*n;      // Cells and neighbors (-x, +x, -y, +y)
+    float* f  = c + 5*n;
+    float* g  = f + 5*n;
+    float* vh = g + 5*n;      // Predictor at the half step
+    float* fh = vh + n;
+    float* gh = fh + n;
+    for (int p = 0; p < 5; ++p) {
+        for (int k = 0; k < nfield; ++k) {
+            const float* up = u + central2d_offset(tile, k, ix + nbr[p][0],
+                                                   iy + nbr[p][1]);
+            for (int i = 0; i < m; ++i)
+                c[p*n + k*m + i] = up[i*step];
+        }
+        tile->flux(f + p*n, g + p*n, c + p*n, m, m, 1);
+    }
+
+    float dtcdx2 = 0.5 * dt / tile->dx;
+    float dtcdy2 = 0.5 * dt / tile->dy;
+    for (int j = 0; j < n; ++j)
+        vh[j] = c[j] -
+            dtcdx2 * limdiff(f[n+j], f[j], f[2*n+j]) -
+            dtcdy2 * limdiff(g[3*n+j], g[j], g[4*n+j]);
+    tile->flux(fh, gh, vh, m, m, 1);
+
+    for (int j = 0; j < n; ++j) {
+        float sx = 0.0625f * limdiff(c[n+j], c[j], c[2*n+j]) +
+            dtcdx2 * fh[j];
+        float sy = 0.0625f * limdiff(c[3*n+j], c[j], c[4*n+j]) +
+            dtcdy2 * gh[j];
+        q[0*n+j] = 0.25f * c[j] - sx - sy;
+        q[1*n+j] = 0.25f * c[j] + sx - sy;
+        q[2*n+j] = 0.25f * c[j] - sx + sy;
+        q[3*n+j] = 0.25f * c[j] + sx + sy;
+    }
+    return q;
+}
+
+
+// Add to the ring sums of the nx by ny block of real cells starting
+// at (x0, y0) the parts from a line of len cells of u starting at
+// (ix, iy) in the direction (ex, ey): if staggered, the cells are
+// staggered cells in the ring (in v after a step pair), and we add what
+// they give back to the real cells in the block; otherwise they are
+// real cells next to the edges of the block (before a pair), and we
+// take out what they give to the ring.
+static
+void tiles_ring_line(central2d_t* tile, const float* u, bool staggered,
+                     int x0, int y0, int nx, int ny,
+                     int ix, int iy, int ex, int ey, int len,
+                     float dt, double* ring)
+{
+    int nfield = tile->nfield;
+    int mmax = (tile->nx + 2*tile->ng) / 2;
+    for (int i0 = 0; i0 < len; i0 += mmax) {
+        int m = (len-i0 < mmax ? len-i0 : mmax);
+        int xs = ix + i0*ex, ys = iy + i0*ey;
+        const float* q = tiles_quadrants(tile, u, x0+xs, y0+ys, ex, ey, m, dt);
+        for (int i = 0; i < m; ++i) {
+            int x = xs + i*ex, y = ys + i*ey;
+            for (int qy = 0; qy < 2; ++qy)
+                for (int qx = 0; qx < 2; ++qx) {
+                    const float* qq = q + (2*qy+qx)*nfield*m + i;
+                    if (staggered) {
+                        int r = tiles_ring_index(x, y, nx, ny);
+                        if (x+qx < 0 || x+qx >= nx || y+qy < 0 || y+qy >= ny)
+                            continue;
+                        for (int k = 0; k < nfield; ++k)
+                            ring[r*nfield+k] += qq[k*m];
+                    } else {
+                        int r = tiles_ring_index(x-1+qx, y-1+qy, nx, ny);
+                        for (int k = 0; r >= 0 && k < nfield; ++k)
+                            ring[r*nfield+k] -= qq[k*m];
+                    }
+                }
+        }
+    }
+}
+
+
+void central2d_ring_out(central2d_t* sim, int ix, int iy, int nx, int ny,
+                        float dt, double* ring)
+{
+    float* u = sim->u;
+    tiles_ring_line(sim, u, false, ix, iy, nx, ny, 0, 0, 1, 0, nx, dt, ring);
+    if (ny > 1)
+        tiles_ring_line(sim, u, false, ix, iy, nx, ny,
+                        0, ny-1, 1, 0, nx, dt, ring);
+    tiles_ring_line(sim, u, false, ix, iy, nx, ny, 0, 1, 0, 1, ny-2, dt, ring);
+    if (nx > 1)
+        tiles_ring_line(sim, u, false, ix, iy, nx, ny,
+                        nx-1, 1, 0, 1, ny-2, dt, ring);
+}
+
+
+void central2d_ring_in(central2d_t* sim, int ix, int iy, int nx, int ny,
+                       float dt, double* ring)
+{
+    float* v = sim->v;
+    tiles_ring_line(sim, v, true, ix, iy, nx, ny,
+                    -1, -1, 1, 0, nx+1, dt, ring);
+    tiles_ring_line(sim, v, true, ix, iy, nx, ny,
+                    -1, ny-1, 1, 0, nx+1, dt, ring);
+    tiles_ring_line(sim, v, true, ix, iy, nx, ny,
+                    -1, 0, 0, 1, ny-1, dt, ring);
+    tiles_ring_line(sim, v, true, ix, iy, nx, ny,
+                    nx-1, 0, 0, 1, ny-1, dt, ring);
+}
+
+
+int central2d_ring_index(int bx, int by, int nx, int ny)
+{
+    return tiles_ring_index(bx, by, nx, ny);
+}
+
+
+// Before a step pair of length 2*dt, take out of the ring sums what
+// the real cells next to the edges give to the staggered cells there
+static inline
+void tiles_ring_out(central2d_t* tile, float dt, double* ring)
+{
+    central2d_ring_out(tile, 0, 0, tile->nx, tile->ny, dt, ring);
+}
+
+
+// After a step pair, add to the ring sums what the staggered cells in
+// the ring (still in v) gave back to the real cells
+static inline
+void tiles_ring_in(central2d_t* tile, float dt, double* ring)
+{
+    central2d_ring_in(tile, 0, 0, tile->nx, tile->ny, dt, ring);
+}
+
+
+// Tiles (owner) and their staggered cell indices (b) for the staggered
+// cell over global cells ig and ig+1 of n cells split into p tiles;
+// return how many there are (one, unless the cell straddles an edge)
+static inline
+int tiles_ring_images(int ig, int n, int p, int* owner, int* b)
+{
+    int i = wrap_index(ig, n);
+    owner[0] = partition_owner(i, n, p);
+    b[0] = i - partition_start(owner[0], n, p);
+    i = wrap_index(ig+1, n);
+    owner[1] = partition_owner(i, n, p);
+    b[1] = i - partition_start(owner[1], n, p) - 1;
+    return (owner[0] == owner[1] && b[0] == b[1] ? 1 : 2);
+}
+
+
+// Correct the real cells of a tile by its share of the sums over all
+// the tiles of the ring sums for each staggered cell in its ring that
+// is shared with a tile that took different time steps (in tile_dt)
+static
+void tiles_reflux(central2d_t* sim, int id, const double* ring,
+                  const int* ring_start, const float* tile_dt)
+{
+    central2d_t* tile = sim->tiles[id];
+    int nx = tile->nx, ny = tile->ny, nfield = tile->nfield;
+    int px = sim->px, py = sim->py, nbatch = sim->nbatch;
+    int x0 = partition_start(id % px, sim->nx, px);
+    int y0 = partition_start(id / px, sim->ny, py);
+    for (int r = 0; r < tiles_ring_size(tile); ++r) {
+        int bx, by, ix[2], iy[2], bxs[2], bys[2], ids[4], rs[4];
+        tiles_ring_cell(r, nx, ny, &bx, &by);
+        int mx = tiles_ring_images(x0+bx, sim->nx, px, ix, bxs);
+        int my = tiles_ring_images(y0+by, sim->ny, py, iy, bys);
+        int n = 0;
+        bool same = true;
+        for (int a = 0; a < my; ++a)
+            for (int b = 0; b < mx; ++b, ++n) {
+                ids[n] = iy[a]*px + ix[b];
+                rs[n] = tiles_ring_index(bxs[b], bys[a],
+                                         sim->tiles[ids[n]]->nx,
+                                         sim->tiles[ids[n]]->ny);
+                assert(rs[n] >= 0);
+                same = same && !memcmp(tile_dt + id*nbatch,
+                                       tile_dt + ids[n]*nbatch,
+                                       nbatch * sizeof(float));
+            }
+        if (same)
+            continue;
+
+        // Real cells of this tile under the staggered cell
+        int x1 = (bx < 0 ? 0 : bx), x2 = (bx+1 < nx ? bx+1 : nx-1);
+        int y1 = (by < 0 ? 0 : by), y2 = (by+1 < ny ? by+1 : ny-1);
+        int ncell = (x2-x1+1) * (y2-y1+1);
+
+        for (int k = 0; k < nfield; ++k) {
+            double sum = 0;
+            for (int m = 0; m < n; ++m)
+                sum += ring[(ring_start[ids[m]] + rs[m])*nfield + k];
+            float du = (float) (-sum / (n*ncell));
+            for (int y = y1; y <= y2; ++y)
+                for (int x = x1; x <= x2; ++x)
+                    tile->u[central2d_offset(tile, k, x, y)] += du;
+        }
+    }
+}
+
+
+// Advance a tile by T with its own step pairs (given the speeds for
+// the first pair), adding the transfers through its edges to its ring
+// sums and putting the time steps in dts (zero after the last pair);
+// return the number of pairs (zero if it needs more than the batch has)
+static
+int tiles_local_run(central2d_t* tile, const float* cxy0, float T,
+                    double* ring, float* dts)
+{
+    int nbatch = tile->ng/4;
+    float dt = T/2;
+    int nleft = 1;  // Pairs of length dt left in the batch
+    for (int j = 0; j < nbatch; ++j)
+        dts[j] = 0;
+    for (int j = 0; j < nbatch; ++j) {
+        float cxy[2] = {cxy0[0], cxy0[1]};
+        if (j > 0) {
+            cxy[0] = cxy[1] = 1.0e-15f;
+            tiles_window_speed(tile, j, cxy);
+        }
+        float dt_max = tile->cfl / fmaxf(cxy[0]/tile->dx, cxy[1]/tile->dy);
+        if (j == 0)
+            dt_max *= LOCAL_STEP_SAFETY;
+        for (; dt > dt_max && nleft <= nbatch-j; nleft *= 2)
+            dt /= 2;
+        if (nleft > nbatch-j)
+            return 0;
+        dts[j] = dt;
+        tiles_ring_out(tile, dt, ring);
+        tiles_step2(tile, j, dt);
+        tiles_ring_in(tile, dt, ring);
+        if (--nleft == 0)
+            return j+1;
+    }
+    return 0;
+}
+
+
+static
+int central2d_local_run(central2d_t* sim, float tfinal)
+{
+    int ntiles = sim->px * sim->py;
+    int nbatch = sim->nbatch;
+    int nfield = sim->nfield;
+    float* tile_cxy = sim->tile_cxy;
+    float dx = sim->dx, dy = sim->dy, cfl = sim->cfl;
+    int nstep = 0, npair = 0, npair_min = 0;
+    long long nrollback = 0;
+    int npow2 = 1;
+    while (2*npow2 <= nbatch)
+        npow2 *= 2;
+    bool done = false;
+    float t = 0, T = 0;
+
+    int* ring_start = (int*) malloc((ntiles+1) * sizeof(int));
+    ring_start[0] = 0;
+    for (int id = 0; id < ntiles; ++id)
+        ring_start[id+1] = ring_start[id] + tiles_ring_size(sim->tiles[id]);
+    double* ring = (double*) malloc(ring_start[ntiles] * nfield *
+                                    sizeof(double));
+    float* tile_dt = (float*) malloc(ntiles * nbatch * sizeof(float));
+
+    #pragma omp parallel num_threads(sim->nthreads) proc_bind(spread)
+    {
+        #pragma omp for schedule(static)
+        for (int id = 0; id < ntiles; ++id)
+            if (!sim->tiles[id]->w)
+                sim->tiles[id]->w = central2d_alloc_array(sim->tiles[id]);
+
+        bool first = true;
+        while (!done) {
+
+            #pragma omp for schedule(static)
+            for (int id = 0; id < ntiles; ++id) {
+                central2d_t* tile = sim->tiles[id];
+                tiles_load(sim, id, !first);
+                memcpy(tile->w, tile->u, tile->array_size * sizeof(float));
+                memset(ring + ring_start[id]*nfield, 0,
+                       tiles_ring_size(tile) * nfield * sizeof(double));
+                tile_cxy[2*id+0] = 1.0e-15f;
+                tile_cxy[2*id+1] = 1.0e-15f;
+                tiles_window_speed(tile, 0, tile_cxy + 2*id);
+            }
+            first = false;
+
+            #pragma omp single
+            {
+                float cx = 1.0e-15f, cy = 1.0e-15f;
+                for (int id = 0; id < ntiles; ++id) {
+                    cx = fmaxf(cx, tile_cxy[2*id+0]);
+                    cy = fmaxf(cy, tile_cxy[2*id+1]);
+                }
+                float dt_max = cfl / fmaxf(cx/dx, cy/dy);
+                T = 2*npow2 * (dt_max * LOCAL_STEP_SAFETY);
+                if (t + T >= tfinal) {
+                    T = tfinal-t;
+                    done = true;
+                }
+                t += T;
+                npair = 0;
+                npair_min = nbatch;
+            }
+
+            // Take the batch, and again in half the time if a tile fails
+            while (true) {
+                #pragma omp for schedule(static) \
+                    reduction(max:npair) reduction(min:npair_min)
+                for (int id = 0; id < ntiles; ++id) {
+                    int n = tiles_local_run(sim->tiles[id], tile_cxy + 2*id,
+                                            T, ring + ring_start[id]*nfield,
+                                            tile_dt + id*nbatch);
+                    if (n > npair)
+                        npair = n;
+                    if (n < npair_min)
+                        npair_min = n;
+                }
+                if (npair_min > 0)
+                    break;
+
+                #pragma omp for schedule(static)
+                for (int id = 0; id < ntiles; ++id) {
+                    central2d_t* tile = sim->tiles[id];
+                    memcpy(tile->u, tile->w, tile->array_size * sizeof(float));
+                    memset(ring + ring_start[id]*nfield, 0,
+                           tiles_ring_size(tile) * nfield * sizeof(double));
+                }
+
+                #pragma omp single
+                {
+                    t -= T/2;
+                    T /= 2;
+                    done = false;
+                    npair = 0;
+                    npair_min = nbatch;
+                    ++nrollback;
+                }
+            }
+
+            #pragma omp for schedule(static)
+            for (int id = 0; id < ntiles; ++id)
+                tiles_reflux(sim, id, ring, ring_start, tile_dt);
+
+            #pragma omp single
+            nstep += 2*npair;
+        }
+
+        #pragma omp for schedule(static)
+        for (int id = 0; id < ntiles; ++id)
+            tiles_store(sim, id);
+    }
+    sim->nrollback += nrollback;
+    free(tile_dt);
+    free(ring);
+    free(ring_start);
+    return nstep;
+}
+
+
+/**
+ * A run is a single parallel region, and the threads stay in it from
+ * the first step pair to the last.  With the team size fixed when the
+ * tiles are made (see `central2d_tile`) and a static schedule, a
+ * tile goes to the same thread in every loop of every run, which is
+ * the thread that first touched its memory; the `proc_bind` clause
+ * keeps the threads on separate places (cores, or whatever
+ * `OMP_PLACES` says), so they do not migrate away from that memory.
+ * The OpenMP runtime keeps the team between parallel regions, so the
+ * cost of a run beyond its step pairs is a wake up of the team and
+ * the copies in and out of the tiles.
+ *
+ * Within a run, each tile computes its wave speeds for the next pair
+ * in the same loop in which it takes this one.  After the loop, every
+ * thread combines the tile speeds for itself (there are only a few,
+ * and the threads all come up with the same answer), so a step pair
+ * costs one barrier rather than three.  The tile speeds go into two
+ * buffers used for alternate pairs, so that a thread that gets ahead
+ * can start writing the speeds for the next pair while the others are
+ * still reading these.  The speeds for the first pair of a batch come
+ * from the loop that loads the ghost cells.
+ */
+
+// Time step for max(cx/dx, cy/dy) = c, cut short to end at tfinal
+static inline
+float central2d_pair_dt(float cfl, float c, float t, float tfinal,
+                        bool* done)
+{
+    float dt = cfl / c;
+    *done = (t + 2*dt >= tfinal);
+    return (*done ? (tfinal-t)/2 : dt);
+}
+
+
+// Max over the tiles of max(cx/dx, cy/dy)
+static
+float tiles_max_speed(central2d_t* sim, const float* tile_cxy)
+{
+    float cx = 1.0e-15f, cy = 1.0e-15f;
+    for (int id = 0; id < sim->px * sim->py; ++id) {
+        cx = fmaxf(cx, tile_cxy[2*id+0]);
+        cy = fmaxf(cy, tile_cxy[2*id+1]);
+    }
+    return fmaxf(cx/sim->dx, cy/sim->dy);
+}
+
+
+static
+int central2d_tiled_run(central2d_t* sim, float tfinal)
+{
+    int ntiles = sim->px * sim->py;
+    int nbatch = sim->nbatch;
+    float* tile_cxy = sim->tile_cxy;
+    float cfl = sim->cfl;
+    int nstep = 0;
+
+    #pragma omp parallel num_threads(sim->nthreads) proc_bind(spread)
+    {
+        // Every thread keeps the same copy of the time stepping state
+        float t = 0;
+        int npair = 0;
+        bool done = false, first = true;
+        while (!done) {
+
+            #pragma omp for schedule(static)
+            for (int id = 0; id < ntiles; ++id) {
+                float* cxy = tile_cxy + 2*ntiles*(npair % 2) + 2*id;
+                tiles_load(sim, id, !first);
+                cxy[0] = cxy[1] = 1.0e-15f;
+                tiles_speed(sim->tiles[id], 0, cxy);
+            }
+            first = false;
+
+            for (int j = 0; j < nbatch && !done; ++j) {
+                float* cxy = tile_cxy + 2*ntiles*(npair % 2);
+                float* cxy_next = tile_cxy + 2*ntiles*((npair+1) % 2);
+                float dt = central2d_pair_dt(cfl, tiles_max_speed(sim, cxy),
+                                             t, tfinal, &done);
+
+                #pragma omp for schedule(static)
+                for (int id = 0; id < ntiles; ++id) {
+                    tiles_step2(sim->tiles[id], j, dt);
+                    if (j+1 < nbatch && !done) {
+                        float* c = cxy_next + 2*id;
+                        c[0] = c[1] = 1.0e-15f;
+                        tiles_speed(sim->tiles[id], j+1, c);
+                    }
+                }
+                t += 2*dt;
+                ++npair;
+            }
+        }
+
+        #pragma omp for schedule(static)
+        for (int id = 0; id < ntiles; ++id)
+            tiles_store(sim, id);
+
+        #pragma omp master
+        nstep = 2*npair;
+    }
+    return nstep;
+}
+
+
+/**
+ * With lagged time steps (see `central2d_set_lagged_cfl`), each tile
+ * computes its wave speeds for a step pair in the same parallel loop in
+ * which it takes the pair, at the time step chosen from the speeds of
+ * the pair before; the speeds are combined and double buffered as in
+ * the ordinary run, so this still costs one barrier per pair.  A tile
+ * writes the result of a pair into its array `w`, and then `u` and `w`
+ * trade places, so that a pair can be taken again by trading them
+ * back.  Every tile trades on every pair, so at the end of the run, we
+ * trade back once more if the number of pairs was odd.
+ */
+
+static inline
+void tiles_swap(central2d_t* tile)
+{
+    float* u = tile->u;
+    tile->u = tile->w;
+    tile->w = u;
+}
+
+
+// Get the speeds for step pair j (and fluxes, if combined) and take it
+static
+void tiles_lagged_step2(central2d_t* tile, int j, float dt, float* cxy)
+{
+    cxy[0] = cxy[1] = 1.0e-15f;
+    tiles_speed(tile, j, cxy);
+    tiles_step2_to(tile, tile->w, j, dt);
+    tiles_swap(tile);
+}
+
+
+static
+int central2d_lagged_run(central2d_t* sim, float tfinal)
+{
+    int ntiles = sim->px * sim->py;
+    int nbatch = sim->nbatch;
+    float* tile_cxy = sim->tile_cxy;
+    float cfl = sim->cfl, lag_cfl = sim->lag_safety * sim->cfl;
+    int nstep = 0;
+
+    #pragma omp parallel num_threads(sim->nthreads) proc_bind(spread)
+    {
+        #pragma omp for schedule(static)
+        for (int id = 0; id < ntiles; ++id)
+            if (!sim->tiles[id]->w)
+                sim->tiles[id]->w = central2d_alloc_array(sim->tiles[id]);
+
+        // Every thread keeps the same copy of the time stepping state
+        float t = 0, c = 0;
+        int npair = 0, nrollback = 0;
+        bool done = false, first = true;
+        while (!done) {
+
+            #pragma omp for schedule(static)
+            for (int id = 0; id < ntiles; ++id)
+                tiles_load(sim, id, !first);
+
+            for (int j = 0; j < nbatch && !done; ++j) {
+                float* cxy = tile_cxy + 2*ntiles*(npair % 2);
+                float dt;
+                if (first) {
+                    #pragma omp for schedule(static)
+                    for (int id = 0; id < ntiles; ++id) {
+                        cxy[2*id+0] = cxy[2*id+1] = 1.0e-15f;
+                        tiles_speed(sim->tiles[id], j, cxy + 2*id);
+                    }
+                    c = tiles_max_speed(sim, cxy);
+                    dt = central2d_pair_dt(cfl, c, t, tfinal, &done);
+
+                    #pragma omp for schedule(static)
+                    for (int id = 0; id < ntiles; ++id) {
+                        tiles_step2_to(sim->tiles[id], sim->tiles[id]->w,
+                                       j, dt);
+                        tiles_swap(sim->tiles[id]);
+                    }
+                    first = false;
+                } else {
+                    dt = central2d_pair_dt(lag_cfl, c, t, tfinal, &done);
+
+                    #pragma omp for schedule(static)
+                    for (int id = 0; id < ntiles; ++id)
+                        tiles_lagged_step2(sim->tiles[id], j, dt,
+                                           cxy + 2*id);
+                    c = tiles_max_speed(sim, cxy);
+
+                    if (dt*c > cfl) {
+                        dt = central2d_pair_dt(cfl, c, t, tfinal, &done);
+                        ++nrollback;
+
+                        #pragma omp for schedule(static)
+                        for (int id = 0; id < ntiles; ++id) {
+                            float ignored[2];
+                            tiles_swap(sim->tiles[id]);
+                            tiles_lagged_step2(sim->tiles[id], j, dt,
+                                               ignored);
+                        }
+                    }
+                }
+                t += 2*dt;
+                ++npair;
+            }
+        }
+
+        #pragma omp for schedule(static)
+        for (int id = 0; id < ntiles; ++id) {
+            tiles_store(sim, id);
+            if (npair % 2)
+                tiles_swap(sim->tiles[id]);
+        }
+
+        #pragma omp master
+        {
+            nstep = 2*npair;
+            sim->nrollback += nrollback;
+        }
+    }
+    return nstep;
+}
+
+
+/**
+ * The partition is set up by `central2d_tile`.  We choose the
+ * decomposition automatically when `px` or `py` is not positive:
+ * the number of tiles is the number of available threads, and we
+ * pick the factorization that minimizes the total ghost cell
+ * perimeter.  Tiles are allocated and initialized in a parallel
+ * loop with the same static schedule used in the solver, so that
+ * each thread first touches (and gets local memory for) the tiles
+ * it will work on.
+ */
+
+// Give the tiles along the edges of the domain the BCs on those edges
+static
+void tiles_set_bc(central2d_t* sim)
+{
+    for (int id = 0; sim->tiles && id < sim->px * sim->py; ++id) {
+        int i = id % sim->px, j = id / sim->px;
+        int edges = (i == 0         ? CENTRAL2D_LEFT   : 0) |
+                    (i == sim->px-1 ? CENTRAL2D_RIGHT  : 0) |
+                    (j == 0         ? CENTRAL2D_BOTTOM : 0) |
+                    (j == sim->py-1 ? CENTRAL2D_TOP    : 0);
+        sim->tiles[id]->bc = sim->bc;
+        sim->tiles[id]->bc_sides = sim->bc_sides & edges;
+    }
+}
+
+
+void central2d_tile(central2d_t* sim, int px, int py, int nbatch)
+{
+    central2d_untile(sim);
+#ifdef _OPENMP
+    int nthreads = omp_get_max_threads();
+#else
+    int nthreads = 1;
+#endif
+    if (px <= 0 || py <= 0) {
+        px = nthreads;
+        py = 1;
+        for (int p = 1; p <= nthreads; ++p)
+            if (nthreads % p == 0 &&
+                sim->nx/p + sim->ny/(nthreads/p) < sim->nx/px + sim->ny/py) {
+                px = p;
+                py = nthreads/p;
+            }
+    }
+    if (px > sim->nx) px = sim->nx;
+    if (py > sim->ny) py = sim->ny;
+    if (nbatch < 1) nbatch = 1;
+    if (px*py <= 1)
+        return;
+
+    int ntiles = px*py;
+    sim->px = px;
+    sim->py = py;
+    sim->nbatch = nbatch;
+    sim->nthreads = (nthreads < ntiles ? nthreads : ntiles);
+    sim->tiles = (central2d_t**) malloc(ntiles * sizeof(central2d_t*));
+    sim->tile_cxy = (float*) malloc(4 * ntiles * sizeof(float));
+
+    #pragma omp parallel for schedule(static) \
+        num_threads(sim->nthreads) proc_bind(spread)
+    for (int id = 0; id < ntiles; ++id) {
+        int i = id % px, j = id / px;
+        int nxt = partition_size(i, sim->nx, px);
+        int nyt = partition_size(j, sim->ny, py);
+        central2d_t* tile =
+            central2d_alloc(nxt, nyt, 4*nbatch, sim->nfield,
+                            sim->flux, sim->speed, sim->cfl, sim->layout);
+        tile->dx = sim->dx;
+        tile->dy = sim->dy;
+        tile->engine = sim->engine;
+        tile->flux_speed = sim->flux_speed;
+        tile->kernels = sim->kernels;
+        memset(tile->mem, 0, central2d_mem_size(tile));
+        sim->tiles[id] = tile;
+    }
+    tiles_set_bc(sim);
+}
+
+
+void central2d_untile(central2d_t* sim)
+{
+    if (sim->tiles) {
+        for (int id = 0; id < sim->px * sim->py; ++id)
+            central2d_free(sim->tiles[id]);
+        free(sim->tiles);
+        free(sim->tile_cxy);
+    }
+    sim->px = 0;
+    sim->py = 0;
+    sim->nbatch = 1;
+    sim->nthreads = 1;
+    sim->tiles = NULL;
+    sim->tile_cxy = NULL;
+}
+
+
+/**
+ * ### Diagnostics
+ *
+ * The row sums of the fields are kept in `diag_rows`, followed by the
+ * minimum and maximum of field 0 in each row (which we only need when
+ * the sums are computed separately).  The separate pass sums the rows
+ * in parallel; the rows are independent, so the result does not depend
+ * on the schedule.  The row sums are then added with a pairwise sum.
+ */
+
+static
+double* central2d_diag_alloc(central2d_t* sim)
+{
+    return (double*) malloc((sim->nfield+2) * (size_t) sim->ny *
+                            sizeof(double));
+}
+
+
+static
+double central2d_pairwise_sum(const double* x, int n)
+{
+    if (n <= 8) {
+        double s = 0;
+        for (int i = 0; i < n; ++i)
+            s += x[i];
+        return s;
+    }
+    int m = n/2;
+    return central2d_pairwise_sum(x, m) + central2d_pairwise_sum(x+m, n-m);
+}
+
+
+static
+void central2d_diag_rows(central2d_t* sim)
+{
+    int nx = sim->nx, ny = sim->ny, nfield = sim->nfield;
+    int cs = sim->cell_stride;
+    double* rows = sim->diag_rows;
+    double* rmin = rows + nfield*ny;
+    double* rmax = rmin + ny;
+    #pragma omp parallel for schedule(static)
+    for (int iy = 0; iy < ny; ++iy) {
+        for (int k = 0; k < nfield; ++k)
+            rows[k*ny+iy] =
+                central2d_row_sum(sim->u + central2d_offset(sim, k, 0, iy),
+                                  nx, cs);
+        const float* h = sim->u + central2d_offset(sim, 0, 0, iy);
+        float hmin = h[0], hmax = h[0];
+        for (int ix = 1; ix < nx; ++ix) {
+            hmin = fminf(hmin, h[ix*cs]);
+            hmax = fmaxf(hmax, h[ix*cs]);
+        }
+        rmin[iy] = hmin;
+        rmax[iy] = hmax;
+    }
+    sim->diag_range[0] = rmin[0];
+    sim->diag_range[1] = rmax[0];
+    for (int iy = 1; iy < ny; ++iy) {
+        sim->diag_range[0] = fminf(sim->diag_range[0], rmin[iy]);
+        sim->diag_range[1] = fmaxf(sim->diag_range[1], rmax[iy]);
+    }
+}
+
+
+void central2d_diagnostics(central2d_t* sim, double* sum, float* range)
+{
+    central2d_sync(sim);
+    if (!sim->diag_rows)
+        sim->diag_rows = central2d_diag_alloc(sim);
+    if (!sim->diag_valid)
+        central2d_diag_rows(sim);
+    sim->diag_valid = false;
+    for (int k = 0; k < sim->nfield; ++k)
+        sum[k] = central2d_pairwise_sum(sim->diag_rows + k*sim->ny, sim->ny);
+    range[0] = sim->diag_range[0];
+    range[1] = sim->diag_range[1];
+}
+
+
+void central2d_set_local_steps(central2d_t* sim, bool local_steps)
+{
+    sim->local_steps = local_steps;
+}
+
+
+void central2d_set_lagged_cfl(central2d_t* sim, float safety)
+{
+    sim->lag_safety = (safety > 0 && safety <= 1 ? safety : 0);
+}
+
+
+void central2d_set_bc(central2d_t* sim, central2d_bc_t bc, int sides)
+{
+    if (sides & (CENTRAL2D_LEFT | CENTRAL2D_RIGHT))
+        sides |= CENTRAL2D_LEFT | CENTRAL2D_RIGHT;
+    if (sides & (CENTRAL2D_BOTTOM | CENTRAL2D_TOP))
+        sides |= CENTRAL2D_BOTTOM | CENTRAL2D_TOP;
+    sim->bc = (sides ? bc : NULL);
+    sim->bc_sides = (bc ? sides : 0);
+    tiles_set_bc(sim);
+}
+
+
+void central2d_set_diagnostics(central2d_t* sim, bool fused)
+{
+    sim->diag_fused = fused;
+    sim->diag_valid = false;
+}
+
+
+void central2d_set_engine(central2d_t* sim, central2d_engine_t engine)
+{
+    if (engine != CENTRAL2D_DEVICE)
+        central2d_device_free(sim);
+    else if (sim->on_device)
+        sim->device_stale = true;
+    sim->engine = engine;
+    for (int id = 0; sim->tiles && id < sim->px * sim->py; ++id)
+        sim->tiles[id]->engine = engine;
+}
+
+
+void central2d_set_flux_speed(central2d_t* sim, flux_speed_t flux_speed)
+{
+    sim->flux_speed = flux_speed;
+    for (int id = 0; sim->tiles && id < sim->px * sim->py; ++id)
+        sim->tiles[id]->flux_speed = flux_speed;
+}
+
+
+void central2d_set_storage(central2d_t* sim, central2d_storage_t storage)
+{
+    size_t nbytes = sim->array_size * sizeof(uint16_t);
+    if (storage == sim->storage)
+        return;
+    mem_free(sim->u16, nbytes, sim->mem_flags);
+    mem_free(sim->v16, nbytes, sim->mem_flags);
+    sim->u16 = NULL;
+    sim->v16 = NULL;
+    sim->storage = storage;
+    if (storage != CENTRAL2D_FLOAT32) {
+        sim->u16 = mem_alloc(nbytes, sim->mem_flags);
+        sim->v16 = mem_alloc(nbytes, sim->mem_flags);
+        memset(sim->v16, 0, nbytes);
+    }
+}
+
+
+void central2d_set_kernels(central2d_t* sim,
+                           const central2d_kernels_t* kernels)
+{
+    if (kernels && (kernels->nfield != sim->nfield ||
+                    kernels->flux != sim->flux))
+        kernels = NULL;
+    sim->kernels = kernels;
+    for (int id = 0; sim->tiles && id < sim->px * sim->py; ++id)
+        sim->tiles[id]->kernels = kernels;
+}
+
+
+int central2d_run(central2d_t* sim, float tfinal)
+{
+    sim->diag_valid = false;
+    const central2d_kernels_t* k = central2d_kernels(sim);
+    if (sim->engine == CENTRAL2D_DEVICE && k->run_device &&
+        !sim->tiles && !sim->block && !sim->bc) {
+        central2d_device_map(sim);
+        sim->host_stale = true;
+        return k->run_device(sim, tfinal);
+    }
+    central2d_sync(sim);
+    if (sim->on_device)
+        sim->device_stale = true;
+    if (sim->tiles && sim->local_steps && sim->nbatch > 1 && !sim->bc)
+        return central2d_local_run(sim, tfinal);
+    if (sim->tiles && sim->lag_safety > 0)
+        return central2d_lagged_run(sim, tfinal);
+    if (sim->tiles)
+        return central2d_tiled_run(sim, tfinal);
+    if (sim->block)
+        return central2d_blocked_run(sim, tfinal);
+    if (sim->storage != CENTRAL2D_FLOAT32 && sim->engine == CENTRAL2D_FUSED &&
+        !sim->bc)
+        return central2d_half_run(sim, tfinal);
+    bool diag = (sim->diag_fused && sim->engine == CENTRAL2D_FUSED &&
+                 sim->ng == 4);
+    if (diag && !sim->diag_rows)
+        sim->diag_rows = central2d_diag_alloc(sim);
+    int nstep = central2d_xrun(k, central2d_stepper(sim),
+                               sim->u, sim->v, sim->scratch,
+                               sim->f, sim->g,
+                               sim->nx, sim->ny, sim->ng,
+                               sim->row_stride, sim->field_stride,
+                               sim->cell_stride,
+                               sim->nfield, sim->flux, sim->speed,
+                               central2d_flux_speeder(sim),
+                               sim->bc, sim->bc_sides,
+                               diag ? sim->diag_rows : NULL, sim->diag_range,
+                               tfinal, sim->dx, sim->dy, sim->cfl);
+    sim->diag_valid = diag;
+    return nstep;
+}
+
+
+/**
+ * ### Ensembles
+ *
+ * `central2d_run_batch` runs each solver on a single thread, so the
+ * threads share the solvers rather than the grid.  Each thread has a
+ * queue of solvers, and the queues are filled from the most expensive
+ * solver down, each going to the queue with the least work so far.
+ * The cost of a solver is its number of cells (with ghosts) times an
+ * estimate of its number of steps: the steps scale like `tfinal`
+ * divided by the time step, which for similar wave speeds scales like
+ * `cfl` times the smaller cell size.  A thread takes solvers from the
+ * front of its own queue, largest first; when its queue is empty, it
+ * takes the last (and so smallest) solver from the queue of another
+ * thread.  The estimates only have to be good enough that a thread
+ * does not start its largest solver when the others are almost done;
+ * the stealing takes care of the rest.
+ *
+ * A solver in the tiled mode runs its tiles one after the other on its
+ * thread (the parallel regions inside `central2d_run` are nested, and
+ * so have only one thread unless the caller turns on nested
+ * parallelism).
+ */
+
+#ifdef _OPENMP
+typedef struct batch_task_t {
+    double cost;
+    int id;
+} batch_task_t;
+
+
+static
+int batch_task_compare(const void* pa, const void* pb)
+{
+    const batch_task_t* a = (const batch_task_t*) pa;
+    const batch_task_t* b = (const batch_task_t*) pb;
+    return (a->cost < b->cost) - (a->cost > b->cost);
+}
+
+
+static
+double batch_cost(central2d_t* sim, float tfinal)
+{
+    float h = (sim->dx < sim->dy ? sim->dx : sim->dy);
+    double ncell = (double) (sim->nx + 2*sim->ng) * (sim->ny + 2*sim->ng);
+    return ncell * sim->nfield * tfinal / (sim->cfl * h);
+}
+
+
+typedef struct batch_queue_t {
+    int* task;          // Solver numbers
+    int head, tail;     // Remaining tasks are task[head:tail]
+    omp_lock_t lock;
+} batch_queue_t;
+
+
+// Take the next solver from the front (or back) of a queue (-1 if empty)
+static
+int batch_take(batch_queue_t* q, bool back)
+{
+    int id = -1;
+    omp_set_lock(&q->lock);
+    if (q->head < q->tail)
+        id = (back ? q->task[--q->tail] : q->task[q->head++]);
+    omp_unset_lock(&q->lock);
+    return id;
+}
+
+
+static
+int central2d_run_stealing(central2d_t** sims, const float* tfinal,
+                           int* nstep, int nsim, int nthreads)
+{
+    batch_task_t* tasks = (batch_task_t*) malloc(nsim * sizeof(batch_task_t));
+    for (int i = 0; i < nsim; ++i) {
+        tasks[i].cost = batch_cost(sims[i], tfinal[i]);
+        tasks[i].id = i;
+    }
+    qsort(tasks, nsim, sizeof(batch_task_t), batch_task_compare);
+
+    batch_queue_t* queues =
+        (batch_queue_t*) malloc(nthreads * sizeof(batch_queue_t));
+    double* load = (double*) calloc(nthreads, sizeof(double));
+    for (int t = 0; t < nthreads; ++t) {
+        queues[t].task = (int*) malloc(nsim * sizeof(int));
+        queues[t].head = queues[t].tail = 0;
+        omp_init_lock(&queues[t].lock);
+    }
+    for (int i = 0; i < nsim; ++i) {
+        int tmin = 0;
+        for (int t = 1; t < nthreads; ++t)
+            if (load[t] < load[tmin])
+                tmin = t;
+        load[tmin] += tasks[i].cost;
+        queues[tmin].task[queues[tmin].tail++] = tasks[i].id;
+    }
+
+    int total = 0;
+    #pragma omp parallel num_threads(nthreads) reduction(+:total)
+    {
+        int me = omp_get_thread_num();
+        for (;;) {
+            int id = batch_take(queues + me, false);
+            for (int k = 1; id < 0 && k < nthreads; ++k)
+                id = batch_take(queues + (me+k) % nthreads, true);
+            if (id < 0)
+                break;
+            int n = central2d_run(sims[id], tfinal[id]);
+            if (nstep)
+                nstep[id] = n;
+            total += n;
+        }
+    }
+
+    for (int t = 0; t < nthreads; ++t) {
+        omp_destroy_lock(&queues[t].lock);
+        free(queues[t].task);
+    }
+    free(load);
+    free(queues);
+    free(tasks);
+    return total;
+}
+#endif
+
+
+int central2d_run_batch(central2d_t** sims, const float* tfinal,
+                        int* nstep, int nsim)
+{
+#ifdef _OPENMP
+    int nthreads = omp_get_max_threads();
+    if (nthreads > nsim)
+        nthreads = nsim;
+    if (nthreads > 1 && !omp_in_parallel())
+        return central2d_run_stealing(sims, tfinal, nstep, nsim, nthreads);
+#endif
+    int total = 0;
+    for (int i = 0; i < nsim; ++i) {
+        int n = central2d_run(sims[i], tfinal[i]);
+        if (nstep)
+            nstep[i] = n;
+        total += n;
+    }
+    return total;
 }
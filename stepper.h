@@ -2,6 +2,11 @@
 #define STEPPER_H
 
 #include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "half.h"
 
 //ldoc
 /**
@@ -13,13 +18,187 @@
  * by two functions: the flux function and the max wave speed function
  * (used to control the time step).  We define callback types for these
  * two functions, with the assumption that the different components
- * of the solution and fluxes are separated by `field_stride`.
+ * of the solution and fluxes are separated by `field_stride`, and
+ * that the data for successive cells are separated by `cell_stride`
+ * (which is one unless the fields are interleaved cell by cell; see
+ * the discussion of storage layouts below).
  *
  */
 typedef void (*flux_t)(float* FU, float* GU, const float* U,
-                       int ncell, int field_stride);
+                       int ncell, int field_stride, int cell_stride);
 typedef void (*speed_t)(float* cxy, const float* U,
-                        int ncell, int field_stride);
+                        int ncell, int field_stride, int cell_stride);
+
+/**
+ * At the start of each step pair, the solver needs the wave speeds
+ * (to choose the time step) and the fluxes for the same data.  Physics
+ * modules can optionally provide a combined function that computes
+ * the fluxes as `flux_t` does and updates the running max wave speeds
+ * `cxy` as `speed_t` does, all in one pass over `U`.
+ */
+typedef void (*flux_speed_t)(float* FU, float* GU, float* cxy,
+                             const float* U, int ncell,
+                             int field_stride, int cell_stride);
+
+
+/**
+ * ### Step engines
+ *
+ * There are two host implementations of the basic time step.  The reference
+ * engine makes separate passes over the grid to compute the fluxes,
+ * the predictor, the half-step fluxes, and the corrector.  The fused
+ * engine does all of these in a single sweep over the rows, keeping
+ * only a few rows of intermediate values in scratch space; this cuts
+ * the memory traffic for grids that do not fit in cache.  The two
+ * engines give identical results.
+ *
+ * The device engine runs the reference step as OpenMP target regions,
+ * which go to a GPU when the compiler is set up for offloading (and
+ * otherwise run on the host).  The solution stays in device memory
+ * from one call to `central2d_run` to the next, and is only copied
+ * back when the host asks for it (see `central2d_sync`).  The device
+ * code is specific to the physics, so the engine is only available
+ * with specialized kernels that provide it (see below); otherwise, and
+ * in the tiled and blocked modes (and with 16-bit storage, which it
+ * does not use, or a non-periodic boundary condition), it falls back
+ * to the reference engine on the host.
+ * It always uses the exact wave speed formula of the shallow water
+ * kernels, and with that speed function, the results are identical to
+ * those of the other engines.
+ */
+typedef enum central2d_engine_t {
+    CENTRAL2D_REFERENCE,
+    CENTRAL2D_FUSED,
+    CENTRAL2D_DEVICE
+} central2d_engine_t;
+
+
+/**
+ * ### Specialized kernels
+ *
+ * The step engines call the physics through the function pointers,
+ * and the number of fields is only known at run time.  For physics that
+ * we care about, it pays to compile the step functions with the flux
+ * function inlined and a fixed number of fields (see `stepper_kernels.h`).
+ * A set of such kernels is described by a `central2d_kernels_t`, which
+ * records the flux function and number of fields that it was compiled
+ * for.  Each kernel takes one step on a window of the grid; the
+ * arguments are described with the implementation of `central2d_step`.
+ * The `step_fused16` kernel is the fused step for solutions stored in
+ * a 16-bit format (see the discussion of storage formats below), and
+ * the `step_fused_diag` kernel is the fused step that also computes
+ * the diagnostics of its output (see `central2d_diagnostics`).  The
+ * `run_device` function (which may be `NULL`) replaces all of
+ * `central2d_run` for the device engine.
+ */
+typedef void (*central2d_step_t)(float* u, float* v, float* vh,
+                                 float* scratch, float* f, float* g,
+                                 int io, int nx, int ny, int ng,
+                                 int s, int fs, int cs,
+                                 int nfield, flux_t flux,
+                                 float dt, float dx, float dy);
+
+typedef void (*central2d_step16_t)(const uint16_t* u, uint16_t* v,
+                                   float* scratch,
+                                   int io, int nx, int ny, int ng,
+                                   int s, int fs, int cs,
+                                   int nfield, flux_t flux,
+                                   float dt, float dx, float dy,
+                                   half_format_t format);
+
+typedef void (*central2d_stepd_t)(float* u, float* v, float* scratch,
+                                  int io, int nx, int ny, int ng,
+                                  int s, int fs, int cs,
+                                  int nfield, flux_t flux,
+                                  float dt, float dx, float dy,
+                                  double* rowsum, float* range);
+
+struct central2d_t;
+
+typedef struct central2d_kernels_t {
+    int nfield;                     // Number of fields
+    flux_t flux;                    // Flux function
+    central2d_step_t step;          // Reference step
+    central2d_step_t step_fluxed;   // Reference step given initial fluxes
+    central2d_step_t step_fused;    // Fused step
+    central2d_step16_t step_fused16;  // Fused step with 16-bit storage
+    central2d_stepd_t step_fused_diag;  // Fused step with diagnostics
+    int (*run_device)(struct central2d_t* sim, float tfinal);  // Or NULL
+} central2d_kernels_t;
+
+
+/**
+ * ### Storage layouts
+ *
+ * The solution and the other per-cell arrays can be stored in one of
+ * three layouts, chosen when the solver is created.  With cells
+ * `(ix,iy)` counted from the corner of the ghost cell region and
+ * `nx_all` and `ny_all` cells in each direction, value `k` at cell
+ * `(ix,iy)` is at
+ *
+ * - `(k*ny_all + iy)*nx_all + ix` in the *field-major* layout (each
+ *   field is a separate array; this is the default);
+ * - `(iy*nfield + k)*nx_all + ix` in the *row-interleaved* layout
+ *   (an "array of structures of arrays" in which each row of the grid
+ *   holds a row of each field, so a cell's values are within a few
+ *   kilobytes of each other); and
+ * - `(iy*nx_all + ix)*nfield + k` in the *cell-interleaved* layout
+ *   (an array of structures, with all the values for a cell together).
+ *
+ * In each case, the location is `k*fs + iy*s + ix*cs` for a field stride
+ * `fs`, row stride `s`, and cell stride `cs`, which the solver records.
+ * In fact, the solver pads `s` and `fs` a little beyond the sizes above
+ * (using `mem_pad`; see `memalloc.h`) so that rows start on cache line
+ * boundaries and large power-of-two strides are avoided, so code outside
+ * the solver should always index through the strides or through
+ * `central2d_offset`.
+ * The solver and the physics work in any layout, but the vector code
+ * paths in the physics and the limiters need a unit cell stride, so
+ * the cell-interleaved layout mostly exists for comparison.
+ */
+typedef enum central2d_layout_t {
+    CENTRAL2D_FIELD_MAJOR,
+    CENTRAL2D_ROW_INTERLEAVED,
+    CENTRAL2D_CELL_INTERLEAVED
+} central2d_layout_t;
+
+
+/**
+ * ### Storage formats
+ *
+ * The solution is normally stored in single precision.  For large
+ * grids, where the fused engine is limited by memory bandwidth, it can
+ * instead be kept in one of the 16-bit formats of `half.h` between
+ * steps, with the arithmetic still done in single precision (see
+ * `central2d_set_storage`).
+ */
+typedef enum central2d_storage_t {
+    CENTRAL2D_FLOAT32,
+    CENTRAL2D_FLOAT16,
+    CENTRAL2D_BFLOAT16
+} central2d_storage_t;
+
+
+/**
+ * ### Boundary conditions
+ *
+ * The domain is periodic unless we say otherwise.  A boundary
+ * condition function fills the ghost cells beyond the sides of the
+ * domain named in the `sides` mask (an or of `central2d_side_t`
+ * values) from the real cells near those sides, on an array `u` with
+ * `nx` by `ny` real cells, `ng` ghost cells on each side, and strides
+ * `s`, `fs`, and `cs` as described below; see `central2d_set_bc`.
+ */
+typedef enum central2d_side_t {
+    CENTRAL2D_LEFT      = 1,   // ix < 0
+    CENTRAL2D_RIGHT     = 2,   // ix >= nx
+    CENTRAL2D_BOTTOM    = 4,   // iy < 0
+    CENTRAL2D_TOP       = 8,   // iy >= ny
+    CENTRAL2D_ALL_SIDES = 15
+} central2d_side_t;
+
+typedef void (*central2d_bc_t)(float* u, int nx, int ny, int ng, int nfield,
+                               int s, int fs, int cs, int sides);
 
 
 /**
@@ -43,16 +222,70 @@ typedef struct central2d_t {
     float dx, dy; // Cell width in x/y
     float cfl;    // Max allowed CFL number
 
+    // Storage layout and strides between fields, rows, and cells
+    central2d_layout_t layout;
+    int field_stride, row_stride, cell_stride;
+
     // Flux and speed functions
     flux_t flux;
     speed_t speed;
+    flux_speed_t flux_speed;  // Optional (see `central2d_set_flux_speed`)
+
+    // Step implementation (see `central2d_set_engine`)
+    central2d_engine_t engine;
+    const central2d_kernels_t* kernels;  // See `central2d_set_kernels`
 
     // Storage
+    int array_size;  // Floats per solution array (including padding)
+    int mem_flags;   // Allocation flags (see memalloc.h)
+    float* mem;   // Start of storage block (u and v may be swapped)
     float* u;
     float* v;
     float* f;
     float* g;
     float* scratch;
+    float* vh;    // Half-step storage for central2d_step_block (on demand)
+
+    // 16-bit solution storage (see `central2d_set_storage`)
+    central2d_storage_t storage;
+    uint16_t* u16;
+    uint16_t* v16;
+
+    // Diagnostics (see `central2d_diagnostics`)
+    bool diag_fused;     // Compute in the last step of a run?
+    bool diag_valid;     // Row sums and range are for the current u?
+    double* diag_rows;   // Sums of rows of each field (then min and max)
+    float diag_range[2]; // Range of field 0
+
+    // Cache blocked mode (see `central2d_block`)
+    int bx, by;                  // Block size (0 if unblocked)
+    struct central2d_t* block;   // Workspace for one block
+    float skip_tol;              // Uniformity tolerance (< 0 to not skip)
+    long long block_nstep;       // Block step pairs since the last stats
+    long long block_nskip;       // ... and how many were skipped
+
+    // Tiled parallel mode (see `central2d_tile`)
+    int px, py;                  // Number of tiles in x/y (0 if untiled)
+    int nbatch;                  // Step pairs per ghost cell exchange
+    int nthreads;                // Threads that advance the tiles
+    struct central2d_t** tiles;  // Subdomain solvers (px*py, row major)
+    float* tile_cxy;             // Per-tile wave speeds
+    bool local_steps;            // Per-tile time steps in each batch?
+    float* w;                    // Tile solution before the last step pair
+                                 // (or batch, with local steps)
+
+    // Boundary conditions (see `central2d_set_bc`)
+    central2d_bc_t bc;           // Non-periodic condition (NULL if none)
+    int bc_sides;                // Sides where bc applies
+
+    // Lagged time steps (see `central2d_set_lagged_cfl`)
+    float lag_safety;            // Fraction of the CFL limit (0 if off)
+    long long nrollback;         // Step pairs taken again
+
+    // Device copy for the device engine (see `central2d_sync`)
+    bool on_device;              // Are u, v, f, and g mapped?
+    bool host_stale;             // Is u newer on the device?
+    bool device_stale;           // ... or on the host?
 
 } central2d_t;
 
@@ -60,11 +293,23 @@ typedef struct central2d_t {
 /**
  * For the most part, we treat the `central2d_t` as a read-only
  * structure.  The exceptions are the constructor and destructor
- * functions.
+ * functions.  The `central2d_init` constructor uses the field-major
+ * layout; `central2d_init_layout` takes the layout as an extra argument.
+ * Both give the grid the four layers of ghost cells that one step pair
+ * needs; `central2d_init_ghost` takes the number of layers `ng` as
+ * well (at least four), which makes for a deep halo (see
+ * `central2d_run`).
  */
 central2d_t* central2d_init(float w, float h, int nx, int ny,
                             int nfield, flux_t flux, speed_t speed,
                             float cfl);
+central2d_t* central2d_init_layout(float w, float h, int nx, int ny,
+                                   int nfield, flux_t flux, speed_t speed,
+                                   float cfl, central2d_layout_t layout);
+central2d_t* central2d_init_ghost(float w, float h, int nx, int ny,
+                                  int nfield, flux_t flux, speed_t speed,
+                                  float cfl, central2d_layout_t layout,
+                                  int ng);
 void central2d_free(central2d_t* sim);
 
 /**
@@ -76,6 +321,15 @@ void central2d_free(central2d_t* sim);
  */
 int  central2d_offset(central2d_t* sim, int k, int ix, int iy);
 
+/**
+ * Solvers that need more arrays like `u` (e.g. the distributed memory
+ * solver) can get them with `central2d_alloc_array`, which allocates and
+ * zeros `sim->array_size` floats in the same way as the solver's own
+ * storage; they must be released with `central2d_free_array`.
+ */
+float* central2d_alloc_array(central2d_t* sim);
+void central2d_free_array(central2d_t* sim, float* a);
+
 /**
  * ### Running the simulation
  *
@@ -84,23 +338,345 @@ int  central2d_offset(central2d_t* sim, int k, int ix, int iy);
  * taken, determined by the CFL restriction and by the requirement
  * that we always take steps in multiples of two so that we end
  * at the reference grid.
+ *
+ * Each step pair uses up four layers of ghost cells, so with a deep
+ * halo of `ng` layers, the serial solver with the reference or fused
+ * engine fills the ghost cells only once every `ng/4` step pairs,
+ * taking the pairs in between on the cells that still have valid
+ * data (see `central2d_xrun`).  This trades a little redundant work
+ * near the edges for fewer ghost cell fills, which is what the
+ * distributed memory solver needs to exchange less often; the solution
+ * is the same.  The other modes fill the ghost cells for every pair,
+ * and the diagnostics are not fused into the last step of a run with a
+ * deep halo (see `central2d_set_diagnostics`).
  */
 int central2d_run(central2d_t* sim, float tfinal);
 
+/**
+ * `central2d_run_batch` advances `nsim` independent solvers, each by
+ * its own time `tfinal[i]`, as `central2d_run` would, and sets
+ * `nstep[i]` (if `nstep` is not `NULL`) to the number of steps each
+ * took; it returns the total.  Rather than splitting each grid over
+ * the threads, it runs each solver on one OpenMP thread and keeps the
+ * threads busy by work stealing (see the implementation notes), which
+ * suits ensembles of many small grids, where the per-step overhead of
+ * a parallel region would dominate.  The solvers must not share
+ * storage.  Called from inside a parallel region, or without OpenMP,
+ * it runs them one at a time.
+ */
+int central2d_run_batch(central2d_t** sims, const float* tfinal,
+                        int* nstep, int nsim);
+
+/**
+ * The step engine can be changed at any time with `central2d_set_engine`
+ * (the default is `CENTRAL2D_REFERENCE`).  The engine is also used for
+ * the tiles in the tiled mode and by `central2d_step_block`.
+ */
+void central2d_set_engine(central2d_t* sim, central2d_engine_t engine);
+
+/**
+ * After a run with the device engine, `sim->u` on the host is out of
+ * date until a call to `central2d_sync` copies the solution back (the
+ * copy is skipped if the host is already up to date).  Anything that
+ * reads `u` directly after a run should call it first; the other
+ * solver functions that read `u`, such as `central2d_diagnostics`, do
+ * so themselves.  Code that changes `u` between runs should call
+ * `central2d_sync` before and `central2d_set_engine` after, which
+ * makes the next run copy `u` to the device again.  Switching to
+ * another engine copies the solution back and frees the device copy.
+ */
+void central2d_sync(central2d_t* sim);
+
+/**
+ * If a combined flux and speed function is set with
+ * `central2d_set_flux_speed`, the reference engine uses it for the first
+ * flux computation in each step pair, which saves a separate pass
+ * over the grid to get the wave speeds.  The function should compute
+ * the same values as the `flux` and `speed` functions.  The fused
+ * engine and the blocked mode compute fluxes on the fly after the
+ * time step has been chosen, so they still use `speed`; so does
+ * `central2d_speed`.  Passing `NULL` turns the combined function off.
+ */
+void central2d_set_flux_speed(central2d_t* sim, flux_speed_t flux_speed);
+
+/**
+ * `central2d_set_kernels` switches to specialized step kernels.
+ * The kernels are only used if they were compiled for the solver's
+ * flux function and number of fields; otherwise (or if `kernels` is
+ * `NULL`) we use the general kernels.  Either way, the results are
+ * the same.
+ */
+void central2d_set_kernels(central2d_t* sim,
+                           const central2d_kernels_t* kernels);
+
+/**
+ * `central2d_set_storage` sets the format of the solution between
+ * steps.  With a 16-bit format, `central2d_run` rounds `u` to that
+ * format on entry, steps with the 16-bit fused kernel, and widens the
+ * result back into `u` at the end, so the rest of the interface still
+ * sees single precision values.  The 16-bit formats are only used by
+ * the serial solver with the fused engine on a periodic domain; the
+ * tiled and blocked modes and `central2d_step_block` always store
+ * single precision values.
+ * Since the solution is rounded at every step, the results are not
+ * the same as in single precision, and the volume and momentum are
+ * only conserved to the accuracy of the format.
+ */
+void central2d_set_storage(central2d_t* sim, central2d_storage_t storage);
+
+/**
+ * ### Diagnostics
+ *
+ * `central2d_diagnostics` computes the sum of each field over the real
+ * cells (into `sum`, which has room for `nfield` values) and the range
+ * of field 0 (into `range`, the minimum and then the maximum); for the
+ * shallow water equations, these are the volume and momentum (up to a
+ * factor of the cell area) and the range of water heights.  The sums
+ * are pairwise: within each row, the values are added in double
+ * precision in short vectorizable runs, and these partial sums are
+ * added in a balanced tree, as are the row sums.  The error is then
+ * proportional to the log of the number of cells rather than to the
+ * number of cells, and the order of the additions does not depend on
+ * the number of threads, so the results are reproducible.  The rows
+ * are summed in parallel.
+ *
+ * The diagnostics are usually wanted after each call to `central2d_run`,
+ * and that costs an extra sweep through memory.  After
+ * `central2d_set_diagnostics(sim, true)`, the serial solver with the
+ * fused engine instead computes the row sums and the range as the last
+ * step of each run writes its results, and `central2d_diagnostics`
+ * just adds up the row sums.  The results are the same either way.
+ * The precomputed values are for the solution at the end of the run,
+ * so they are dropped by the first call to `central2d_diagnostics`
+ * after the run; anything that changes `u` between a run and that call
+ * should call `central2d_set_diagnostics` again, which also drops them.
+ * In the other modes, the flag has no effect.
+ */
+void central2d_diagnostics(central2d_t* sim, double* sum, float* range);
+void central2d_set_diagnostics(central2d_t* sim, bool fused);
+
+/**
+ * ### Advancing part of the grid
+ *
+ * Solvers that fill in ghost cells on their own (such as the MPI
+ * solver) can use two lower-level functions instead of `central2d_run`.
+ * `central2d_speed` updates the running max wave speeds `cxy` with
+ * the speeds over all real cells, and `central2d_step_block` takes
+ * a pair of time steps on the `nx` by `ny` block of real cells with
+ * lower left corner `(ix,iy)`.  The block update reads `sim->u` within
+ * four cells of the block (possibly including ghost cells), and writes
+ * the new values to the block in `w`, an array with the same layout as
+ * `sim->u`.  Because we write to a separate array, the blocks covering
+ * a grid can be updated in any order.  With a deep halo, the block may
+ * also reach out into the ghost cells, as long as it stays four cells
+ * inside the edge of the ghost cell region; this is how a solver takes
+ * several step pairs between fills of the ghost cells.
+ */
+void central2d_speed(central2d_t* sim, float* cxy);
+void central2d_step_block(central2d_t* sim, float* w,
+                          int ix, int iy, int nx, int ny, float dt);
+
+/**
+ * To correct the totals when the blocks on either side of an edge take
+ * different steps (as in the local time stepping mode and the finer
+ * levels of the AMR layer), a solver needs to know what went through
+ * the edges of a block in a step pair.  The step pair moves the fields
+ * from the real cells to the staggered cells that overlap them and
+ * back, so all that a block gains or loses goes through the ring of
+ * `2*(nx+ny)` staggered cells that straddle its edges: staggered cell
+ * `(bx,by)` covers cells `bx` and `bx+1` in $x$ and `by` and `by+1` in
+ * $y$, relative to the block, and the ring holds the ones with
+ * `-1 <= bx < nx` and `-1 <= by < ny` on the edges of that range.
+ * `central2d_ring_out`, called before the step pair of length `2*dt`
+ * on `sim->u`, subtracts from `ring[r*nfield+k]` what the block gives
+ * to ring cell `r` in field `k`, and `central2d_ring_in`, called after
+ * `central2d_step_block` (while the staggered values are still in
+ * `sim->v`), adds what the block got back.  The sum over the ring is
+ * then the change in the block totals (the sum of the cell values),
+ * to rounding, and two blocks that take the same steps on the same
+ * data have ring sums that cancel where they share a staggered cell.
+ * `central2d_ring_index` gives the position of staggered cell
+ * `(bx,by)` in the ring of an `nx` by `ny` block, or -1 if it is not in
+ * the ring.  The block must be within the real cells.
+ */
+void central2d_ring_out(central2d_t* sim, int ix, int iy, int nx, int ny,
+                        float dt, double* ring);
+void central2d_ring_in(central2d_t* sim, int ix, int iy, int nx, int ny,
+                       float dt, double* ring);
+int central2d_ring_index(int bx, int by, int nx, int ny);
+
+/**
+ * Such solvers may also want the limited slopes that the steps use.
+ * `central2d_limdiff` is the limiter itself (the limited difference
+ * at a cell with value `u0` between neighbors `um` and `up`), and
+ * `central2d_roughness` measures how far the solution is from smooth
+ * on the `nx` by `ny` block of real cells with lower left corner
+ * `(ix,iy)`: it returns the largest value over the cells and fields of
+ * the sum of the magnitudes of the limited differences in $x$ and $y$,
+ * or of the jump to the next cell in $x$ or $y$ if that is bigger (the
+ * limiter gives a zero slope on both sides of a sharp step).  It reads
+ * one layer of cells around the block.
+ */
+float central2d_limdiff(float um, float u0, float up);
+float central2d_roughness(central2d_t* sim, int ix, int iy, int nx, int ny);
+
+/**
+ * ### Cache blocked mode
+ *
+ * Calling `central2d_block` with positive `bx` and `by` makes
+ * `central2d_run` advance the grid in blocks of `bx` by `by` cells,
+ * each of which is copied (with a halo of ghost cells) into a small
+ * workspace that fits in cache.  A non-positive block size turns the
+ * blocked mode off.  `central2d_tune_block` times each of a set of
+ * candidate block sizes, reports the results to `log` (if not `NULL`),
+ * and chooses the fastest.  The blocked mode applies when the solver
+ * is not in the tiled parallel mode.  The solution is identical to the
+ * one computed without blocking.
+ */
+void central2d_block(central2d_t* sim, int bx, int by);
+void central2d_tune_block(central2d_t* sim, FILE* log);
+
+/**
+ * In still water, most blocks have nothing to do: if every field is
+ * constant over a block and the four layers of cells around it, the
+ * step pair leaves the block unchanged.  Calling `central2d_set_skip`
+ * with a nonnegative `tol` makes the blocked mode check each block
+ * (with its halo) before the step pair, and just copy the block to the
+ * output when the range of each field there is at most `tol`.  With
+ * `tol` zero, only exactly uniform blocks are skipped, and the solution
+ * is identical to the one computed without skipping; a positive `tol`
+ * also skips blocks with small ripples, which then stay as they are
+ * until something bigger reaches them.  A negative `tol` (the default)
+ * turns the check off.  `central2d_skip_stats` sets `*nskip` and
+ * `*nstep` to the number of block step pairs skipped and taken in all
+ * since the last call (or since the check was turned on), and resets
+ * the counts.
+ */
+void central2d_set_skip(central2d_t* sim, float tol);
+void central2d_skip_stats(central2d_t* sim, long long* nskip,
+                          long long* nstep);
+
+/**
+ * ### Tiled parallel mode
+ *
+ * By default, `central2d_run` advances the whole grid in a single
+ * thread.  Calling `central2d_tile` switches to a domain-decomposed
+ * mode in which the grid is split into `px` by `py` tiles that are
+ * advanced in parallel by OpenMP threads.  Each tile has enough ghost
+ * cells to take `nbatch` step pairs between exchanges of ghost data
+ * with its neighbors.  If `px` or `py` is not positive, we pick a
+ * decomposition with one tile per available thread.  A decomposition
+ * with only one tile leaves the solver in the serial mode, as does
+ * a call to `central2d_untile`.  The solution is identical to the one
+ * computed in the serial mode.
+ *
+ * The tiles are advanced by a team of `nthreads` threads (the number
+ * available when `central2d_tile` is called, or the number of tiles if
+ * that is smaller), and each thread works on the same tiles in every
+ * call to `central2d_run`, bound to its own place.  The OpenMP runtime
+ * keeps the team alive from one call to the next, so short runs (many
+ * frames with a small output interval) do not pay to start threads;
+ * setting `OMP_WAIT_POLICY=active` also keeps the threads spinning
+ * rather than sleeping while the caller writes out a frame.
+ */
+void central2d_tile(central2d_t* sim, int px, int py, int nbatch);
+void central2d_untile(central2d_t* sim);
+
+/**
+ * `central2d_set_local_steps` turns on local time stepping in the
+ * tiled mode (with `nbatch > 1`): in each batch, all the tiles advance
+ * by the same time, but each tile takes as few step pairs as its own
+ * wave speeds allow, so quiet parts of the grid do not pay for the
+ * time step needed where the flow is fast.  The solution is no longer
+ * the same as in the serial mode, but the totals of the fields are
+ * still conserved to rounding: after each batch, the tiles correct the
+ * cells along their edges so that neighbors that took different steps
+ * agree on what went through the edges between them.  Local steps
+ * need a periodic domain, since every tile edge must have a neighbor
+ * on the other side to agree with.  A batch in which the speeds grow
+ * too fast for the steps chosen at its start is taken again in half
+ * the time, and `nrollback` counts these batches.  On the test
+ * problems, local steps are correct but slower than the ordinary run.
+ */
+void central2d_set_local_steps(central2d_t* sim, bool local_steps);
+
+/**
+ * ### Lagged time steps
+ *
+ * Each step pair starts with a max reduction of the wave speeds over
+ * the whole grid, and nothing can be stepped until it is done: the
+ * tiles wait for each other, the MPI ranks wait for an all-reduce, and
+ * the device engine waits for the speeds to come back to the host.
+ * Calling `central2d_set_lagged_cfl` with `safety` between 0 and 1
+ * chooses each time step instead from the wave speeds at the start of
+ * the step pair before, scaled down by `safety`, so the reduction for
+ * the current pair can go on while it is being taken.  When the
+ * reduction finishes, we check the time step against the real speeds;
+ * if it broke the CFL condition, the pair is thrown away and taken
+ * again with the time step from the new speeds.  So every step pair
+ * still satisfies the CFL condition, but the time steps are a little
+ * shorter than they would otherwise be, and the solution is no longer
+ * identical to the one computed without lagging.  The first pair of
+ * each call to `central2d_run` waits for the reduction as usual.  The
+ * lagged steps apply to the tiled mode (but not with local time steps,
+ * which check the speeds in their own way),
+ * the device engine, and the distributed memory solver; the serial
+ * host engines ignore the setting, since nothing waits on the
+ * reduction there.  The `nrollback` field counts the step pairs that
+ * had to be taken again.  A `safety` of zero (the default) turns the
+ * lagged steps off.
+ */
+void central2d_set_lagged_cfl(central2d_t* sim, float safety);
+
 /**
  * ### Applying boundary conditions
  *
- * Ideally, we would not be applying boundary conditions inside the
- * solver, but through an external call (as we do with the other
- * cases).  This is because, apart from periodic boundary conditions,
- * the way that we manipulate ghost cell data in order to enforce BCs
- * usually depends a bit on the BCs that are appropriate to the physics
- * (which may vary from field to field).  For this exercise, we're always
- * going to use periodic BCs.  But I want to leave the interface function
- * public in the eventuality that I might swap in a function pointer
- * for applying the BCs.
- */
-void central2d_periodic(float* u, int nx, int ny, int ng, int nfield);
+ * Apart from periodic boundary conditions, the way that we manipulate
+ * ghost cell data in order to enforce BCs usually depends a bit on the
+ * physics (which may vary from field to field), so the BCs are
+ * functions of type `central2d_bc_t` that we plug into the solver.
+ * `central2d_set_bc` makes `bc` the condition on the sides of the
+ * domain in the `sides` mask, and on the sides opposite them (a domain
+ * cannot be periodic in x with a wall on only one side); the other
+ * sides stay periodic, and a `NULL` condition (the default) makes the
+ * whole domain periodic.
+ *
+ * The solver fills the ghost cells once per batch of step pairs, as
+ * before, and applies `bc` again to the window of each later pair in
+ * the batch (with the window's narrower ghost region), since the
+ * values computed there from the ghost cells of the pair before are
+ * not what the condition would give.  In the tiled mode, the tiles
+ * read their ghost cells directly from their neighbors as usual
+ * (wrapping around the periodic sides), and a tile at the edge of the
+ * domain then applies `bc` to its own ghost cells on that edge; in the
+ * distributed memory solver, the ranks at the edges do the same after
+ * the exchange.  The conditions only touch ghost cells, so they cost
+ * no communication.  The device engine, the 16-bit storage formats,
+ * and the AMR layer only support periodic domains; with another
+ * condition, `central2d_run` uses the host engine in single precision.
+ *
+ * `central2d_periodic` fills all the ghost cells of `u` (strides as
+ * described above) with the periodic images of the real cells, for
+ * every field in a single pass over the ghost rows.  The generic
+ * conditions do the same on the sides in their mask, with the sides
+ * in x first (over the rows that are not ghost rows of a side in y)
+ * and then the sides in y over whole rows, so the corners get the
+ * condition of both.  `central2d_outflow` copies the nearest real cell
+ * into each ghost cell (a zero gradient condition, which lets waves
+ * leave the domain), and `central2d_reflect` mirrors the real cells
+ * across the side, negating field `kx` in the ghost cells beyond the
+ * sides in x and field `ky` beyond the sides in y (a negative index
+ * negates nothing).  Mirroring with the normal momentum negated makes
+ * a solid wall; `shallow2d_walls` is the version for the shallow water
+ * equations.  All of them need `ng <= nx` and `ng <= ny`.
+ */
+void central2d_set_bc(central2d_t* sim, central2d_bc_t bc, int sides);
+void central2d_periodic(float* u, int nx, int ny, int ng, int nfield,
+                        int s, int fs, int cs);
+void central2d_outflow(float* u, int nx, int ny, int ng, int nfield,
+                       int s, int fs, int cs, int sides);
+void central2d_reflect(float* u, int nx, int ny, int ng, int nfield,
+                       int s, int fs, int cs, int sides, int kx, int ky);
 
 //ldoc off
 #endif /* STEPPER_H */
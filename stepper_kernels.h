@@ -0,0 +1,768 @@
+#ifndef STEPPER_KERNELS_H
+#define STEPPER_KERNELS_H
+
+#include "stepper.h"
+#include "simd.h"
+#include "profile.h"
+
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+//ldoc on
+/**
+ * ## Step kernels
+ *
+ * The limiters and the step functions are written once, in this file,
+ * and compiled once for each kind of physics that we want to specialize
+ * on.  A translation unit that includes this file first defines
+ *
+ * - `KERNEL_NFIELD`: the number of fields, as an expression (this may
+ *   refer to the `nfield` argument of the step functions); and
+ * - `KERNEL_FLUX(FU, GU, U, ncell, field_stride, cell_stride)`: the flux
+ *   computation for a row (this may refer to the `flux` argument).
+ *
+ * and gets `static` definitions of `central2d_step`,
+ * `central2d_step_fluxed`, and `central2d_step_fused` (with the
+ * `central2d_step_t` signature), of `central2d_step_fused16`
+ * (with the `central2d_step16_t` signature), and of
+ * `central2d_step_fused_diag` (with the `central2d_stepd_t`
+ * signature).  The general solver in `stepper.c` uses the arguments,
+ * so it works for any physics through the function pointers; a
+ * physics module can instead use a constant field count and
+ * call its own flux function directly, so that the compiler can inline
+ * the flux computation and unroll the loops over fields.  See
+ * `central2d_set_kernels` for how such a specialization is installed.
+ * Each translation unit can only include this file once.
+ */
+
+#ifndef KERNEL_NFIELD
+#error "KERNEL_NFIELD must be defined before including stepper_kernels.h"
+#endif
+#ifndef KERNEL_FLUX
+#error "KERNEL_FLUX must be defined before including stepper_kernels.h"
+#endif
+
+
+/**
+ * ### Derivatives with limiters
+ *
+ * In order to advance the time step, we also need to estimate
+ * derivatives of the fluxes and the solution values at each cell.
+ * In order to maintain stability, we apply a limiter here.
+ *
+ * The minmod limiter *looks* like it should be expensive to computer,
+ * since superficially it seems to require a number of branches.
+ * We do something a little tricky, getting rid of the condition
+ * on the sign of the arguments using the `copysign` instruction.
+ * If the compiler does the "right" thing with `max` and `min`
+ * for floating point arguments (translating them to branch-free
+ * intrinsic operations), this implementation should be relatively fast.
+ */
+
+
+// Branch-free computation of minmod of two numbers times 2s
+static inline
+float xmin2s(float s, float a, float b) {
+    float sa = copysignf(s, a);
+    float sb = copysignf(s, b);
+    float abs_a = fabsf(a);
+    float abs_b = fabsf(b);
+    float min_abs = (abs_a < abs_b ? abs_a : abs_b);
+    return (sa+sb) * min_abs;
+}
+
+
+// Limited combined slope estimate
+static inline
+float limdiff(float um, float u0, float up) {
+    const float theta = 2.0;
+    const float quarter = 0.25;
+    float du1 = u0-um;   // Difference to left
+    float du2 = up-u0;   // Difference to right
+    float duc = up-um;   // Twice centered difference
+    return xmin2s( quarter, xmin2s(theta, du1, du2), duc );
+}
+
+
+/**
+ * The limiter is applied to whole rows at a time.  All three versions
+ * below (differences along a row, across rows with a stride, or
+ * between three separate rows) reduce to the same kernel on three
+ * shifted input arrays.  Besides the plain loop, which we leave to the
+ * compiler, there are explicitly vectorized kernels for each of the
+ * instruction sets in `simd.h`; these apply the same branch-free
+ * formulas lane by lane, using bit masks for `copysign` and `fabs`
+ * and the vector `min` instruction, so they give identical results.
+ * Any leftover cells at the end of a row go through the scalar loop
+ * (or through masked loads and stores with AVX-512).
+ */
+
+static
+void limited_deriv3_scalar(float* restrict du,
+                           const float* restrict um,
+                           const float* restrict u0,
+                           const float* restrict up,
+                           int ncell)
+{
+    for (int i = 0; i < ncell; ++i)
+        du[i] = limdiff(um[i], u0[i], up[i]);
+}
+
+
+#ifdef SIMD_X86
+
+SIMD_TARGET_AVX2 static inline
+__m256 xmin2s_avx2(__m256 s, __m256 a, __m256 b)
+{
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 sa = _mm256_or_ps(s, _mm256_and_ps(sign, a));
+    __m256 sb = _mm256_or_ps(s, _mm256_and_ps(sign, b));
+    __m256 abs_a = _mm256_andnot_ps(sign, a);
+    __m256 abs_b = _mm256_andnot_ps(sign, b);
+    __m256 min_abs = _mm256_min_ps(abs_a, abs_b);
+    return _mm256_mul_ps(_mm256_add_ps(sa, sb), min_abs);
+}
+
+
+SIMD_TARGET_AVX2 static
+void limited_deriv3_avx2(float* restrict du,
+                         const float* restrict um,
+                         const float* restrict u0,
+                         const float* restrict up,
+                         int ncell)
+{
+    const __m256 theta = _mm256_set1_ps(2.0f);
+    const __m256 quarter = _mm256_set1_ps(0.25f);
+    int i = 0;
+    for (; i+8 <= ncell; i += 8) {
+        __m256 vm = _mm256_loadu_ps(um+i);
+        __m256 v0 = _mm256_loadu_ps(u0+i);
+        __m256 vp = _mm256_loadu_ps(up+i);
+        __m256 du1 = _mm256_sub_ps(v0, vm);
+        __m256 du2 = _mm256_sub_ps(vp, v0);
+        __m256 duc = _mm256_sub_ps(vp, vm);
+        _mm256_storeu_ps(du+i, xmin2s_avx2(quarter,
+                                           xmin2s_avx2(theta, du1, du2),
+                                           duc));
+    }
+    limited_deriv3_scalar(du+i, um+i, u0+i, up+i, ncell-i);
+}
+
+
+SIMD_TARGET_AVX512 static inline
+__m512 xmin2s_avx512(__m512 s, __m512 a, __m512 b)
+{
+    const __m512i sign = _mm512_set1_epi32((int) 0x80000000);
+    __m512i si = _mm512_castps_si512(s);
+    __m512 sa = _mm512_castsi512_ps(
+        _mm512_or_epi32(si, _mm512_and_epi32(sign, _mm512_castps_si512(a))));
+    __m512 sb = _mm512_castsi512_ps(
+        _mm512_or_epi32(si, _mm512_and_epi32(sign, _mm512_castps_si512(b))));
+    __m512 min_abs = _mm512_min_ps(_mm512_abs_ps(a), _mm512_abs_ps(b));
+    return _mm512_mul_ps(_mm512_add_ps(sa, sb), min_abs);
+}
+
+
+SIMD_TARGET_AVX512 static
+void limited_deriv3_avx512(float* restrict du,
+                           const float* restrict um,
+                           const float* restrict u0,
+                           const float* restrict up,
+                           int ncell)
+{
+    const __m512 theta = _mm512_set1_ps(2.0f);
+    const __m512 quarter = _mm512_set1_ps(0.25f);
+    for (int i = 0; i < ncell; i += 16) {
+        __mmask16 m = (ncell-i >= 16 ? 0xFFFF :
+                       (__mmask16) ((1u << (ncell-i)) - 1));
+        __m512 vm = _mm512_maskz_loadu_ps(m, um+i);
+        __m512 v0 = _mm512_maskz_loadu_ps(m, u0+i);
+        __m512 vp = _mm512_maskz_loadu_ps(m, up+i);
+        __m512 du1 = _mm512_sub_ps(v0, vm);
+        __m512 du2 = _mm512_sub_ps(vp, v0);
+        __m512 duc = _mm512_sub_ps(vp, vm);
+        _mm512_mask_storeu_ps(du+i, m,
+                              xmin2s_avx512(quarter,
+                                            xmin2s_avx512(theta, du1, du2),
+                                            duc));
+    }
+}
+
+#endif /* SIMD_X86 */
+
+
+#ifdef SIMD_NEON_ENABLED
+
+static inline
+float32x4_t xmin2s_neon(float32x4_t s, float32x4_t a, float32x4_t b)
+{
+    const uint32x4_t sign = vdupq_n_u32(0x80000000u);
+    uint32x4_t si = vreinterpretq_u32_f32(s);
+    float32x4_t sa = vreinterpretq_f32_u32(
+        vorrq_u32(si, vandq_u32(sign, vreinterpretq_u32_f32(a))));
+    float32x4_t sb = vreinterpretq_f32_u32(
+        vorrq_u32(si, vandq_u32(sign, vreinterpretq_u32_f32(b))));
+    float32x4_t abs_a = vabsq_f32(a);
+    float32x4_t abs_b = vabsq_f32(b);
+    float32x4_t min_abs = vbslq_f32(vcltq_f32(abs_a, abs_b), abs_a, abs_b);
+    return vmulq_f32(vaddq_f32(sa, sb), min_abs);
+}
+
+
+static
+void limited_deriv3_neon(float* restrict du,
+                         const float* restrict um,
+                         const float* restrict u0,
+                         const float* restrict up,
+                         int ncell)
+{
+    const float32x4_t theta = vdupq_n_f32(2.0f);
+    const float32x4_t quarter = vdupq_n_f32(0.25f);
+    int i = 0;
+    for (; i+4 <= ncell; i += 4) {
+        float32x4_t vm = vld1q_f32(um+i);
+        float32x4_t v0 = vld1q_f32(u0+i);
+        float32x4_t vp = vld1q_f32(up+i);
+        float32x4_t du1 = vsubq_f32(v0, vm);
+        float32x4_t du2 = vsubq_f32(vp, v0);
+        float32x4_t duc = vsubq_f32(vp, vm);
+        vst1q_f32(du+i, xmin2s_neon(quarter,
+                                    xmin2s_neon(theta, du1, du2),
+                                    duc));
+    }
+    limited_deriv3_scalar(du+i, um+i, u0+i, up+i, ncell-i);
+}
+
+#endif /* SIMD_NEON_ENABLED */
+
+
+// Compute limited derivs from three separate rows
+static inline
+void limited_deriv3(float* restrict du,
+                    const float* restrict um,
+                    const float* restrict u0,
+                    const float* restrict up,
+                    int ncell)
+{
+    switch (simd_level()) {
+#ifdef SIMD_X86
+    case SIMD_AVX512:
+        limited_deriv3_avx512(du, um, u0, up, ncell);
+        return;
+    case SIMD_AVX2:
+        limited_deriv3_avx2(du, um, u0, up, ncell);
+        return;
+#endif
+#ifdef SIMD_NEON_ENABLED
+    case SIMD_NEON:
+        limited_deriv3_neon(du, um, u0, up, ncell);
+        return;
+#endif
+    default:
+        limited_deriv3_scalar(du, um, u0, up, ncell);
+    }
+}
+
+
+// Compute limited derivs from three rows with cell stride cs
+static inline
+void limited_deriv3s(float* restrict du,
+                     const float* restrict um,
+                     const float* restrict u0,
+                     const float* restrict up,
+                     int ncell, int cs)
+{
+    if (cs == 1) {
+        limited_deriv3(du, um, u0, up, ncell);
+        return;
+    }
+    for (int i = 0; i < ncell; ++i)
+        du[i] = limdiff(um[i*cs], u0[i*cs], up[i*cs]);
+}
+
+
+// Compute limited derivs
+static inline
+void limited_deriv1(float* restrict du,
+                    const float* restrict u,
+                    int ncell, int cs)
+{
+    limited_deriv3s(du, u-cs, u, u+cs, ncell, cs);
+}
+
+
+// Compute limited derivs across stride
+static inline
+void limited_derivk(float* restrict du,
+                    const float* restrict u,
+                    int ncell, int stride, int cs)
+{
+    limited_deriv3s(du, u-stride, u, u+stride, ncell, cs);
+}
+
+
+/**
+ * ### Row sums
+ *
+ * The diagnostics (see `central2d_diagnostics`) add up rows with a
+ * pairwise sum.  Runs of up to 32 values are added into four double
+ * precision accumulators, which the compiler can keep in a vector
+ * register, and longer rows are split in half.  The same function is
+ * used when the sums are computed in the step and when they are
+ * computed separately, so the results agree.
+ */
+
+static inline
+double central2d_row_sum(const float* restrict x, int n, int cs)
+{
+    if (n > 32) {
+        int m = n/2;
+        return central2d_row_sum(x, m, cs) +
+            central2d_row_sum(x + m*cs, n-m, cs);
+    }
+    double s[4] = {0, 0, 0, 0};
+    int i = 0;
+    for (; i+4 <= n; i += 4)
+        for (int j = 0; j < 4; ++j)
+            s[j] += x[(i+j)*cs];
+    for (; i < n; ++i)
+        s[i%4] += x[i*cs];
+    return (s[0]+s[1]) + (s[2]+s[3]);
+}
+
+
+/**
+ * ### Advancing a time step
+ *
+ * Take one step of the numerical scheme.  This consists of two pieces:
+ * a first-order corrector computed at a half time step, which is used
+ * to obtain new $F$ and $G$ values; and a corrector step that computes
+ * the solution at the full step.  For full details, we refer to the
+ * [Jiang and Tadmor paper][jt].
+ *
+ * The `compute_step` function takes two arguments: the `io` flag
+ * which is the time step modulo 2 (0 if even, 1 if odd); and the `dt`
+ * flag, which actually determines the time step length.  We need
+ * to know the even-vs-odd distinction because the Jiang-Tadmor
+ * scheme alternates between a primary grid (on even steps) and a
+ * staggered grid (on odd steps).  This means that the data at $(i,j)$
+ * in an even step and the data at $(i,j)$ in an odd step represent
+ * values at different locations in space, offset by half a space step
+ * in each direction.  Every other step, we shift things back by one
+ * mesh cell in each direction, essentially resetting to the primary
+ * indexing scheme.
+ *
+ * We're slightly tricky in the corrector in that we write
+ * $$
+ *   v(i,j) = (s(i+1,j) + s(i,j)) - (d(i+1,j)-d(i,j))
+ * $$
+ * where $s(i,j)$ comprises the $u$ and $x$-derivative terms in the
+ * update formula, and $d(i,j)$ the $y$-derivative terms.  This cuts
+ * the arithmetic cost a little (not that it's that big to start).
+ * It also makes it more obvious that we only need four rows worth
+ * of scratch space.
+ */
+
+
+// Predictor half-step
+static
+void central2d_predict(float* restrict v,
+                       float* restrict scratch,
+                       const float* restrict u,
+                       const float* restrict f,
+                       const float* restrict g,
+                       float dtcdx2, float dtcdy2,
+                       int nx, int ny, int s, int fs, int cs, int nfield)
+{
+    float* restrict fx = scratch;
+    float* restrict gy = scratch+nx;
+    for (int k = 0; k < KERNEL_NFIELD; ++k) {
+        for (int iy = 1; iy < ny-1; ++iy) {
+            int offset = k*fs+iy*s+cs;
+            limited_deriv1(fx+1, f+offset, nx-2, cs);
+            limited_derivk(gy+1, g+offset, nx-2, s, cs);
+            for (int ix = 1; ix < nx-1; ++ix) {
+                int offset = k*fs+iy*s+ix*cs;
+                v[offset] = u[offset] - dtcdx2 * fx[ix] - dtcdy2 * gy[ix];
+            }
+        }
+    }
+}
+
+
+// Corrector
+static
+void central2d_correct_sd(float* restrict s,
+                          float* restrict d,
+                          const float* restrict ux,
+                          const float* restrict uy,
+                          const float* restrict u,
+                          const float* restrict f,
+                          const float* restrict g,
+                          float dtcdx2, float dtcdy2,
+                          int xlo, int xhi, int cs)
+{
+    for (int ix = xlo; ix < xhi; ++ix)
+        s[ix] =
+            0.2500f * (u [ix*cs] + u [(ix+1)*cs]) +
+            0.0625f * (ux[ix] - ux[ix+1]) +
+            dtcdx2  * (f [ix*cs] - f [(ix+1)*cs]);
+    for (int ix = xlo; ix < xhi; ++ix)
+        d[ix] =
+            0.0625f * (uy[ix] + uy[ix+1]) +
+            dtcdy2  * (g [ix*cs] + g [(ix+1)*cs]);
+}
+
+
+// Corrector
+static
+void central2d_correct(float* restrict v,
+                       float* restrict scratch,
+                       const float* restrict u,
+                       const float* restrict f,
+                       const float* restrict g,
+                       float dtcdx2, float dtcdy2,
+                       int xlo, int xhi, int ylo, int yhi,
+                       int nx, int ny, int s, int fs, int cs, int nfield)
+{
+    assert(0 <= xlo && xlo < xhi && xhi <= nx);
+    assert(0 <= ylo && ylo < yhi && yhi <= ny);
+
+    float* restrict ux = scratch;
+    float* restrict uy = scratch +   nx;
+    float* restrict s0 = scratch + 2*nx;
+    float* restrict d0 = scratch + 3*nx;
+    float* restrict s1 = scratch + 4*nx;
+    float* restrict d1 = scratch + 5*nx;
+
+    for (int k = 0; k < KERNEL_NFIELD; ++k) {
+
+        float*       restrict vk = v + k*fs;
+        const float* restrict uk = u + k*fs;
+        const float* restrict fk = f + k*fs;
+        const float* restrict gk = g + k*fs;
+
+        limited_deriv1(ux+1, uk+ylo*s+cs, nx-2, cs);
+        limited_derivk(uy+1, uk+ylo*s+cs, nx-2, s, cs);
+        central2d_correct_sd(s1, d1, ux, uy,
+                             uk + ylo*s, fk + ylo*s, gk + ylo*s,
+                             dtcdx2, dtcdy2, xlo, xhi, cs);
+
+        for (int iy = ylo; iy < yhi; ++iy) {
+
+            float* tmp;
+            tmp = s0; s0 = s1; s1 = tmp;
+            tmp = d0; d0 = d1; d1 = tmp;
+
+            limited_deriv1(ux+1, uk+(iy+1)*s+cs, nx-2, cs);
+            limited_derivk(uy+1, uk+(iy+1)*s+cs, nx-2, s, cs);
+            central2d_correct_sd(s1, d1, ux, uy,
+                                 uk + (iy+1)*s, fk + (iy+1)*s, gk + (iy+1)*s,
+                                 dtcdx2, dtcdy2, xlo, xhi, cs);
+
+            for (int ix = xlo; ix < xhi; ++ix)
+                vk[iy*s+ix*cs] = (s1[ix]+s0[ix])-(d1[ix]-d0[ix]);
+        }
+    }
+}
+
+
+/**
+ * The `central2d_step` function works on a rectangular window of
+ * a larger array: the window has `nx` by `ny` real cells and `ng`
+ * ghost cells on each side, starting at `u`, with rows separated
+ * by the stride `s`, fields separated by the stride `fs`, and cells
+ * separated by the stride `cs`.  For the full grid in the field-major
+ * layout, `s = nx+2*ng`, `fs = s*(ny+2*ng)`, and `cs = 1`, but
+ * the tiled solvers below also use the same code to advance pieces
+ * of the grid.  The `f`, `g`, and `v` arrays are indexed just like `u`.
+ * The predicted values at the half step go into `vh` over the whole
+ * window; usually this is just `v` (which is overwritten by the corrector
+ * anyway), but callers that need to leave everything but the real cells
+ * of `v` untouched can provide separate storage.
+ */
+
+/**
+ * The reference step is split in two, so that callers that have
+ * already computed the fluxes at the start of the step (along with the
+ * wave speeds; see `central2d_set_flux_speed`) can skip the first pass.
+ */
+
+static
+void central2d_step_fluxed(float* restrict u, float* v, float* vh,
+                           float* restrict scratch,
+                           float* restrict f,
+                           float* restrict g,
+                           int io, int nx, int ny, int ng,
+                           int s, int fs, int cs,
+                           int nfield, flux_t flux,
+                           float dt, float dx, float dy)
+{
+    int nx_all = nx + 2*ng;
+    int ny_all = ny + 2*ng;
+
+    float dtcdx2 = 0.5 * dt / dx;
+    float dtcdy2 = 0.5 * dt / dy;
+
+    PROFILE_BEGIN(predict);
+    central2d_predict(vh, scratch, u, f, g, dtcdx2, dtcdy2,
+                      nx_all, ny_all, s, fs, cs, nfield);
+    PROFILE_END(PROFILE_PREDICT, predict, (nx_all-2.0)*(ny_all-2));
+
+    // Flux values of f and g at half step
+    PROFILE_BEGIN(flux_mark);
+    for (int iy = 1; iy < ny_all-1; ++iy) {
+        int jj = iy*s+cs;
+        KERNEL_FLUX(f+jj, g+jj, vh+jj, nx_all-2, fs, cs);
+    }
+    PROFILE_END(PROFILE_FLUX, flux_mark, (nx_all-2.0)*(ny_all-2));
+
+    PROFILE_BEGIN(correct);
+    central2d_correct(v+io*(s+cs), scratch, u, f, g, dtcdx2, dtcdy2,
+                      ng-io, nx+ng-io,
+                      ng-io, ny+ng-io,
+                      nx_all, ny_all, s, fs, cs, nfield);
+    PROFILE_END(PROFILE_CORRECT, correct, (double) nx*ny);
+}
+
+
+static
+void central2d_step(float* restrict u, float* v, float* vh,
+                    float* restrict scratch,
+                    float* restrict f,
+                    float* restrict g,
+                    int io, int nx, int ny, int ng,
+                    int s, int fs, int cs,
+                    int nfield, flux_t flux,
+                    float dt, float dx, float dy)
+{
+    int nx_all = nx + 2*ng;
+    int ny_all = ny + 2*ng;
+    PROFILE_BEGIN(flux_mark);
+    for (int iy = 0; iy < ny_all; ++iy)
+        KERNEL_FLUX(f+iy*s, g+iy*s, u+iy*s, nx_all, fs, cs);
+    PROFILE_END(PROFILE_FLUX, flux_mark, (double) nx_all*ny_all);
+    central2d_step_fluxed(u, v, vh, scratch, f, g,
+                          io, nx, ny, ng, s, fs, cs,
+                          nfield, flux, dt, dx, dy);
+}
+
+
+/**
+ * ### Fused step
+ *
+ * The reference step above makes several passes over the whole window
+ * (fluxes, predictor, half-step fluxes, and corrector), each of which
+ * streams all of `u`, `v`, `f`, and `g` through memory.  For large grids,
+ * this makes the step memory bound.  The fused step computes the same
+ * values, but it sweeps through the window one row at a time, keeping
+ * only the few rows of intermediate data that the stencils need:
+ * rolling windows of three rows of the solution and of the fluxes (for
+ * the $y$ derivatives), the current row of half-step values and fluxes,
+ * and two rows of the $s$ and $d$ terms in the corrector.  These all live
+ * in the scratch space, so `u` is read and `v` is written about once
+ * per step, and `f`, `g`, and `vh` are not used at all.  The arithmetic
+ * is done in the same order as in the reference step, so the results
+ * are identical.
+ *
+ * The flux function needs the fields of its input and outputs to be
+ * separated by the same stride, so we copy each row of `u` into
+ * scratch before computing the fluxes.  All the computations on a row
+ * then use this copy, which has the fields one after the other; so
+ * apart from the copy in and the write of the results, the sweep does
+ * not depend on the storage layout.
+ *
+ * For the same reason, it is easy to keep the solution in a 16-bit
+ * format (see `half.h`): we widen the rows as we copy them in, and
+ * narrow the results as we write them out.  The sweep takes either the
+ * single precision arrays `u` and `v` or the 16-bit arrays `u16` and
+ * `v16` (the others are `NULL`); it is inlined into the step functions
+ * below with these arguments and the format fixed, so that the tests
+ * on them are resolved at compile time.
+ *
+ * In the same way, when `rowsum` is not `NULL` (with single precision
+ * storage), the sweep adds up each row of each field of its output as
+ * it writes it, putting the sum for row `iy` of field `k` in
+ * `rowsum[k*ny+iy]`, and updates the running minimum and maximum of
+ * field 0 in `range`.
+ */
+
+static inline
+void central2d_fused_sweep(const float* restrict u, float* v,
+                           const uint16_t* restrict u16, uint16_t* v16,
+                           half_format_t format,
+                           double* restrict rowsum, float* restrict range,
+                           float* restrict scratch,
+                           int io, int nx, int ny, int ng,
+                           int s, int fs, int cs,
+                           int nfield, flux_t flux,
+                           float dt, float dx, float dy)
+{
+    int nx_all = nx + 2*ng;
+    int nr = KERNEL_NFIELD * nx_all;
+
+    float dtcdx2 = 0.5 * dt / dx;
+    float dtcdy2 = 0.5 * dt / dy;
+
+    int xlo = ng-io, xhi = nx+ng-io;
+    int ylo = ng-io, yhi = ny+ng-io;
+
+    float* restrict fr = scratch;        // Flux rows (three row ring)
+    float* restrict gr = fr + 3*nr;
+    float* restrict ur = gr + 3*nr;      // Copies of rows of u (ring)
+    float* restrict vr = ur + 3*nr;      // Half-step values
+    float* restrict fh = vr + nr;        // Half-step fluxes
+    float* restrict gh = fh + nr;
+    float* restrict sr = gh + nr;        // Corrector terms (two row ring)
+    float* restrict dr = sr + 2*nr;
+    float* restrict ux = dr + 2*nr;
+    float* restrict uy = ux + nx_all;
+    float* restrict fx = uy + nx_all;
+    float* restrict gy = fx + nx_all;
+
+    for (int iy = ylo-1; iy <= yhi+1; ++iy) {
+
+        // Copy of row iy and its fluxes (at the start of the step)
+        float* restrict ui = ur + (iy%3)*nr;
+        for (int k = 0; k < KERNEL_NFIELD; ++k) {
+            if (u16) {
+                half_to_float(ui + k*nx_all, u16 + k*fs + iy*s,
+                              nx_all, cs, format);
+                continue;
+            }
+            const float* restrict uk = u + k*fs + iy*s;
+            if (cs == 1)
+                memcpy(ui + k*nx_all, uk, nx_all * sizeof(float));
+            else
+                for (int ix = 0; ix < nx_all; ++ix)
+                    ui[k*nx_all+ix] = uk[ix*cs];
+        }
+        PROFILE_BEGIN(flux_mark);
+        KERNEL_FLUX(fr + (iy%3)*nr, gr + (iy%3)*nr, ui, nx_all, nx_all, 1);
+        PROFILE_END(PROFILE_FLUX, flux_mark, nx_all);
+
+        // Everything else for row r = iy-1 (once we have fluxes above it)
+        int r = iy-1;
+        if (r < ylo)
+            continue;
+
+        float* restrict um = ur + ((r-1)%3)*nr;
+        float* restrict u0 = ur + (r%3)*nr;
+        float* restrict up = ur + ((r+1)%3)*nr;
+        float* restrict f0 = fr + (r%3)*nr;
+        float* restrict gm = gr + ((r-1)%3)*nr;
+        float* restrict g0 = gr + (r%3)*nr;
+        float* restrict gp = gr + ((r+1)%3)*nr;
+        PROFILE_BEGIN(predict);
+        for (int k = 0; k < KERNEL_NFIELD; ++k) {
+            const float* restrict uk = u0 + k*nx_all;
+            float* restrict vk = vr + k*nx_all;
+            int o = k*nx_all+1;
+            limited_deriv1(fx+1, f0+o, nx_all-2, 1);
+            limited_deriv3(gy+1, gm+o, g0+o, gp+o, nx_all-2);
+            for (int ix = 1; ix < nx_all-1; ++ix)
+                vk[ix] = uk[ix] - dtcdx2 * fx[ix] - dtcdy2 * gy[ix];
+        }
+        PROFILE_END(PROFILE_PREDICT, predict, nx_all-2);
+        PROFILE_BEGIN(flux_half);
+        KERNEL_FLUX(fh+1, gh+1, vr+1, nx_all-2, nx_all, 1);
+        PROFILE_END(PROFILE_FLUX, flux_half, nx_all-2);
+
+        float* restrict s1 = sr + (r%2)*nr;
+        float* restrict d1 = dr + (r%2)*nr;
+        float* restrict s0 = sr + ((r+1)%2)*nr;
+        float* restrict d0 = dr + ((r+1)%2)*nr;
+        PROFILE_BEGIN(correct);
+        for (int k = 0; k < KERNEL_NFIELD; ++k) {
+            int o = k*nx_all;
+            limited_deriv1(ux+1, u0+o+1, nx_all-2, 1);
+            limited_deriv3(uy+1, um+o+1, u0+o+1, up+o+1, nx_all-2);
+            central2d_correct_sd(s1+o, d1+o, ux, uy,
+                                 u0+o, fh+o, gh+o,
+                                 dtcdx2, dtcdy2, xlo, xhi, 1);
+            if (r > ylo && v16) {
+                // Narrow the results through ux (which is free for now)
+                for (int ix = xlo; ix < xhi; ++ix)
+                    ux[ix] = (s1[o+ix]+s0[o+ix])-(d1[o+ix]-d0[o+ix]);
+                half_from_float(v16 + k*fs + (r-1+io)*s + (xlo+io)*cs,
+                                ux + xlo, xhi-xlo, cs, format);
+            } else if (r > ylo && rowsum) {
+                float* restrict vk = v + k*fs + (r-1+io)*s + io*cs;
+                for (int ix = xlo; ix < xhi; ++ix)
+                    ux[ix] = (s1[o+ix]+s0[o+ix])-(d1[o+ix]-d0[o+ix]);
+                for (int ix = xlo; ix < xhi; ++ix)
+                    vk[ix*cs] = ux[ix];
+                rowsum[k*(yhi-ylo) + r-1-ylo] =
+                    central2d_row_sum(ux+xlo, xhi-xlo, 1);
+                for (int ix = xlo; k == 0 && ix < xhi; ++ix) {
+                    range[0] = fminf(range[0], ux[ix]);
+                    range[1] = fmaxf(range[1], ux[ix]);
+                }
+            } else if (r > ylo) {
+                float* restrict vk = v + k*fs + (r-1+io)*s + io*cs;
+                for (int ix = xlo; ix < xhi; ++ix)
+                    vk[ix*cs] = (s1[o+ix]+s0[o+ix])-(d1[o+ix]-d0[o+ix]);
+            }
+        }
+        PROFILE_END(PROFILE_CORRECT, correct, (r > ylo ? xhi-xlo : 0));
+    }
+}
+
+
+static
+void central2d_step_fused(float* restrict u, float* v, float* vh,
+                          float* restrict scratch,
+                          float* restrict f,
+                          float* restrict g,
+                          int io, int nx, int ny, int ng,
+                          int s, int fs, int cs,
+                          int nfield, flux_t flux,
+                          float dt, float dx, float dy)
+{
+    central2d_fused_sweep(u, v, NULL, NULL, HALF_FP16, NULL, NULL, scratch,
+                          io, nx, ny, ng, s, fs, cs,
+                          nfield, flux, dt, dx, dy);
+}
+
+
+static
+void central2d_step_fused16(const uint16_t* restrict u, uint16_t* v,
+                            float* restrict scratch,
+                            int io, int nx, int ny, int ng,
+                            int s, int fs, int cs,
+                            int nfield, flux_t flux,
+                            float dt, float dx, float dy,
+                            half_format_t format)
+{
+    if (format == HALF_BF16)
+        central2d_fused_sweep(NULL, NULL, u, v, HALF_BF16, NULL, NULL,
+                              scratch,
+                              io, nx, ny, ng, s, fs, cs,
+                              nfield, flux, dt, dx, dy);
+    else
+        central2d_fused_sweep(NULL, NULL, u, v, HALF_FP16, NULL, NULL,
+                              scratch,
+                              io, nx, ny, ng, s, fs, cs,
+                              nfield, flux, dt, dx, dy);
+}
+
+
+
+static
+void central2d_step_fused_diag(float* restrict u, float* v,
+                               float* restrict scratch,
+                               int io, int nx, int ny, int ng,
+                               int s, int fs, int cs,
+                               int nfield, flux_t flux,
+                               float dt, float dx, float dy,
+                               double* rowsum, float* range)
+{
+    central2d_fused_sweep(u, v, NULL, NULL, HALF_FP16, rowsum, range,
+                          scratch, io, nx, ny, ng, s, fs, cs,
+                          nfield, flux, dt, dx, dy);
+}
+
+
+//ldoc off
+#endif /* STEPPER_KERNELS_H */
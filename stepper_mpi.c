@@ -0,0 +1,399 @@
+#include "stepper_mpi.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <stdbool.h>
+
+//ldoc on
+/**
+ * ## Distributed memory implementation
+ *
+ * ### Decomposition
+ *
+ * We let MPI pick a balanced two-dimensional process grid and split the
+ * cells as evenly as possible, in the same way as the tiled solver:
+ * process column `i` of `p` owns the cells `(i*nx)/p <= ix < ((i+1)*nx)/p`.
+ */
+
+static inline
+int partition_start(int i, int n, int p)
+{
+    return (int) (((long) i * n) / p);
+}
+
+
+/**
+ * ### Ghost cell exchange
+ *
+ * Each rank exchanges data with eight neighbors (the corner neighbors
+ * are needed to fill the corner ghost cells in a single round of
+ * messages).  We number the directions `(dx,dy)` with `dx,dy` in
+ * {-1,0,1} in row-major order, skipping the center, so that direction
+ * `7-n` is opposite to direction `n`.  A message sent in direction `n`
+ * is tagged with `n`, and the neighbor receives it as coming from
+ * direction `7-n`.  The send and receive regions are described by MPI
+ * derived datatypes over the solution array, so there is no explicit
+ * packing.  We build the types from the solver's strides, so they work
+ * for any storage layout (and with padded strides): a region of `nk`
+ * fields by `ny` rows by `nx` cells, starting at field zero and at
+ * row `y0` and cell `x0` counted from the corner of the ghost cells.
+ */
+
+static
+void region_type(central2d_t* sim, int nk, int y0, int ny,
+                 int x0, int nx, MPI_Datatype* type)
+{
+    MPI_Aint fsize = sizeof(float);
+    MPI_Datatype row, rows, fields;
+    MPI_Type_vector(nx, 1, sim->cell_stride, MPI_FLOAT, &row);
+    MPI_Type_create_hvector(ny, 1, sim->row_stride * fsize, row, &rows);
+    MPI_Type_create_hvector(nk, 1, sim->field_stride * fsize, rows, &fields);
+    int one = 1;
+    MPI_Aint disp = ((MPI_Aint) y0 * sim->row_stride +
+                     (MPI_Aint) x0 * sim->cell_stride) * fsize;
+    MPI_Type_create_hindexed(1, &one, &disp, fields, type);
+    MPI_Type_commit(type);
+    MPI_Type_free(&row);
+    MPI_Type_free(&rows);
+    MPI_Type_free(&fields);
+}
+
+
+static
+void exchange_range(int d, int n, int ng, int* send_lo, int* recv_lo, int* len)
+{
+    if (d < 0) {
+        *send_lo = ng;
+        *recv_lo = 0;
+        *len = ng;
+    } else if (d > 0) {
+        *send_lo = n;
+        *recv_lo = n+ng;
+        *len = ng;
+    } else {
+        *send_lo = ng;
+        *recv_lo = ng;
+        *len = n;
+    }
+}
+
+
+static
+void exchange_types(central2d_mpi_t* msim)
+{
+    central2d_t* sim = msim->sim;
+    int ng = sim->ng;
+    int n = 0;
+    for (int dy = -1; dy <= 1; ++dy)
+        for (int dx = -1; dx <= 1; ++dx) {
+            if (dx == 0 && dy == 0)
+                continue;
+            int sx, rx, lx, sy, ry, ly;
+            exchange_range(dx, sim->nx, ng, &sx, &rx, &lx);
+            exchange_range(dy, sim->ny, ng, &sy, &ry, &ly);
+            region_type(sim, sim->nfield, sy, ly, sx, lx, &msim->send[n]);
+            region_type(sim, sim->nfield, ry, ly, rx, lx, &msim->recv[n]);
+
+            int coords[2] = {msim->coords[0]+dy, msim->coords[1]+dx};
+            MPI_Cart_rank(msim->comm, coords, &msim->nbr[n]);
+            ++n;
+        }
+}
+
+
+static
+void exchange_start(central2d_mpi_t* msim)
+{
+    float* u = msim->sim->u;
+    for (int n = 0; n < 8; ++n)
+        MPI_Irecv(u, 1, msim->recv[n], msim->nbr[n], 7-n,
+                  msim->comm, &msim->reqs[n]);
+    for (int n = 0; n < 8; ++n)
+        MPI_Isend(u, 1, msim->send[n], msim->nbr[n], n,
+                  msim->comm, &msim->reqs[8+n]);
+}
+
+
+static
+void exchange_finish(central2d_mpi_t* msim)
+{
+    MPI_Waitall(16, msim->reqs, MPI_STATUSES_IGNORE);
+}
+
+
+/**
+ * ### Structure allocation
+ */
+
+central2d_mpi_t* central2d_mpi_init(MPI_Comm comm,
+                                    float w, float h, int nx, int ny,
+                                    int nfield, flux_t flux, speed_t speed,
+                                    float cfl, central2d_layout_t layout,
+                                    int ng)
+{
+    central2d_mpi_t* msim = (central2d_mpi_t*) malloc(sizeof(central2d_mpi_t));
+
+    int nproc;
+    int periods[2] = {1, 1};
+    MPI_Comm_size(comm, &nproc);
+    msim->dims[0] = 0;
+    msim->dims[1] = 0;
+    MPI_Dims_create(nproc, 2, msim->dims);
+    if (nx > ny) {
+        int tmp = msim->dims[0];
+        msim->dims[0] = msim->dims[1];
+        msim->dims[1] = tmp;
+    }
+    MPI_Cart_create(comm, 2, msim->dims, periods, 1, &msim->comm);
+    MPI_Comm_rank(msim->comm, &msim->rank);
+    MPI_Cart_coords(msim->comm, msim->rank, 2, msim->coords);
+
+    int py = msim->dims[0], px = msim->dims[1];
+    int j = msim->coords[0], i = msim->coords[1];
+    msim->nx = nx;
+    msim->ny = ny;
+    msim->x0 = partition_start(i, nx, px);
+    msim->y0 = partition_start(j, ny, py);
+    int nxl = partition_start(i+1, nx, px) - msim->x0;
+    int nyl = partition_start(j+1, ny, py) - msim->y0;
+    if (ng < 4)
+        ng = 4;
+    assert(nxl >= 8 && nyl >= 8 && nxl >= ng && nyl >= ng);
+
+    central2d_t* sim = central2d_init_ghost(w, h, nxl, nyl, nfield,
+                                            flux, speed, cfl, layout, ng);
+    sim->dx = w/nx;
+    sim->dy = h/ny;
+    msim->sim = sim;
+    msim->u0 = sim->u;
+
+    msim->w = central2d_alloc_array(sim);
+
+    exchange_types(msim);
+
+    msim->viz_mem = MPI_DATATYPE_NULL;
+    msim->viz_file = MPI_DATATYPE_NULL;
+    msim->viz_frames = 0;
+    return msim;
+}
+
+
+void central2d_mpi_free(central2d_mpi_t* msim)
+{
+    central2d_t* sim = msim->sim;
+    if (sim->u != msim->u0) {
+        msim->w = sim->u;
+        sim->u = msim->u0;
+    }
+    central2d_free_array(sim, msim->w);
+    central2d_free(sim);
+    for (int n = 0; n < 8; ++n) {
+        MPI_Type_free(&msim->send[n]);
+        MPI_Type_free(&msim->recv[n]);
+    }
+    if (msim->viz_mem != MPI_DATATYPE_NULL) {
+        MPI_Type_free(&msim->viz_mem);
+        MPI_Type_free(&msim->viz_file);
+    }
+    MPI_Comm_free(&msim->comm);
+    free(msim);
+}
+
+
+/**
+ * ### Advancing the solution
+ *
+ * We overlap the ghost cell exchange with computation.  Once the
+ * nonblocking sends and receives are posted, we compute the local
+ * wave speeds and do the global reduction for the time step; then
+ * we advance the inner block of cells that are at least four cells
+ * from the edge of the local domain, since these do not depend on
+ * ghost cell data.  Only then do we wait for the exchange to finish
+ * and advance the four strips along the edges.  The new values go
+ * into the second array `w`, since the strips still need the old
+ * values near the edge of the inner block; at the end of the step
+ * pair, we swap the roles of `u` and `w`.
+ *
+ * With a deep halo of `ng` ghost cells, one exchange serves a batch of
+ * `ng/4` step pairs, as in the tiled solver.  Step pair `j` of a batch
+ * updates the real cells and `e = 4*(ng/4-1-j)` layers of ghost cells
+ * around them, which are all that the later pairs of the batch read;
+ * the strips along the edges extend out into the ghost cells to cover
+ * them.  Only the first pair of a batch overlaps the inner block with
+ * the exchange.  The wave speeds are still reduced for every pair.
+ *
+ * With lagged time steps (see `central2d_set_lagged_cfl`), the time
+ * step comes from the global wave speeds at the start of the pair
+ * before, and the reduction for this pair is a nonblocking all-reduce
+ * that goes on while we advance the grid.  We wait for it only at the
+ * end of the pair, before the swap; if the time step turns out to
+ * break the CFL condition, `u` still holds the start of the pair (with
+ * its ghost cells), so we take the pair again on every rank, all ranks
+ * having the same speeds to decide.
+ *
+ * The exchange always wraps around the edges of the domain.  With a
+ * non-periodic boundary condition on the local solver (see
+ * `central2d_set_bc`), the ranks along the sides where it applies
+ * overwrite their ghost cells on those sides once the exchange is
+ * done, and on the window `4+e` layers deep for the later pairs of the
+ * batch, before they advance the strips.
+ */
+
+// Sides of the global domain with a BC that this rank's block is on
+static
+int central2d_mpi_bc_sides(central2d_mpi_t* msim)
+{
+    int py = msim->dims[0], px = msim->dims[1];
+    int j = msim->coords[0], i = msim->coords[1];
+    int edges = (i == 0    ? CENTRAL2D_LEFT   : 0) |
+                (i == px-1 ? CENTRAL2D_RIGHT  : 0) |
+                (j == 0    ? CENTRAL2D_BOTTOM : 0) |
+                (j == py-1 ? CENTRAL2D_TOP    : 0);
+    return (msim->sim->bc ? msim->sim->bc_sides & edges : 0);
+}
+
+// Take a step pair from u into w on the real cells and e layers of
+// ghost cells, finishing the ghost cell exchange if one is going on
+static
+void central2d_mpi_step2(central2d_mpi_t* msim, int e, float dt,
+                         bool exchanging)
+{
+    central2d_t* sim = msim->sim;
+    int nx = sim->nx, ny = sim->ny;
+    float* w = msim->w;
+    if (nx > 8 && ny > 8)
+        central2d_step_block(sim, w, 4, 4, nx-8, ny-8, dt);
+    if (exchanging)
+        exchange_finish(msim);
+    int sides = central2d_mpi_bc_sides(msim);
+    if (sides) {
+        int s = sim->row_stride, fs = sim->field_stride, cs = sim->cell_stride;
+        sim->bc(sim->u + (sim->ng-4-e)*(s+cs), nx, ny, 4+e, sim->nfield,
+                s, fs, cs, sides);
+    }
+    central2d_step_block(sim, w, -e,   -e,   nx+2*e, 4+e, dt);
+    central2d_step_block(sim, w, -e,   ny-4, nx+2*e, 4+e, dt);
+    if (ny > 8) {
+        central2d_step_block(sim, w, -e,   4, 4+e, ny-8, dt);
+        central2d_step_block(sim, w, nx-4, 4, 4+e, ny-8, dt);
+    }
+}
+
+
+int central2d_mpi_run(central2d_mpi_t* msim, float tfinal)
+{
+    central2d_t* sim = msim->sim;
+    float dx = sim->dx, dy = sim->dy, cfl = sim->cfl;
+    int nbatch = sim->ng/4;
+    int nstep = 0;
+    bool done = false;
+    float t = 0, c = 0;
+    while (!done) {
+        exchange_start(msim);
+        for (int j = 0; j < nbatch && !done; ++j) {
+            int e = 4*(nbatch-1-j);
+            float lcxy[2] = {1.0e-15f, 1.0e-15f};
+            float cxy[2];
+            MPI_Request reduce;
+            float dt;
+            bool lagged = (sim->lag_safety > 0 && c > 0);
+            central2d_speed(sim, lcxy);
+            if (lagged) {
+                MPI_Iallreduce(lcxy, cxy, 2, MPI_FLOAT, MPI_MAX, msim->comm,
+                               &reduce);
+                dt = sim->lag_safety*cfl / c;
+            } else {
+                MPI_Allreduce(lcxy, cxy, 2, MPI_FLOAT, MPI_MAX, msim->comm);
+                c = fmaxf(cxy[0]/dx, cxy[1]/dy);
+                dt = cfl / c;
+            }
+            if (t + 2*dt >= tfinal) {
+                dt = (tfinal-t)/2;
+                done = true;
+            }
+
+            central2d_mpi_step2(msim, e, dt, j == 0);
+            if (lagged) {
+                MPI_Wait(&reduce, MPI_STATUS_IGNORE);
+                c = fmaxf(cxy[0]/dx, cxy[1]/dy);
+                if (dt*c > cfl) {
+                    dt = cfl / c;
+                    done = (t + 2*dt >= tfinal);
+                    if (done)
+                        dt = (tfinal-t)/2;
+                    central2d_mpi_step2(msim, e, dt, false);
+                    ++sim->nrollback;
+                }
+            }
+
+            float* w = msim->w;
+            msim->w = sim->u;
+            sim->u = w;
+            t += 2*dt;
+            nstep += 2;
+        }
+    }
+    return nstep;
+}
+
+
+/**
+ * ### Output
+ *
+ * Rank 0 writes the header; after that, each frame is a collective write
+ * in which every rank deposits its block of the height field directly
+ * from `sim->u` (the memory type skips the ghost cells and the other
+ * fields, and the file type places the block within the frame).
+ */
+
+MPI_File central2d_mpi_viz_open(central2d_mpi_t* msim, const char* fname)
+{
+    MPI_File fh;
+    if (MPI_File_open(msim->comm, (char*) fname,
+                      MPI_MODE_WRONLY | MPI_MODE_CREATE,
+                      MPI_INFO_NULL, &fh) != MPI_SUCCESS)
+        return MPI_FILE_NULL;
+    MPI_File_set_size(fh, 0);
+
+    central2d_t* sim = msim->sim;
+    if (msim->viz_mem == MPI_DATATYPE_NULL) {
+        int ng = sim->ng;
+        int fsizes[2] = {msim->ny, msim->nx};
+        int subsizes[2] = {sim->ny, sim->nx};
+        int fstarts[2] = {msim->y0, msim->x0};
+        region_type(sim, 1, ng, sim->ny, ng, sim->nx, &msim->viz_mem);
+        MPI_Type_create_subarray(2, fsizes, subsizes, fstarts,
+                                 MPI_ORDER_C, MPI_FLOAT, &msim->viz_file);
+        MPI_Type_commit(&msim->viz_file);
+    }
+    msim->viz_frames = 0;
+
+    if (msim->rank == 0) {
+        float xy[2] = {msim->nx, msim->ny};
+        MPI_File_write_at(fh, 0, xy, 2, MPI_FLOAT, MPI_STATUS_IGNORE);
+    }
+    return fh;
+}
+
+
+void central2d_mpi_viz_frame(central2d_mpi_t* msim, MPI_File fh)
+{
+    if (fh == MPI_FILE_NULL)
+        return;
+    MPI_Offset frame_size = (MPI_Offset) msim->nx * msim->ny * sizeof(float);
+    MPI_Offset disp = 2*sizeof(float) + msim->viz_frames * frame_size;
+    MPI_File_set_view(fh, disp, MPI_FLOAT, msim->viz_file,
+                      "native", MPI_INFO_NULL);
+    MPI_File_write_all(fh, msim->sim->u, 1, msim->viz_mem,
+                       MPI_STATUS_IGNORE);
+    ++msim->viz_frames;
+}
+
+
+void central2d_mpi_viz_close(MPI_File fh)
+{
+    if (fh != MPI_FILE_NULL)
+        MPI_File_close(&fh);
+}
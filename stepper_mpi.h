@@ -0,0 +1,94 @@
+#ifndef STEPPER_MPI_H
+#define STEPPER_MPI_H
+
+#include "stepper.h"
+#include <mpi.h>
+
+//ldoc on
+/**
+ * ## Distributed memory interface
+ *
+ * For grids that do not fit on one node, we decompose the domain in
+ * two dimensions over the ranks of an MPI communicator.  Each rank owns
+ * a rectangular block of the grid, which it stores in an ordinary
+ * `central2d_t` (the `sim` field).  The local solver has the global
+ * cell sizes, and its ghost cells are filled by exchanging data with
+ * the neighboring ranks rather than by `central2d_periodic`.  The
+ * global domain is periodic unless the local solver is given another
+ * boundary condition with `central2d_set_bc` (on every rank), which the
+ * ranks along the edges of the domain apply after the exchange.
+ *
+ * The local block on a rank covers global cells `x0 <= ix < x0+sim->nx`
+ * and `y0 <= iy < y0+sim->ny`; local cell `(ix,iy)` (in the sense of
+ * `central2d_offset`) is global cell `(x0+ix,y0+iy)`.  Every local block
+ * must be at least eight cells wide in each direction.
+ */
+typedef struct central2d_mpi_t {
+
+    MPI_Comm comm;     // Periodic Cartesian communicator
+    int rank;          // Rank in comm
+    int dims[2];       // Number of ranks in y/x
+    int coords[2];     // Position of this rank in the y/x process grid
+    int nx, ny;        // Global grid size (without ghost cells)
+    int x0, y0;        // Global index of first locally owned cell
+
+    central2d_t* sim;  // Local solver
+
+    // Ghost cell exchange
+    int nbr[8];              // Neighbor ranks
+    MPI_Datatype send[8];    // Real cells sent to each neighbor
+    MPI_Datatype recv[8];    // Ghost cells received from each neighbor
+    MPI_Request reqs[16];
+
+    // Storage
+    float* w;          // Second copy of the solution
+    float* u0;         // Original storage (we swap u and w in steps)
+
+    // Output (see central2d_mpi_viz_open)
+    MPI_Datatype viz_mem;    // Local height field in sim->u
+    MPI_Datatype viz_file;   // Local block in a frame
+    int viz_frames;          // Number of frames written
+
+} central2d_mpi_t;
+
+/**
+ * The constructor and destructor are collective over `comm`.
+ * The arguments other than `comm` are as in `central2d_init_ghost`;
+ * with `ng` ghost cells, the ranks exchange them once every `ng/4`
+ * step pairs (so every local block must have at least `ng` cells in
+ * each direction, too).
+ */
+central2d_mpi_t* central2d_mpi_init(MPI_Comm comm,
+                                    float w, float h, int nx, int ny,
+                                    int nfield, flux_t flux, speed_t speed,
+                                    float cfl, central2d_layout_t layout,
+                                    int ng);
+void central2d_mpi_free(central2d_mpi_t* msim);
+
+/**
+ * ### Running the simulation
+ *
+ * `central2d_mpi_run` is the collective counterpart of `central2d_run`.
+ * The time step is chosen from the global max wave speed, so all ranks
+ * take the same steps and the result agrees with the shared memory
+ * solver.  With lagged time steps (see `central2d_set_lagged_cfl` on
+ * the local solver), the all-reduce for each step pair overlaps the
+ * computation, and every rank takes the same pairs again when the
+ * check fails.
+ */
+int central2d_mpi_run(central2d_mpi_t* msim, float tfinal);
+
+/**
+ * ### Output
+ *
+ * The distributed solver writes the same file format as the `viz_frame`
+ * routine in the driver (a header with the grid dimensions followed
+ * by raw height fields), but it uses collective MPI-IO so that every
+ * rank writes its own block of each frame.
+ */
+MPI_File central2d_mpi_viz_open(central2d_mpi_t* msim, const char* fname);
+void central2d_mpi_viz_frame(central2d_mpi_t* msim, MPI_File fh);
+void central2d_mpi_viz_close(MPI_File fh);
+
+//ldoc off
+#endif /* STEPPER_MPI_H */
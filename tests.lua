@@ -36,4 +36,48 @@ wave = {
   nx = nx
 }
 
-simulate(_G[args[1]])
+-- Dam breaks on a non-square grid (with square cells), kept in each of
+-- the 16-bit storage formats between steps
+for _, fmt in ipairs({"fp16", "bf16"}) do
+  local ny = math.floor(nx*4/5)
+  _G["dam_" .. fmt] = {
+    init = function(x,y)
+      if (x-1)*(x-1) + (y-0.8)*(y-0.8) < 0.25 then
+        return 1.5, 0, 0
+      else
+        return 1, 0, 0
+      end
+    end,
+    out = "dam_" .. fmt .. ".out",
+    engine = "fused",
+    storage = fmt,
+    w = 2,
+    h = 2*ny/nx,
+    nx = nx,
+    ny = ny
+  }
+end
+
+-- Dam breaks with several radii, run together (see simulate_batch)
+sweep = {
+  out = "sweep.out",
+  frames = 20,
+  nx = nx
+}
+for i, r in ipairs({0.25, 0.5, 0.75}) do
+  sweep[i] = {
+    init = function(x,y)
+      if (x-1)*(x-1) + (y-1)*(y-1) < r*r then
+        return 1.5, 0, 0
+      else
+        return 1, 0, 0
+      end
+    end
+  }
+end
+
+if args[1] == "sweep" then
+  simulate_batch(sweep)
+else
+  simulate(_G[args[1]])
+end
@@ -13,7 +13,142 @@ matplotlib.use('Agg')
 import matplotlib.pyplot as plt
 from mpl_toolkits.mplot3d import Axes3D
 import matplotlib.animation as manimation
+import mmap
+import struct
 import sys
+import time
+import zlib
+
+
+class Frames(object):
+    """Common interface of the readers: iterate over one field of
+    every frame with frames()."""
+
+    def frames(self, k=0):
+        for i in range(self.nframe):
+            yield self.frame(i, k)
+
+
+class FrameFile(Frames):
+    """Random access reader for chunked frame files (see framefile.h).
+
+    The file is memory mapped, and only the chunks of the frames that
+    are asked for are read (and decompressed).
+    """
+
+    HEADER = struct.Struct('<8s6i2fq16x')
+
+    def __init__(self, fname):
+        with open(fname, 'rb') as f:
+            self.mm = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        (magic, self.nx, self.ny, self.nfield, self.codec, self.keep_bits,
+         self.nframe, self.dx, self.dy, index) = self.HEADER.unpack_from(self.mm)
+        if index == 0:
+            raise ValueError("{0} has no index (unfinished run?)".format(fname))
+        rec = struct.Struct('<d{0}q'.format(2*self.nfield))
+        self.times = []
+        self.chunks = []
+        for i in range(self.nframe):
+            entry = rec.unpack_from(self.mm, index + i*rec.size)
+            self.times.append(entry[0])
+            self.chunks.append(list(zip(entry[1::2], entry[2::2])))
+
+    def frame(self, i, k=0):
+        """Return field k of frame i as an ny-by-nx array."""
+        offset, nbytes = self.chunks[i][k]
+        n = self.nx * self.ny
+        if self.codec == 0:
+            u = np.frombuffer(self.mm, dtype='<f4', count=n, offset=offset)
+        else:
+            data = zlib.decompress(self.mm[offset:offset+nbytes])
+            planes = np.frombuffer(data, dtype=np.uint8).reshape(4, n)
+            u = np.ascontiguousarray(planes.T).view('<f4')
+        return u.reshape(self.ny, self.nx)
+
+
+class RawFile(Frames):
+    """Reader for the original output format (water height only)."""
+
+    def __init__(self, fname):
+        u = np.memmap(fname, dtype='<f4', mode='r')
+        self.nx = int(u[0])
+        self.ny = int(u[1])
+        self.nfield = 1
+        self.nframe = (len(u)-2) // (self.nx*self.ny)
+        self.u = u[2:2+self.nframe*self.nx*self.ny].reshape(
+            self.nframe, self.ny, self.nx)
+
+    def frame(self, i, k=0):
+        return self.u[i]
+
+
+class FrameRing(Frames):
+    """Live reader for a shared memory frame ring (see framering.h).
+
+    The simulator never waits for us, so frames() always moves on to
+    the newest frame published, skipping any that came out while the
+    last one was being drawn, and stops once the run is over.
+    """
+
+    HEADER = struct.Struct('<8s4i2fqqi12x')
+    SLOT = struct.Struct('<qd48x')
+
+    def __init__(self, fname, poll=0.05):
+        with open(fname, 'rb') as f:
+            self.mm = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        (magic, self.nx, self.ny, self.nfield, self.nslot, self.dx, self.dy,
+         self.slot_size, count, done) = self.HEADER.unpack_from(self.mm)
+        self.nframe = None
+        self.poll = poll
+
+    def state(self):
+        """Return the number of frames published and the done flag."""
+        return struct.unpack_from('<qi', self.mm, 40)
+
+    def read(self, n):
+        """Return (t, fields) for frame n, or None if that frame is not
+        in the ring (not published yet, or already overwritten)."""
+        offset = 64 + (n % self.nslot) * self.slot_size
+        seq, t = self.SLOT.unpack_from(self.mm, offset)
+        if seq != 2*n+2:
+            return None
+        start = offset + self.SLOT.size
+        data = self.mm[start:start + 4*self.nfield*self.nx*self.ny]
+        if struct.unpack_from('<q', self.mm, offset)[0] != seq:
+            return None
+        u = np.frombuffer(data, dtype='<f4')
+        return t, u.reshape(self.nfield, self.ny, self.nx)
+
+    def frame(self, i, k=0):
+        frame = self.read(i)
+        if frame is None:
+            raise IndexError("Frame {0} is not in the ring".format(i))
+        return frame[1][k]
+
+    def frames(self, k=0):
+        last = -1
+        while True:
+            count, done = self.state()
+            if count-1 > last:
+                frame = self.read(count-1)
+                if frame is not None:
+                    last = count-1
+                    yield frame[1][k]
+            elif done:
+                return
+            else:
+                time.sleep(self.poll)
+
+
+def open_frames(fname):
+    """Open a simulator output file in any format (or a frame ring)."""
+    with open(fname, 'rb') as f:
+        magic = f.read(8)
+    if magic == b'SWFRAME1':
+        return FrameFile(fname)
+    if magic == b'SWRING01':
+        return FrameRing(fname)
+    return RawFile(fname)
 
 
 def main(infile="waves.out", outfile="out.mp4", startpic="start.png"):
@@ -25,28 +160,27 @@ def main(infile="waves.out", outfile="out.mp4", startpic="start.png"):
         startpic: Name of picture generated at first frame
     """
 
-    u = np.fromfile(infile, dtype=np.dtype('f4'))
-    nx = int(u[0])
-    ny = int(u[1])
+    u = open_frames(infile)
+    nx = u.nx
+    ny = u.ny
     x = range(0,nx)
     y = range(0,ny)
-    u = u[2:]
-    nframe = len(u) // (nx*ny)
+    nframe = u.nframe
     stride = nx // 20
-    u = np.reshape(u, (nframe,nx,ny))
     X, Y = np.meshgrid(x,y)
 
     fig = plt.figure(figsize=(10,10))
 
-    def plot_frame(i, stride=5):
+    def plot_frame(Z, stride=5):
         ax = fig.add_subplot(111, projection='3d')
         ax.set_zlim(0, 2)
-        Z = u[i,:,:];
         ax.plot_surface(X, Y, Z, rstride=stride, cstride=stride)
         return ax
 
+    frames = u.frames()
+    Z = next(frames)
     if startpic:
-        ax = plot_frame(0)
+        ax = plot_frame(Z)
         plt.savefig(startpic)
         plt.delaxes(ax)
 
@@ -62,10 +196,11 @@ def main(infile="waves.out", outfile="out.mp4", startpic="start.png"):
         writer = Writer(fps=15, metadata=metadata)
 
     with writer.saving(fig, outfile, nframe):
-        for i in range(nframe):
-            ax = plot_frame(i)
+        while Z is not None:
+            ax = plot_frame(Z)
             writer.grab_frame()
             plt.delaxes(ax)
+            Z = next(frames, None)
 
 
 if __name__ == "__main__":